@@ -27,21 +27,103 @@
 #include "address.h"
 #include "setup.h"
 #include "vsfat.h"
+#include "pathtable.h"
 
 AddressRegion *address_regions;
 uint32_t address_regions_count;
 
+//Number of regions we have room for before the next realloc
+static uint32_t address_regions_capacity;
+//Search keys for address_region_find, kept apart from the regions so the
+//binary search only touches 8 bytes per region
+static uint64_t *address_region_ends;
+
 //Add an address region to the mapped address regions array
-void add_address_region(uint64_t base, uint64_t length, void *mem_pointer,
-                        char *file_path)
+void add_address_region(uint64_t base, uint32_t length, void *mem_pointer,
+                        uint32_t path)
 {
+    //Grow geometrically, a realloc per file gets expensive with big trees
+    if (address_regions_count == address_regions_capacity)
+    {
+        address_regions_capacity =
+            address_regions_capacity ? address_regions_capacity * 2 : 64;
+        address_regions = realloc(address_regions,
+                                  address_regions_capacity * sizeof(AddressRegion));
+    }
     address_regions_count++;
-    address_regions =
-        realloc(address_regions, address_regions_count * sizeof(AddressRegion));
     address_regions[address_regions_count - 1].base = base;
     address_regions[address_regions_count - 1].length = length;
+    address_regions[address_regions_count - 1].flags = 0;
     address_regions[address_regions_count - 1].mem_pointer = mem_pointer;
-    address_regions[address_regions_count - 1].file_path = file_path;
+    address_regions[address_regions_count - 1].path = path;
+}
+
+//Add a region whose contents are generated as they're read
+void add_generated_region(uint64_t base, uint32_t length,
+                          RegionGenerator *generator)
+{
+    add_address_region(base, length, generator, Path_None);
+    address_regions[address_regions_count - 1].flags = Region_Generated;
+}
+
+static int region_compare(const void *left, const void *right)
+{
+    const AddressRegion *l = left;
+    const AddressRegion *r = right;
+    if (l->base != r->base)
+    {
+        return l->base < r->base ? -1 : 1;
+    }
+    return 0;
+}
+
+//Sort the regions by address and build the lookup index
+//Has to be called after the last add_address_region and before any lookups
+void address_regions_index()
+{
+    //Directory clusters get allocated in between file clusters, so the regions
+    //are mostly but not entirely in order
+    qsort(address_regions, address_regions_count, sizeof(AddressRegion),
+          region_compare);
+    address_regions_capacity = address_regions_count;
+    address_regions = realloc(address_regions,
+                              address_regions_count * sizeof(AddressRegion));
+
+    //Each key is the furthest end of any region up to and including this one
+    //That keeps the keys sorted even if two regions were to overlap
+    address_region_ends = realloc(address_region_ends,
+                                  address_regions_count * sizeof(uint64_t));
+    uint64_t end = 0;
+    for (uint32_t a = 0; a < address_regions_count; a++)
+    {
+        if (address_regions[a].base + address_regions[a].length > end)
+        {
+            end = address_regions[a].base + address_regions[a].length;
+        }
+        address_region_ends[a] = end;
+    }
+}
+
+//Find the first region that ends after the given address
+//Every region that overlaps a read starting here is at or after this index
+//Returns address_regions_count if there isn't one
+uint32_t address_region_find(uint64_t address)
+{
+    uint32_t low = 0;
+    uint32_t high = address_regions_count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (address_region_ends[mid] > address)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+    return low;
 }
 
 //Return a memory address given a fat sector
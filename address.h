@@ -17,24 +17,46 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifndef ADDRESS_H_INCLUDED
+#define ADDRESS_H_INCLUDED
+
 #include <ctype.h>
 #include <stdint.h>
 
-void add_address_region(uint64_t base, uint64_t length,
-                        void *mem_pointer, char *file_path);
+void add_address_region(uint64_t base, uint32_t length,
+                        void *mem_pointer, uint32_t path);
+void address_regions_index();
+uint32_t address_region_find(uint64_t address);
 uint64_t address_from_fatsec(uint32_t fatclus);
 uint64_t address_from_fatclus(uint32_t fatclus);
 uint32_t fat_location(uint32_t fatnum);
 
 uint32_t root_dir_loc();
 
+//Content that's built when a host reads it instead of being kept in memory
+typedef struct RegionGenerator
+{
+    //Fill len bytes from pos bytes into the region. buf is already zeroed
+    void (*generate)(void *context, unsigned char *buf, uint64_t pos, uint32_t len);
+    void *context;
+} RegionGenerator;
+
+//mem_pointer is a RegionGenerator
+#define Region_Generated 1
+
 typedef struct AddressRegion
 {
     uint64_t base;
-    uint64_t length;
+    uint32_t length;
+    uint32_t flags;
     void *mem_pointer;
-    char *file_path;
+    uint32_t path; // Source file in the path table, or Path_None
 } AddressRegion;
 
+void add_generated_region(uint64_t base, uint32_t length,
+                          RegionGenerator *generator);
+
 extern AddressRegion *address_regions;
-extern uint32_t address_regions_count;
\ No newline at end of file
+extern uint32_t address_regions_count;
+
+#endif /* ADDRESS_H_INCLUDED */
@@ -17,11 +17,15 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/types.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +35,7 @@
 #include <unistd.h>
 
 #include "buse.h"
+#include "qos.h"
 
 /*
  * These helper functions were taken from cliserv.h in the nbd distribution.
@@ -52,6 +57,14 @@ uint64_t ntohll(uint64_t a)
 #endif
 #define htonll ntohll
 
+/* The command is in the low bits of the request type, flags such as FUA
+ * or write-zeroes' NO_HOLE in the high ones. Every command has to be
+ * masked before it's compared, or a flagged request matches nothing. */
+#define BUSE_CMD_MASK 0xffff
+
+/* Most file pieces read_splice can hand back for one request. */
+#define BUSE_MAX_SEGMENTS 64
+
 static int read_all(int fd, char *buf, size_t count)
 {
   int bytes_read;
@@ -59,6 +72,8 @@ static int read_all(int fd, char *buf, size_t count)
   while (count > 0)
   {
     bytes_read = read(fd, buf, count);
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
     assert(bytes_read > 0);
     buf += bytes_read;
     count -= bytes_read;
@@ -75,6 +90,8 @@ static int write_all(int fd, char *buf, size_t count)
   while (count > 0)
   {
     bytes_written = write(fd, buf, count);
+    if (bytes_written == -1 && errno == EINTR)
+      continue;
     assert(bytes_written > 0);
     buf += bytes_written;
     count -= bytes_written;
@@ -84,6 +101,427 @@ static int write_all(int fd, char *buf, size_t count)
   return 0;
 }
 
+/* One request, from the time its header (and any payload) has been read
+ * off the socket until its reply has been written back. */
+struct buse_job
+{
+  struct buse_job *next;
+  uint32_t type;
+  int fua;
+  uint64_t from;
+  uint32_t len;
+  char handle[8];
+  void *chunk;
+  /* CLOCK_MONOTONIC time QoS holds it back until, or 0 */
+  uint64_t ready;
+};
+
+/* State shared by whoever is serving requests. The worker threads only
+ * exist when the backend asks for more than one. */
+struct buse_server
+{
+  int sk;
+  const struct buse_operations *aop;
+  void *userdata;
+  pthread_mutex_t reply_lock;
+  int pipe[2];
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+  struct buse_job *head;
+  struct buse_job *tail;
+  uint32_t busy;
+  int stopping;
+  pthread_t *threads;
+  uint32_t count;
+};
+
+static volatile sig_atomic_t stats_requested;
+
+static void request_stats(int sig)
+{
+  (void)sig;
+  stats_requested = 1;
+}
+
+static void print_requested_stats(const struct buse_operations *aop)
+{
+  if (stats_requested)
+  {
+    stats_requested = 0;
+    buse_print_stats(stderr, aop->stats);
+  }
+}
+
+/* Charge a request to its QoS budget and count it. Served in order, it is
+ * held back right here. With workers it's queued with the time it becomes
+ * ready instead, so requests of other classes aren't stuck behind it. */
+static void admit(struct buse_server *srv, struct qos_state *qos,
+                  struct buse_job *job, enum buse_class cls)
+{
+  struct buse_stats *stats = srv->aop->stats;
+  uint32_t len = job->len;
+  uint64_t delay = 0;
+
+  if (qos)
+  {
+    delay = qos_admit(qos, cls, len);
+    if (delay && !srv->count)
+      qos_wait(delay);
+    else if (delay)
+      job->ready = qos_now() + delay;
+  }
+  if (stats)
+  {
+    stats->ops[cls]++;
+    stats->bytes[cls] += len;
+    if (delay)
+    {
+      stats->throttled[cls]++;
+      stats->throttle_ns[cls] += delay;
+    }
+  }
+}
+
+/* Request buffers are page aligned so that backends using O_DIRECT can
+ * usually do I/O straight into them. */
+static void *alloc_chunk(uint32_t len)
+{
+  void *chunk;
+
+  if (posix_memalign(&chunk, 4096, len ? len : 1))
+    return NULL;
+  return chunk;
+}
+
+/* Send `len' bytes of a file by reading them into `buf' first. Whatever
+ * can't be read is sent as buf already has it. */
+static void send_copy(int sk, int fd, uint64_t offset, char *buf, uint32_t len)
+{
+  uint32_t done = 0;
+  ssize_t bytes_read;
+
+  while (done < len)
+  {
+    bytes_read = pread(fd, buf + done, len - done, offset + done);
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      break;
+    done += bytes_read;
+  }
+  write_all(sk, buf, len);
+}
+
+/* Send one file piece of a read reply through the pipe, so the data never
+ * passes through user space. Falls back to copying if the file can't be
+ * spliced from. */
+static void send_segment(struct buse_server *srv, const struct buse_segment *seg,
+                         char *buf)
+{
+  loff_t offset = seg->offset;
+  uint32_t left = seg->len;
+  ssize_t in, out;
+
+  if (srv->pipe[0] == -1)
+  {
+    send_copy(srv->sk, seg->fd, seg->offset, buf, seg->len);
+    return;
+  }
+
+  while (left > 0)
+  {
+    in = splice(seg->fd, &offset, srv->pipe[1], NULL, left, SPLICE_F_MOVE);
+    if (in == -1 && errno == EINTR)
+      continue;
+    if (in == 0)
+    {
+      /* The file is shorter than it was, send the rest from buf */
+      write_all(srv->sk, buf + (seg->len - left), left);
+      return;
+    }
+    if (in == -1)
+    {
+      send_copy(srv->sk, seg->fd, offset, buf + (seg->len - left), left);
+      return;
+    }
+    left -= in;
+    while (in > 0)
+    {
+      out = splice(srv->pipe[0], NULL, srv->sk, NULL, in,
+                   SPLICE_F_MOVE | (left ? SPLICE_F_MORE : 0));
+      if (out == -1 && errno == EINTR)
+        continue;
+      assert(out > 0);
+      in -= out;
+    }
+  }
+}
+
+/* Send the data of a read reply: buf, with the segments taking the place
+ * of the parts of it they cover. */
+static void send_read(struct buse_server *srv, struct buse_job *job,
+                      const struct buse_segment *segs, uint32_t count)
+{
+  char *buf = job->chunk;
+  uint32_t pos = 0;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    assert(segs[i].pos >= pos && segs[i].pos + segs[i].len <= job->len);
+    write_all(srv->sk, buf + pos, segs[i].pos - pos);
+    send_segment(srv, &segs[i], buf + segs[i].pos);
+    pos = segs[i].pos + segs[i].len;
+  }
+  write_all(srv->sk, buf + pos, job->len - pos);
+}
+
+/* Carry out one request and send its reply. Replies from different
+ * threads must not interleave on the socket. */
+static void serve(struct buse_server *srv, struct buse_job *job)
+{
+  const struct buse_operations *aop = srv->aop;
+  void *userdata = srv->userdata;
+  struct nbd_reply reply;
+  struct buse_segment segs[BUSE_MAX_SEGMENTS];
+  uint32_t count = 0;
+
+  reply.magic = htonl(NBD_REPLY_MAGIC);
+  reply.error = htonl(0);
+  memcpy(reply.handle, job->handle, sizeof(reply.handle));
+
+  switch (job->type)
+  {
+  case NBD_CMD_READ:
+    /* Splicing is only safe while nobody else can be using the backend's
+     * descriptors, so the worker threads always copy. */
+    if (aop->read_splice && !srv->count)
+    {
+      count = BUSE_MAX_SEGMENTS;
+      reply.error = aop->read_splice(job->chunk, job->len, job->from, segs,
+                                     &count, userdata);
+      if (reply.error)
+        count = 0;
+    }
+    else if (aop->read)
+    {
+      reply.error = aop->read(job->chunk, job->len, job->from, userdata);
+    }
+    else
+    {
+      /* If user not specified read operation, return EPERM error */
+      reply.error = htonl(EPERM);
+    }
+    break;
+  case NBD_CMD_WRITE:
+    if (aop->write)
+    {
+      reply.error = aop->write(job->chunk, job->len, job->from, userdata);
+      /* Forced unit access: the write has to be durable before the reply,
+       * which a flush right behind it guarantees. */
+      if (!reply.error && job->fua && aop->flush)
+        reply.error = aop->flush(userdata);
+    }
+    else
+    {
+      /* If user not specified write operation, return EPERM error */
+      reply.error = htonl(EPERM);
+    }
+    break;
+#ifdef NBD_FLAG_SEND_FLUSH
+  case NBD_CMD_FLUSH:
+    if (aop->flush)
+    {
+      reply.error = aop->flush(userdata);
+    }
+    break;
+#endif
+#ifdef NBD_FLAG_SEND_TRIM
+  case NBD_CMD_TRIM:
+    if (aop->trim)
+    {
+      reply.error = aop->trim(job->from, job->len, userdata);
+    }
+    break;
+#endif
+#ifdef NBD_FLAG_SEND_WRITE_ZEROES
+  case NBD_CMD_WRITE_ZEROES:
+    if (aop->write_zeroes)
+    {
+      reply.error = aop->write_zeroes(job->from, job->len, userdata);
+    }
+    else
+    {
+      reply.error = htonl(EPERM);
+    }
+    break;
+#endif
+  }
+
+  pthread_mutex_lock(&srv->reply_lock);
+  write_all(srv->sk, (char *)&reply, sizeof(struct nbd_reply));
+  if (job->type == NBD_CMD_READ)
+    send_read(srv, job, segs, count);
+  pthread_mutex_unlock(&srv->reply_lock);
+
+  free(job->chunk);
+  free(job);
+}
+
+/* Take the oldest queued request QoS lets through now. Otherwise return
+ * NULL, with `until' set to when the next held back one is due, or 0. */
+static struct buse_job *take_ready(struct buse_server *srv, uint64_t *until)
+{
+  struct buse_job **link = &srv->head;
+  struct buse_job *prev = NULL;
+  uint64_t now = 0;
+
+  *until = 0;
+  for (; *link; prev = *link, link = &(*link)->next)
+  {
+    struct buse_job *job = *link;
+
+    if (job->ready && !now)
+      now = qos_now();
+    if (job->ready > now)
+    {
+      if (!*until || job->ready < *until)
+        *until = job->ready;
+      continue;
+    }
+    *link = job->next;
+    if (srv->tail == job)
+      srv->tail = prev;
+    return job;
+  }
+  return NULL;
+}
+
+static void *worker(void *arg)
+{
+  struct buse_server *srv = arg;
+  struct buse_job *job;
+  uint64_t until;
+
+  pthread_mutex_lock(&srv->lock);
+  for (;;)
+  {
+    job = take_ready(srv, &until);
+    if (!job)
+    {
+      struct timespec ts;
+
+      if (!srv->head && srv->stopping)
+        break;
+      if (!until)
+      {
+        pthread_cond_wait(&srv->work, &srv->lock);
+        continue;
+      }
+      ts.tv_sec = until / 1000000000;
+      ts.tv_nsec = until % 1000000000;
+      pthread_cond_timedwait(&srv->work, &srv->lock, &ts);
+      continue;
+    }
+    srv->busy++;
+    pthread_mutex_unlock(&srv->lock);
+
+    serve(srv, job);
+
+    pthread_mutex_lock(&srv->lock);
+    if (--srv->busy == 0 && !srv->head)
+      pthread_cond_broadcast(&srv->idle);
+  }
+  pthread_mutex_unlock(&srv->lock);
+  return NULL;
+}
+
+static void submit(struct buse_server *srv, struct buse_job *job)
+{
+  if (!srv->count)
+  {
+    serve(srv, job);
+    return;
+  }
+  pthread_mutex_lock(&srv->lock);
+  if (srv->tail)
+    srv->tail->next = job;
+  else
+    srv->head = job;
+  srv->tail = job;
+  pthread_cond_signal(&srv->work);
+  pthread_mutex_unlock(&srv->lock);
+}
+
+static void start_workers(struct buse_server *srv, uint32_t count)
+{
+  pthread_condattr_t attr;
+  sigset_t stats_signal;
+  sigset_t old;
+
+  pthread_mutex_init(&srv->reply_lock, NULL);
+  pthread_mutex_init(&srv->lock, NULL);
+  /* Workers wait for QoS deadlines, which are on the monotonic clock. */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&srv->work, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_cond_init(&srv->idle, NULL);
+  if (count < 2)
+    return;
+
+  srv->threads = calloc(count, sizeof(pthread_t));
+  assert(srv->threads);
+  /* Workers inherit the mask, so SIGUSR1 goes to the thread that prints. */
+  sigemptyset(&stats_signal);
+  sigaddset(&stats_signal, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &stats_signal, &old);
+  for (srv->count = 0; srv->count < count; srv->count++)
+    if (pthread_create(&srv->threads[srv->count], NULL, worker, srv))
+      break;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  assert(srv->count);
+}
+
+/* Let every queued request finish, then stop the workers. */
+static void stop_workers(struct buse_server *srv)
+{
+  pthread_mutex_lock(&srv->lock);
+  while (srv->head || srv->busy)
+    pthread_cond_wait(&srv->idle, &srv->lock);
+  srv->stopping = 1;
+  pthread_cond_broadcast(&srv->work);
+  pthread_mutex_unlock(&srv->lock);
+  for (uint32_t i = 0; i < srv->count; i++)
+    pthread_join(srv->threads[i], NULL);
+  free(srv->threads);
+  srv->count = 0;
+}
+
+#if defined NBD_SET_FLAGS && defined NBD_FLAG_SEND_TRIM
+/* Advertise the optional commands the backend can take. */
+static unsigned int nbd_flags(const struct buse_operations *aop)
+{
+  unsigned int flags = NBD_FLAG_SEND_TRIM;
+
+#ifdef NBD_FLAG_SEND_FLUSH
+  if (aop->flush)
+    flags |= NBD_FLAG_SEND_FLUSH;
+#endif
+#ifdef NBD_FLAG_SEND_FUA
+  if (aop->flush)
+    flags |= NBD_FLAG_SEND_FUA;
+#endif
+#ifdef NBD_FLAG_SEND_WRITE_ZEROES
+  if (aop->write_zeroes)
+    flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+#else
+  (void)aop;
+#endif
+  return flags;
+}
+#endif
+
 int buse_main(const char *dev_file, const struct buse_operations *aop, void *userdata)
 {
   int sp[2];
@@ -92,8 +530,9 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
   uint32_t len;
   ssize_t bytes_read;
   struct nbd_request request;
-  struct nbd_reply reply;
-  void *chunk;
+  struct buse_server srv;
+  struct buse_job *job;
+  struct qos_state *qos = NULL;
 
   err = socketpair(AF_UNIX, SOCK_STREAM, 0, sp);
   assert(!err);
@@ -139,9 +578,9 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
       fprintf(stderr, "ioctl(nbd, NBD_SET_SOCK, sk) failed.[%s]\n", strerror(errno));
     }
 #if defined NBD_SET_FLAGS && defined NBD_FLAG_SEND_TRIM
-    else if (ioctl(nbd, NBD_SET_FLAGS, NBD_FLAG_SEND_TRIM) == -1)
+    else if (ioctl(nbd, NBD_SET_FLAGS, nbd_flags(aop)) == -1)
     {
-      fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, NBD_FLAG_SEND_TRIM) failed.[%s]\n", strerror(errno));
+      fprintf(stderr, "ioctl(nbd, NBD_SET_FLAGS, %#x) failed.[%s]\n", nbd_flags(aop), strerror(errno));
     }
 #endif
     else
@@ -169,20 +608,79 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
   close(sp[1]);
   sk = sp[0];
 
-  reply.magic = htonl(NBD_REPLY_MAGIC);
-  reply.error = htonl(0);
+  if (aop->qos)
+  {
+    qos = qos_create(aop->qos);
+    assert(qos);
+  }
+  if (aop->stats)
+  {
+    struct sigaction sa;
 
-  while ((bytes_read = read(sk, &request, sizeof(request))) > 0)
+    /* No SA_RESTART: the signal has to break the blocking socket read
+     * below, so an idle device still prints. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stats;
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+
+  memset(&srv, 0, sizeof(srv));
+  srv.sk = sk;
+  srv.aop = aop;
+  srv.userdata = userdata;
+  srv.pipe[0] = srv.pipe[1] = -1;
+  if (aop->read_splice && aop->threads < 2)
   {
-    assert(bytes_read == sizeof(request));
-    memcpy(reply.handle, request.handle, sizeof(reply.handle));
-    reply.error = htonl(0);
+    if (pipe2(srv.pipe, O_CLOEXEC) == -1)
+      srv.pipe[0] = srv.pipe[1] = -1;
+    else
+      /* A bigger pipe moves more per splice, it's fine if we can't have it */
+      fcntl(srv.pipe[1], F_SETPIPE_SZ, 1024 * 1024);
+  }
+  start_workers(&srv, aop->threads);
 
+  for (;;)
+  {
+    bytes_read = read(sk, &request, sizeof(request));
+    if (bytes_read == -1 && errno == EINTR)
+    {
+      print_requested_stats(aop);
+      continue;
+    }
+    if (bytes_read <= 0)
+      break;
+    assert(bytes_read == sizeof(request));
     len = ntohl(request.len);
     from = ntohll(request.from);
     assert(request.magic == htonl(NBD_REQUEST_MAGIC));
 
-    switch (ntohl(request.type))
+    print_requested_stats(aop);
+
+    if ((ntohl(request.type) & BUSE_CMD_MASK) == NBD_CMD_DISC)
+    {
+      /* Handle a disconnect request. */
+      stop_workers(&srv);
+      if (aop->disc)
+      {
+        aop->disc(userdata);
+      }
+      qos_destroy(qos);
+      return 0;
+    }
+
+    job = calloc(1, sizeof(struct buse_job));
+    assert(job);
+    job->type = ntohl(request.type) & BUSE_CMD_MASK;
+#ifdef NBD_CMD_FLAG_FUA
+    job->fua = (ntohl(request.type) & NBD_CMD_FLAG_FUA) != 0;
+#endif
+    job->from = from;
+    job->len = len;
+    memcpy(job->handle, request.handle, sizeof(job->handle));
+
+    /* Payloads have to come off the socket here, in order, and the QoS
+     * budget is charged here too so it's spent in arrival order. */
+    switch (job->type)
     {
       /* I may at some point need to deal with the the fact that the
        * official nbd server has a maximum buffer size, and divides up
@@ -190,75 +688,52 @@ int buse_main(const char *dev_file, const struct buse_operations *aop, void *use
        * and writes.
        */
     case NBD_CMD_READ:
-      if (*(int *)userdata)
+      if (aop->debug)
       {
         fprintf(stderr, "Request for read of size %d from %lu\n", len, from);
       }
-      /* Fill with zero in case actual read is not implemented */
-      chunk = malloc(len);
-      if (aop->read)
-      {
-        reply.error = aop->read(chunk, len, from, userdata);
-      }
-      else
-      {
-        /* If user not specified read operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
-      write_all(sk, (char *)chunk, len);
-
-      free(chunk);
+      job->chunk = alloc_chunk(len);
+      assert(job->chunk);
+      admit(&srv, qos, job, BUSE_CLASS_READ);
       break;
     case NBD_CMD_WRITE:
-      if (*(int *)userdata)
+      if (aop->debug)
       {
         fprintf(stderr, "Request for write of size %d\n", len);
       }
-      chunk = malloc(len);
-      read_all(sk, chunk, len);
-      if (aop->write)
-      {
-        reply.error = aop->write(chunk, len, from, userdata);
-      }
-      else
-      {
-        /* If user not specified write operation, return EPERM error */
-        reply.error = htonl(EPERM);
-      }
-      free(chunk);
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
+      job->chunk = alloc_chunk(len);
+      assert(job->chunk);
+      read_all(sk, job->chunk, len);
+      admit(&srv, qos, job, BUSE_CLASS_WRITE);
       break;
-    case NBD_CMD_DISC:
-      /* Handle a disconnect request. */
-      if (aop->disc)
-      {
-        aop->disc(userdata);
-      }
-      return 0;
 #ifdef NBD_FLAG_SEND_FLUSH
     case NBD_CMD_FLUSH:
-      if (aop->flush)
+      if (aop->stats)
       {
-        reply.error = aop->flush(userdata);
+        aop->stats->flushes++;
       }
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
       break;
 #endif
 #ifdef NBD_FLAG_SEND_TRIM
     case NBD_CMD_TRIM:
-      if (aop->trim)
-      {
-        reply.error = aop->trim(from, len, userdata);
-      }
-      write_all(sk, (char *)&reply, sizeof(struct nbd_reply));
+      admit(&srv, qos, job, BUSE_CLASS_TRIM);
+      break;
+#endif
+#ifdef NBD_FLAG_SEND_WRITE_ZEROES
+    case NBD_CMD_WRITE_ZEROES:
+      /* Zeroing is a metadata operation for the backends that offer it,
+       * so it is budgeted with trim rather than with writes. */
+      admit(&srv, qos, job, BUSE_CLASS_TRIM);
       break;
 #endif
     default:
       assert(0);
     }
+    submit(&srv, job);
   }
+  stop_workers(&srv);
   if (bytes_read == -1)
     fprintf(stderr, "%s\n", strerror(errno));
+  qos_destroy(qos);
   return 0;
 }
@@ -8,9 +8,57 @@ extern "C"
 
   /* Most of this file was copied from nbd.h in the nbd distribution. */
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <linux/nbd.h>
 
+  /* Request classes used for rate limiting and statistics. */
+  enum buse_class
+  {
+    BUSE_CLASS_READ = 0,
+    BUSE_CLASS_WRITE,
+    BUSE_CLASS_TRIM,
+    BUSE_CLASS_COUNT
+  };
+
+  /* Token bucket limits for one class of request. A rate of zero means
+   * unlimited. If a burst is left at zero, one second worth of the
+   * matching rate is allowed to accumulate. */
+  struct buse_limit
+  {
+    uint64_t iops;
+    uint64_t bps;
+    uint64_t burst_ios;
+    uint64_t burst_bytes;
+  };
+
+  /* Per-device QoS. Each class has its own buckets and `total' is shared by
+   * all of them. Requests over the limit are delayed, never failed. */
+  struct buse_qos
+  {
+    struct buse_limit limit[BUSE_CLASS_COUNT];
+    struct buse_limit total;
+  };
+
+  /* Counters maintained by buse_main while serving requests. */
+  struct buse_stats
+  {
+    uint64_t ops[BUSE_CLASS_COUNT];
+    uint64_t bytes[BUSE_CLASS_COUNT];
+    uint64_t throttled[BUSE_CLASS_COUNT];
+    uint64_t throttle_ns[BUSE_CLASS_COUNT];
+    uint64_t flushes;
+  };
+
+  /* Part of a read reply that is sent straight from a file. */
+  struct buse_segment
+  {
+    int fd;
+    uint64_t offset; /* where the data starts in the file */
+    uint32_t pos;    /* where it goes in the reply */
+    uint32_t len;
+  };
+
   struct buse_operations
   {
     int (*read)(void *buf, uint32_t len, uint64_t offset, void *userdata);
@@ -18,15 +66,41 @@ extern "C"
     void (*disc)(void *userdata);
     int (*flush)(void *userdata);
     int (*trim)(uint64_t from, uint32_t len, void *userdata);
+    // only offered to the kernel when its nbd.h knows NBD_CMD_WRITE_ZEROES
+    int (*write_zeroes)(uint64_t from, uint32_t len, void *userdata);
+    // optional zero-copy read, used instead of read when serving in order.
+    // Fill buf like read would, except for up to *count pieces which are
+    // instead described in segs, in order of pos, and *count set to how many
+    // there are. Those are spliced from their file to the socket, and if the
+    // file comes up short the rest is sent from buf. The descriptors have to
+    // stay open until the next call
+    int (*read_splice)(void *buf, uint32_t len, uint64_t offset,
+                       struct buse_segment *segs, uint32_t *count,
+                       void *userdata);
 
     // either set size, OR set both blksize and size_blocks
     uint64_t size;
     uint32_t blksize;
     uint64_t size_blocks;
+
+    // optional rate limiting, and counters which are dumped on SIGUSR1
+    const struct buse_qos *qos;
+    struct buse_stats *stats;
+
+    // serve up to this many requests at once, replying as each finishes;
+    // the callbacks must then be thread safe. 0 or 1 serves them in order
+    uint32_t threads;
+
+    // log every request to stderr
+    int debug;
   };
 
   int buse_main(const char *dev_file, const struct buse_operations *bop, void *userdata);
 
+  int buse_parse_amount(const char *text, uint64_t *value);
+  int buse_parse_qos(struct buse_qos *qos, const char *spec);
+  void buse_print_stats(FILE *out, const struct buse_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,14 +17,26 @@
  *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "buse.h"
+#include "emulate.h"
+#include "dedup.h"
+#include "zram.h"
+#include "sparse.h"
 
 static void *data;
 static int xmpl_debug = 1;
+static struct buse_qos qos;
+static struct buse_stats stats;
+static struct buse_operations emu_aop;
+static struct emu_device emu;
+static struct dedup_device dedup;
+static struct zram_device zram;
+static struct sparse_device sparse;
 
 static int xmp_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
 {
@@ -69,22 +81,172 @@ static struct buse_operations aop = {
     .flush = xmp_flush,
     .trim = xmp_trim,
     .size = 128 * 1024 * 1024,
+    .stats = &stats,
+    .debug = 1,
 };
 
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage:\n"
+          "  %s [options] /dev/nbd0\n"
+          "  --size BYTES     device size, K/M/G suffixes allowed (default 128M)\n"
+          "  --dedup          store each distinct block once, zero blocks not at all\n"
+          "  --compress       keep blocks compressed in memory, like zram\n"
+          "  --sparse[=PAGE]  allocate 4K (or PAGE sized) pages on first write and\n"
+          "                   free them on trim, so --size can exceed memory\n"
+          "  --threads N      with --compress or --sparse, serve up to N requests\n"
+          "                   at once (default 1)\n"
+          "  --qos SPEC       rate limit requests, e.g. read_iops=500,write_bps=8M\n"
+          "  --emulate SPEC   add the latency of sd, usbhdd or emmc media\n"
+          "Don't forget to load nbd kernel module (`modprobe nbd`) and\n"
+          "run example from root. Send SIGUSR1 for request statistics.\n",
+          prog);
+}
+
+static const struct option options[] = {
+    {"qos", required_argument, NULL, 'q'},
+    {"emulate", required_argument, NULL, 'e'},
+    {"size", required_argument, NULL, 's'},
+    {"dedup", no_argument, NULL, 'D'},
+    {"compress", no_argument, NULL, 'C'},
+    {"sparse", optional_argument, NULL, 'S'},
+    {"threads", required_argument, NULL, 'T'},
+    {0, 0, 0, 0}};
+
 int main(int argc, char *argv[])
 {
-  if (argc != 2)
+  int opt;
+  int emulate = 0;
+  int use_dedup = 0;
+  int use_zram = 0;
+  uint64_t sparse_page = 0;
+  unsigned long threads = 1;
+  char *end;
+  void *userdata = &xmpl_debug;
+
+  while ((opt = getopt_long(argc, argv, "q:e:s:DCS::T:", options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'q':
+      if (buse_parse_qos(&qos, optarg) == -1)
+      {
+        fprintf(stderr, "Invalid QoS specification `%s'\n", optarg);
+        return 1;
+      }
+      aop.qos = &qos;
+      break;
+    case 'e':
+      if (emu_parse(&emu.config, optarg) == -1)
+      {
+        fprintf(stderr, "Invalid emulation profile `%s'\n", optarg);
+        return 1;
+      }
+      emulate = 1;
+      break;
+    case 's':
+      if (buse_parse_amount(optarg, &aop.size) == -1 || aop.size == 0)
+      {
+        fprintf(stderr, "Invalid size `%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'D':
+      use_dedup = 1;
+      break;
+    case 'C':
+      use_zram = 1;
+      break;
+    case 'S':
+      sparse_page = 4096;
+      if (optarg && buse_parse_amount(optarg, &sparse_page) == -1)
+      {
+        fprintf(stderr, "Invalid page size `%s'\n", optarg);
+        return 1;
+      }
+      break;
+    case 'T':
+      threads = strtoul(optarg, &end, 10);
+      if (*end || threads == 0 || threads > 1024)
+      {
+        fprintf(stderr, "Invalid thread count `%s'\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (argc - optind != 1 || use_dedup + use_zram + !!sparse_page > 1)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  /* Only the compressed and sparse stores lock their own blocks. */
+  if (threads > 1 && !use_zram && !sparse_page)
+  {
+    fprintf(stderr, "--threads only applies to --compress and --sparse\n");
+    return 1;
+  }
+  if (threads > 1 && emulate)
   {
-    fprintf(stderr,
-            "Usage:\n"
-            "  %s /dev/nbd0\n"
-            "Don't forget to load nbd kernel module (`modprobe nbd`) and\n"
-            "run example from root.\n",
-            argv[0]);
+    fprintf(stderr, "--emulate models a single queue, so it can't be used with --threads\n");
     return 1;
   }
+  aop.threads = threads;
 
-  data = malloc(aop.size);
+  if (use_dedup)
+  {
+    if (dedup_init(&dedup, aop.size, xmpl_debug) == -1)
+    {
+      fprintf(stderr, "Unable to allocate the dedup block table\n");
+      return 1;
+    }
+    aop.read = dedup_read;
+    aop.write = dedup_write;
+    aop.trim = dedup_trim;
+    aop.disc = dedup_disc;
+    userdata = &dedup;
+  }
+  else if (use_zram)
+  {
+    if (zram_init(&zram, aop.size, xmpl_debug) == -1)
+    {
+      fprintf(stderr, "Unable to allocate the zram block table\n");
+      return 1;
+    }
+    aop.read = zram_read;
+    aop.write = zram_write;
+    aop.trim = zram_trim;
+    aop.disc = zram_disc;
+    userdata = &zram;
+  }
+  else if (sparse_page)
+  {
+    if (sparse_init(&sparse, aop.size, sparse_page, xmpl_debug) == -1)
+    {
+      fprintf(stderr, "Page size must be a power of two of at least 512\n");
+      return 1;
+    }
+    aop.read = sparse_read;
+    aop.write = sparse_write;
+    aop.trim = sparse_trim;
+    aop.write_zeroes = sparse_trim;
+    aop.disc = sparse_disc;
+    userdata = &sparse;
+  }
+  else
+  {
+    data = malloc(aop.size);
+  }
 
-  return buse_main(argv[1], &aop, (void *)&xmpl_debug);
+  if (emulate)
+  {
+    emu_wrap(&emu, &emu_aop, &aop, userdata);
+    return buse_main(argv[optind], &emu_aop, (void *)&emu);
+  }
+  return buse_main(argv[optind], &aop, userdata);
 }
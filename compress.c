@@ -0,0 +1,179 @@
+/*
+ * compress - small LZ77 block compressor used by the compressed RAM disk
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <string.h>
+
+#include "compress.h"
+
+/*
+ * The stream is a sequence of items, each introduced by a control byte:
+ *
+ *   000LLLLL                 L + 1 literal bytes follow
+ *   LLLOOOOO [EEEEEEEE] OOOOOOOO
+ *                            back reference of L + 2 bytes (E is added when
+ *                            L is 7) starting O + 1 bytes behind the output
+ *
+ * which is the LZF layout. It is byte oriented, needs no entropy coding and
+ * decodes with nothing but copies, which is what we want for 4K blocks on
+ * slow ARM cores.
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + (1 << 3))
+
+static uint32_t lz_hash(const unsigned char *p)
+{
+  uint32_t v = p[0] << 16 | p[1] << 8 | p[2];
+
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Returns the compressed size, or 0 if the output would not fit in out_max
+ * bytes, in which case the caller should store the data as is. */
+uint32_t lz_compress(const unsigned char *in, uint32_t in_len,
+                     unsigned char *out, uint32_t out_max)
+{
+  uint32_t htab[1 << LZ_HASH_BITS];
+  uint32_t ip = 0;
+  uint32_t op = 0;
+  uint32_t lit = 0;
+
+  memset(htab, 0, sizeof(htab));
+
+  while (ip < in_len)
+  {
+    if (ip + 2 < in_len)
+    {
+      uint32_t h = lz_hash(in + ip);
+      uint32_t ref = htab[h];
+
+      htab[h] = ip + 1;
+      if (ref && ip - (ref - 1) <= LZ_MAX_OFF &&
+          memcmp(in + ref - 1, in + ip, 3) == 0)
+      {
+        uint32_t off = ip - ref;
+        uint32_t len = 3;
+        uint32_t max = in_len - ip;
+
+        ref--;
+        if (max > LZ_MAX_REF)
+          max = LZ_MAX_REF;
+        while (len < max && in[ref + len] == in[ip + len])
+          len++;
+
+        /* Close the pending literal run. */
+        if (lit)
+        {
+          if (op + 1 + lit > out_max)
+            return 0;
+          out[op++] = lit - 1;
+          memcpy(out + op, in + ip - lit, lit);
+          op += lit;
+          lit = 0;
+        }
+
+        if (op + 3 > out_max)
+          return 0;
+        len -= 2;
+        if (len < 7)
+        {
+          out[op++] = (len << 5) | (off >> 8);
+        }
+        else
+        {
+          out[op++] = (7 << 5) | (off >> 8);
+          out[op++] = len - 7;
+        }
+        out[op++] = off & 0xff;
+        ip += len + 2;
+        continue;
+      }
+    }
+
+    ip++;
+    if (++lit == LZ_MAX_LIT)
+    {
+      if (op + 1 + lit > out_max)
+        return 0;
+      out[op++] = lit - 1;
+      memcpy(out + op, in + ip - lit, lit);
+      op += lit;
+      lit = 0;
+    }
+  }
+
+  if (lit)
+  {
+    if (op + 1 + lit > out_max)
+      return 0;
+    out[op++] = lit - 1;
+    memcpy(out + op, in + ip - lit, lit);
+    op += lit;
+  }
+  return op;
+}
+
+/* Decode exactly out_len bytes. Returns -1 on a corrupt stream. */
+int lz_decompress(const unsigned char *in, uint32_t in_len,
+                  unsigned char *out, uint32_t out_len)
+{
+  uint32_t ip = 0;
+  uint32_t op = 0;
+
+  while (ip < in_len)
+  {
+    uint32_t ctrl = in[ip++];
+
+    if (ctrl < LZ_MAX_LIT)
+    {
+      ctrl++;
+      if (ip + ctrl > in_len || op + ctrl > out_len)
+        return -1;
+      memcpy(out + op, in + ip, ctrl);
+      ip += ctrl;
+      op += ctrl;
+    }
+    else
+    {
+      uint32_t len = ctrl >> 5;
+      uint32_t ref;
+
+      if (len == 7)
+      {
+        if (ip >= in_len)
+          return -1;
+        len += in[ip++];
+      }
+      len += 2;
+      if (ip >= in_len)
+        return -1;
+      ref = ((ctrl & 0x1f) << 8) + in[ip++] + 1;
+      if (ref > op || op + len > out_len)
+        return -1;
+
+      /* Overlapping copies are how runs are encoded, so go byte by byte. */
+      for (uint32_t i = 0; i < len; i++, op++)
+        out[op] = out[op - ref];
+    }
+  }
+  return op == out_len ? 0 : -1;
+}
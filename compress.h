@@ -0,0 +1,31 @@
+/*
+ * compress - small LZ77 block compressor used by the compressed RAM disk
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef COMPRESS_H_INCLUDED
+#define COMPRESS_H_INCLUDED
+
+#include <stdint.h>
+
+uint32_t lz_compress(const unsigned char *in, uint32_t in_len,
+                     unsigned char *out, uint32_t out_max);
+int lz_decompress(const unsigned char *in, uint32_t in_len,
+                  unsigned char *out, uint32_t out_len);
+
+#endif /* COMPRESS_H_INCLUDED */
@@ -0,0 +1,319 @@
+/*
+ * dedup - content deduplicating memory store for busexmp
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+#define DEDUP_MIN_BUCKETS 1024
+
+/* Word-at-a-time multiply/xorshift hash. It only has to spread blocks over
+ * the buckets, every hit is confirmed with memcmp. */
+static uint64_t hash_block(const unsigned char *data)
+{
+  const uint64_t *word = (const uint64_t *)data;
+  uint64_t h = 0x9e3779b97f4a7c15ULL;
+
+  for (size_t i = 0; i < DEDUP_BLOCK_SIZE / sizeof(uint64_t); i++)
+  {
+    h ^= word[i];
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+static int is_zero(const unsigned char *data)
+{
+  const uint64_t *word = (const uint64_t *)data;
+
+  for (size_t i = 0; i < DEDUP_BLOCK_SIZE / sizeof(uint64_t); i++)
+    if (word[i])
+      return 0;
+  return 1;
+}
+
+static uint32_t *bucket_for(struct dedup_device *dev, uint64_t hash)
+{
+  return &dev->buckets[hash & dev->bucket_mask];
+}
+
+static int rehash(struct dedup_device *dev, uint32_t count)
+{
+  uint32_t *buckets = calloc(count, sizeof(uint32_t));
+
+  if (!buckets)
+    return -1;
+  free(dev->buckets);
+  dev->buckets = buckets;
+  dev->bucket_mask = count - 1;
+
+  for (uint32_t slot = 0; slot < dev->blocks_count; slot++)
+  {
+    struct dedup_block *block = &dev->blocks[slot];
+    uint32_t *head;
+
+    if (!block->refs)
+      continue;
+    head = bucket_for(dev, block->hash);
+    block->next = *head;
+    *head = slot + 1;
+  }
+  return 0;
+}
+
+static uint32_t alloc_slot(struct dedup_device *dev)
+{
+  uint32_t ref;
+
+  if (dev->free_head)
+  {
+    ref = dev->free_head;
+    dev->free_head = dev->blocks[ref - 1].next;
+    return ref;
+  }
+  if (dev->blocks_count == dev->blocks_alloc)
+  {
+    uint32_t alloc = dev->blocks_alloc ? dev->blocks_alloc * 2 : DEDUP_MIN_BUCKETS;
+    struct dedup_block *blocks = realloc(dev->blocks, alloc * sizeof(struct dedup_block));
+
+    if (!blocks)
+      return 0;
+    dev->blocks = blocks;
+    dev->blocks_alloc = alloc;
+  }
+  return ++dev->blocks_count;
+}
+
+/* Find or store a copy of `data' and take a reference to it. Returns the
+ * slot + 1, 0 for the all-zero block, which is never stored, or -1 if memory
+ * ran out. */
+static int64_t intern(struct dedup_device *dev, const unsigned char *data)
+{
+  uint64_t hash;
+  uint32_t *head;
+  uint32_t ref;
+  struct dedup_block *block;
+
+  if (is_zero(data))
+    return 0;
+
+  hash = hash_block(data);
+  head = bucket_for(dev, hash);
+  for (ref = *head; ref; ref = dev->blocks[ref - 1].next)
+  {
+    block = &dev->blocks[ref - 1];
+    if (block->hash == hash && memcmp(block->data, data, DEDUP_BLOCK_SIZE) == 0)
+    {
+      block->refs++;
+      return ref;
+    }
+  }
+
+  ref = alloc_slot(dev);
+  if (!ref)
+    return -1;
+  block = &dev->blocks[ref - 1];
+  block->data = malloc(DEDUP_BLOCK_SIZE);
+  if (!block->data)
+  {
+    block->next = dev->free_head;
+    block->refs = 0;
+    dev->free_head = ref;
+    return -1;
+  }
+  memcpy(block->data, data, DEDUP_BLOCK_SIZE);
+  block->hash = hash;
+  block->refs = 1;
+  block->next = *head;
+  *head = ref;
+  dev->unique++;
+
+  /* Keep chains short; a failed grow just leaves them a bit longer. */
+  if (dev->unique > dev->bucket_mask + 1)
+    rehash(dev, (dev->bucket_mask + 1) * 2);
+  return ref;
+}
+
+static void release(struct dedup_device *dev, uint32_t ref)
+{
+  struct dedup_block *block;
+  uint32_t *link;
+
+  if (!ref)
+    return;
+  block = &dev->blocks[ref - 1];
+  if (--block->refs)
+    return;
+
+  for (link = bucket_for(dev, block->hash); *link != ref; link = &dev->blocks[*link - 1].next)
+    ;
+  *link = block->next;
+
+  free(block->data);
+  block->data = NULL;
+  block->next = dev->free_head;
+  dev->free_head = ref;
+  dev->unique--;
+}
+
+/* Point logical block `blk' at `data', dropping whatever it held before. */
+static int set_block(struct dedup_device *dev, uint64_t blk, const unsigned char *data)
+{
+  int64_t ref = intern(dev, data);
+
+  if (ref < 0)
+    return ENOMEM;
+  if (dev->table[blk] && !ref)
+    dev->mapped--;
+  else if (!dev->table[blk] && ref)
+    dev->mapped++;
+  release(dev, dev->table[blk]);
+  dev->table[blk] = ref;
+  return 0;
+}
+
+static void get_block(struct dedup_device *dev, uint64_t blk, unsigned char *out)
+{
+  uint32_t ref = dev->table[blk];
+
+  if (ref)
+    memcpy(out, dev->blocks[ref - 1].data, DEDUP_BLOCK_SIZE);
+  else
+    memset(out, 0, DEDUP_BLOCK_SIZE);
+}
+
+/* Apply `len' bytes of `src' (or zeros when src is NULL) at `offset', doing
+ * a read-modify-write for blocks that are only partly covered. */
+static int update(struct dedup_device *dev, const unsigned char *src, uint32_t len, uint64_t offset)
+{
+  unsigned char block[DEDUP_BLOCK_SIZE];
+
+  while (len > 0)
+  {
+    uint64_t blk = offset / DEDUP_BLOCK_SIZE;
+    uint32_t inner = offset % DEDUP_BLOCK_SIZE;
+    uint32_t n = DEDUP_BLOCK_SIZE - inner;
+    int err;
+
+    if (n > len)
+      n = len;
+    if (n != DEDUP_BLOCK_SIZE)
+      get_block(dev, blk, block);
+    if (src)
+      memcpy(block + inner, src, n);
+    else
+      memset(block + inner, 0, n);
+
+    err = set_block(dev, blk, block);
+    if (err)
+      return err;
+
+    if (src)
+      src += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int dedup_init(struct dedup_device *dev, uint64_t size, int debug)
+{
+  uint64_t count = (size + DEDUP_BLOCK_SIZE - 1) / DEDUP_BLOCK_SIZE;
+
+  memset(dev, 0, sizeof(struct dedup_device));
+  dev->debug = debug;
+  dev->size = size;
+  if (count > UINT32_MAX)
+    return -1;
+  dev->table = calloc(count, sizeof(uint32_t));
+  if (!dev->table)
+    return -1;
+  return rehash(dev, DEDUP_MIN_BUCKETS);
+}
+
+int dedup_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct dedup_device *dev = userdata;
+  unsigned char *out = buf;
+
+  if (dev->debug)
+    fprintf(stderr, "R - %lu, %u\n", offset, len);
+
+  while (len > 0)
+  {
+    uint64_t blk = offset / DEDUP_BLOCK_SIZE;
+    uint32_t inner = offset % DEDUP_BLOCK_SIZE;
+    uint32_t n = DEDUP_BLOCK_SIZE - inner;
+    uint32_t ref = dev->table[blk];
+
+    if (n > len)
+      n = len;
+    if (ref)
+      memcpy(out, dev->blocks[ref - 1].data + inner, n);
+    else
+      memset(out, 0, n);
+
+    out += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int dedup_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct dedup_device *dev = userdata;
+
+  if (dev->debug)
+    fprintf(stderr, "W - %lu, %u\n", offset, len);
+  return update(dev, buf, len, offset);
+}
+
+int dedup_trim(uint64_t from, uint32_t len, void *userdata)
+{
+  struct dedup_device *dev = userdata;
+
+  if (dev->debug)
+    fprintf(stderr, "T - %lu, %u\n", from, len);
+  return update(dev, NULL, len, from);
+}
+
+void dedup_disc(void *userdata)
+{
+  struct dedup_device *dev = userdata;
+
+  fprintf(stderr, "Received a disconnect request.\n");
+  dedup_print_stats(stderr, dev);
+}
+
+void dedup_print_stats(FILE *out, const struct dedup_device *dev)
+{
+  uint64_t logical = dev->mapped * DEDUP_BLOCK_SIZE;
+  uint64_t stored = (uint64_t)dev->unique * DEDUP_BLOCK_SIZE;
+
+  fprintf(out, "dedup: %lu bytes written in non-zero blocks, %lu bytes stored (%u unique blocks)\n",
+          logical, stored, dev->unique);
+  if (stored)
+    fprintf(out, "dedup: ratio %.2f\n", (double)logical / stored);
+}
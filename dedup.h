@@ -0,0 +1,62 @@
+/*
+ * dedup - content deduplicating memory store for busexmp
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DEDUP_H_INCLUDED
+#define DEDUP_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DEDUP_BLOCK_SIZE 4096
+
+/* One stored copy of a block's contents, shared by every logical block with
+ * the same data. Slots with the same hash bucket are chained through `next'. */
+struct dedup_block
+{
+  uint64_t hash;
+  uint32_t refs;
+  uint32_t next;
+  unsigned char *data;
+};
+
+struct dedup_device
+{
+  uint64_t size;
+  // logical block -> slot + 1, or 0 for a block that reads as zeros
+  uint32_t *table;
+  struct dedup_block *blocks;
+  uint32_t blocks_count;
+  uint32_t blocks_alloc;
+  uint32_t free_head;
+  // hash bucket -> first slot + 1
+  uint32_t *buckets;
+  uint32_t bucket_mask;
+  uint32_t unique;
+  uint64_t mapped;
+  int debug;
+};
+
+int dedup_init(struct dedup_device *dev, uint64_t size, int debug);
+int dedup_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int dedup_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int dedup_trim(uint64_t from, uint32_t len, void *userdata);
+void dedup_disc(void *userdata);
+void dedup_print_stats(FILE *out, const struct dedup_device *dev);
+
+#endif /* DEDUP_H_INCLUDED */
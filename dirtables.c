@@ -0,0 +1,247 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vsfat.h"
+#include "utils.h"
+#include "address.h"
+#include "dirtables.h"
+#include "pathtable.h"
+#include "Fat32_Attr.h"
+
+DirListing **dir_listings = 0;
+uint32_t dir_listings_count = 0;
+static uint32_t dir_listings_capacity = 0;
+
+//Rendered clusters, indexed by cluster number
+static unsigned char *dir_cache = 0;
+static DirCluster *dir_cache_tags[Dir_Cache_Clusters];
+
+static void dir_generate(void *context, unsigned char *buf, uint64_t pos, uint32_t len);
+
+static uint32_t dir_cluster_size()
+{
+    return bootentry.BPB_BytsPerSec * bootentry.BPB_SecPerClus;
+}
+
+//Start an empty directory. Its path and parent are up to the caller
+DirListing *dir_listing_new(uint32_t first_cluster, uint32_t parent_cluster, uint8_t dots)
+{
+    DirListing *listing = malloc(sizeof(DirListing));
+    memset(listing, 0, sizeof(DirListing));
+    listing->first_cluster = first_cluster;
+    listing->parent_cluster = parent_cluster;
+    listing->dots = dots;
+
+    if (dir_listings_count == dir_listings_capacity)
+    {
+        dir_listings_capacity = dir_listings_capacity ? dir_listings_capacity * 2 : 64;
+        dir_listings = realloc(dir_listings, dir_listings_capacity * sizeof(DirListing *));
+    }
+    listing->id = dir_listings_count;
+    dir_listings[dir_listings_count++] = listing;
+    return listing;
+}
+
+//Add a child. They have to be added in the order of their slots
+void dir_listing_add(DirListing *listing, DirChild *child)
+{
+    if (listing->count == listing->capacity)
+    {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 8;
+        listing->children = realloc(listing->children, listing->capacity * sizeof(DirChild));
+    }
+    listing->children[listing->count++] = *child;
+}
+
+//Map the next cluster of a directory's chain
+void dir_map_cluster(DirListing *listing, uint32_t cluster)
+{
+    uint32_t index = listing->cluster_count;
+    listing->clusters = realloc(listing->clusters, (index + 1) * sizeof(uint32_t));
+    listing->clusters[listing->cluster_count++] = cluster;
+
+    DirCluster *dir_cluster = malloc(sizeof(DirCluster));
+    dir_cluster->generator.generate = dir_generate;
+    dir_cluster->generator.context = dir_cluster;
+    dir_cluster->listing = listing;
+    dir_cluster->cluster = cluster;
+    dir_cluster->index = index;
+    add_generated_region(address_from_fatclus(cluster), dir_cluster_size(),
+                         &dir_cluster->generator);
+}
+
+//Build the LFN entries and the 8.3 entry for a child
+//Returns how many entries were written
+static uint32_t dir_build_entries(DirChild *child, unsigned char *out)
+{
+    DirEntry entry;
+    memset(&entry, 0, sizeof(DirEntry));
+    memcpy(entry.DIR_Name, child->name83, 8);
+    memcpy(entry.DIR_Ext, child->name83 + 8, 3);
+
+    //No point adding entries if we don't have an LFN
+    if (child->lfn_entries > 0)
+    {
+        //Copy the name in padding with 0x00 to fake UCS-2, like format_name_83 does
+        unsigned char lfn_buffer[LFN_Max_length];
+        unsigned char *lfn = lfn_buffer;
+        const char *name = path_name(child->path);
+        unsigned int lfnlength = strlen(name);
+        for (unsigned int i = 0; i < lfnlength; i++)
+        {
+            lfn[i * 2] = name[i];
+            lfn[i * 2 + 1] = 0x00;
+        }
+
+        int lfnEntryCount = child->lfn_entries;
+        LfnEntry *lfnEntries = (LfnEntry *)out;
+        memset(lfnEntries, 0xFF, sizeof(LfnEntry) * lfnEntryCount);
+
+        for (int entryCount = 0; entryCount < lfnEntryCount; entryCount++)
+        {
+            int currentEntry = lfnEntryCount - entryCount - 1;
+            //Set the flag on the last entry
+            if (currentEntry == 0)
+            {
+                lfnEntries[currentEntry].LFN_Seq = ((entryCount + 1) & LFN_Seq_Mask) | LFN_First_Flag;
+            }
+            else
+            {
+                lfnEntries[currentEntry].LFN_Seq = (entryCount + 1) & LFN_Seq_Mask;
+            }
+            int chars = min(lfnlength, 5);
+            memset(&lfnEntries[currentEntry].LFN_Name, 0, 10);
+            memcpy(&lfnEntries[currentEntry].LFN_Name, lfn, chars * 2);
+            lfnlength -= chars;
+            lfn += chars * 2;
+
+            lfnEntries[currentEntry].LFN_Attributes = LFN_Attr;
+            lfnEntries[currentEntry].LFN_Type = 0x00;
+            lfnEntries[currentEntry].LFN_Checksum = fn_checksum(entry.DIR_Name, entry.DIR_Ext);
+
+            chars = min(lfnlength, 6);
+            memset(&lfnEntries[currentEntry].LFN_Name2, 0, 12);
+            memcpy(&lfnEntries[currentEntry].LFN_Name2, lfn, chars * 2);
+            lfnlength -= chars;
+            lfn += chars * 2;
+
+            lfnEntries[currentEntry].LFN_Cluster_HI = 0x00;
+            lfnEntries[currentEntry].LFN_Cluster_LO = 0x00;
+
+            chars = min(lfnlength, 2);
+            memset(&lfnEntries[currentEntry].LFN_Name3, 0, 4);
+            memcpy(&lfnEntries[currentEntry].LFN_Name3, lfn, chars * 2);
+            lfnlength -= chars;
+            lfn += chars * 2;
+        }
+    }
+
+    entry.DIR_Attr = child->attr;
+    entry.DIR_FstClusLO = (uint16_t)(child->cluster & 0xFFFF);
+    entry.DIR_FstClusHI = (uint16_t)((child->cluster & 0xFFFF0000) >> 16);
+    entry.DIR_FileSize = child->size;
+    memcpy(out + child->lfn_entries * sizeof(DirEntry), &entry, sizeof(DirEntry));
+    return child->lfn_entries + 1;
+}
+
+//Write a . or .. entry
+static void dir_build_dot(unsigned char *out, int dots, uint32_t cluster)
+{
+    DirEntry dotentry;
+    memset(&dotentry, 0, sizeof(DirEntry));
+    dotentry.DIR_Attr = DIR_Attr_Archive | DIR_Attr_Directory;
+    memset(dotentry.DIR_Name, ' ', 8);
+    memset(dotentry.DIR_Ext, ' ', 3);
+    memset(dotentry.DIR_Name, '.', dots);
+    dotentry.DIR_FstClusLO = (uint16_t)(cluster & 0xFFFF);
+    dotentry.DIR_FstClusHI = (uint16_t)((cluster & 0xFFFF0000) >> 16);
+    memcpy(out, &dotentry, sizeof(DirEntry));
+}
+
+//Build a whole cluster of a directory
+static void dir_render(DirCluster *dir_cluster, unsigned char *out)
+{
+    DirListing *listing = dir_cluster->listing;
+    uint32_t entrys_per_cluster = dir_cluster_size() / sizeof(DirEntry);
+    uint32_t first = dir_cluster->index * entrys_per_cluster;
+    uint32_t last = first + entrys_per_cluster;
+
+    memset(out, 0, dir_cluster_size());
+    if (listing->dots && first == 0)
+    {
+        dir_build_dot(out, 1, listing->first_cluster);
+        dir_build_dot(out + sizeof(DirEntry), 2, listing->parent_cluster);
+    }
+
+    //Find the last child starting at or before this cluster, it might spill into it
+    uint32_t low = 0;
+    uint32_t high = listing->count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (listing->children[mid].slot <= first)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    uint32_t child = low > 0 ? low - 1 : 0;
+
+    unsigned char entries[(LFN_Max_Entries + 1) * sizeof(DirEntry)];
+    for (; child < listing->count && listing->children[child].slot < last; child++)
+    {
+        uint32_t slot = listing->children[child].slot;
+        uint32_t count = dir_build_entries(&listing->children[child], entries);
+        for (uint32_t a = 0; a < count; a++, slot++)
+        {
+            if (slot >= first && slot < last)
+            {
+                memcpy(out + (slot - first) * sizeof(DirEntry),
+                       entries + a * sizeof(DirEntry), sizeof(DirEntry));
+            }
+        }
+    }
+}
+
+//Generate part of a directory cluster, rendering it if it isn't cached
+static void dir_generate(void *context, unsigned char *buf, uint64_t pos, uint32_t len)
+{
+    DirCluster *dir_cluster = context;
+    uint32_t cluster_size = dir_cluster_size();
+    if (dir_cache == 0)
+    {
+        dir_cache = malloc((size_t)Dir_Cache_Clusters * cluster_size);
+    }
+
+    uint32_t slot = dir_cluster->cluster % Dir_Cache_Clusters;
+    unsigned char *cached = dir_cache + (size_t)slot * cluster_size;
+    if (dir_cache_tags[slot] != dir_cluster)
+    {
+        dir_render(dir_cluster, cached);
+        dir_cache_tags[slot] = dir_cluster;
+    }
+    memcpy(buf, cached + pos, len);
+}
@@ -0,0 +1,76 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef DIRTABLES_H_INCLUDED
+#define DIRTABLES_H_INCLUDED
+
+#include <stdint.h>
+#include <time.h>
+
+#include "address.h"
+
+//How many rendered directory clusters we keep around
+#define Dir_Cache_Clusters 64
+
+//One file or folder in a directory, everything needed to build its entries
+typedef struct DirChild
+{
+    uint32_t path; // The long name is the last part of it
+    uint32_t cluster;
+    uint32_t size;
+    uint32_t slot; // First directory entry it takes
+    unsigned char name83[11];
+    uint8_t attr;
+    uint8_t lfn_entries;
+} DirChild;
+
+//The contents of a directory, kept instead of the directory tables themselves
+typedef struct DirListing
+{
+    uint32_t path;
+    DirChild *children;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *clusters; // The chain, in order
+    uint32_t cluster_count;
+    uint32_t first_cluster;
+    uint32_t parent_cluster; // 0 when the parent is the root
+    uint32_t id;             // Index in dir_listings
+    uint32_t parent;         // The root is its own parent
+    struct timespec mtime;   // When the source folder last changed, as of the scan
+    uint8_t dots;            // Everything but the root starts with . and ..
+} DirListing;
+
+//One cluster of a directory, mapped as a generated region
+typedef struct DirCluster
+{
+    RegionGenerator generator;
+    DirListing *listing;
+    uint32_t cluster;
+    uint32_t index; // Position in the directory's chain
+} DirCluster;
+
+DirListing *dir_listing_new(uint32_t first_cluster, uint32_t parent_cluster, uint8_t dots);
+void dir_listing_add(DirListing *listing, DirChild *child);
+void dir_map_cluster(DirListing *listing, uint32_t cluster);
+
+//Every directory, parents before their children
+extern DirListing **dir_listings;
+extern uint32_t dir_listings_count;
+
+#endif /* DIRTABLES_H_INCLUDED */
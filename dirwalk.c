@@ -0,0 +1,240 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "dirwalk.h"
+
+//Folders waiting to be read, everything is protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static WalkDir *pending = 0;
+static uint32_t outstanding = 0; // Waiting or being read
+static uint32_t open_dirs = 0;
+
+static WalkDir *walk_dir_new(char *path)
+{
+    WalkDir *dir = malloc(sizeof(WalkDir));
+    memset(dir, 0, sizeof(WalkDir));
+    dir->path = path;
+    dir->fd = -1;
+    return dir;
+}
+
+//Queue a folder to be read by whichever thread gets to it first
+static void walk_push(WalkDir *dir)
+{
+    pthread_mutex_lock(&lock);
+    dir->next = pending;
+    pending = dir;
+    outstanding++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+}
+
+static WalkEntry *walk_add(WalkDir *dir, const char *name)
+{
+    if (dir->count == dir->capacity)
+    {
+        dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+        dir->entries = realloc(dir->entries, dir->capacity * sizeof(WalkEntry));
+    }
+
+    //Names of one folder share a buffer, it goes away once the layout is done
+    uint32_t length = strlen(name) + 1;
+    if (dir->names_size + length > dir->names_capacity)
+    {
+        dir->names_capacity = dir->names_capacity ? dir->names_capacity * 2 : 256;
+        while (dir->names_size + length > dir->names_capacity)
+        {
+            dir->names_capacity *= 2;
+        }
+        dir->names = realloc(dir->names, dir->names_capacity);
+    }
+    memcpy(dir->names + dir->names_size, name, length);
+
+    WalkEntry *entry = &dir->entries[dir->count++];
+    entry->name = dir->names_size;
+    dir->names_size += length;
+    entry->size = 0;
+    entry->dir = 0;
+    return entry;
+}
+
+//List one folder, stat its files relative to it and queue its folders
+static void walk_read(WalkDir *dir)
+{
+    int fd = dir->fd;
+    if (fd < 0)
+    {
+        fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+    }
+    else
+    {
+        pthread_mutex_lock(&lock);
+        open_dirs--;
+        pthread_mutex_unlock(&lock);
+    }
+    if (fd < 0)
+    {
+        return;
+    }
+    DIR *d = fdopendir(fd);
+    if (d == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    //Remember when it last changed, a snapshot is only good while it hasn't
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        dir->mtime = st.st_mtim;
+    }
+
+    size_t length = strlen(dir->path);
+    struct dirent *found;
+    while ((found = readdir(d)) != NULL)
+    {
+        if (found->d_type != DT_DIR)
+        {
+            // If our full path exceeds the allowable length, drop this file
+            if (strlen(found->d_name) + length + 1 >= PATH_MAX)
+            {
+                fprintf(stderr, "File %s/%s path is too long\n", dir->path, found->d_name);
+                continue;
+            }
+            WalkEntry *entry = walk_add(dir, found->d_name);
+            if (fstatat(fd, found->d_name, &st, 0) == 0)
+            {
+                entry->size = st.st_size;
+            }
+        }
+        else if (strcmp(found->d_name, ".") != 0 && strcmp(found->d_name, "..") != 0) // skip . and ..
+        {
+            WalkEntry *entry = walk_add(dir, found->d_name);
+            char *path = malloc(length + strlen(found->d_name) + 2);
+            sprintf(path, "%s/%s", dir->path, found->d_name);
+            entry->dir = walk_dir_new(path);
+
+            //Open it while we have this one, unless too many are already waiting
+            pthread_mutex_lock(&lock);
+            int hold = open_dirs < Walk_Max_Open_Dirs;
+            if (hold)
+            {
+                open_dirs++;
+            }
+            pthread_mutex_unlock(&lock);
+            if (hold)
+            {
+                entry->dir->fd = openat(fd, found->d_name, O_RDONLY | O_DIRECTORY);
+                if (entry->dir->fd < 0)
+                {
+                    pthread_mutex_lock(&lock);
+                    open_dirs--;
+                    pthread_mutex_unlock(&lock);
+                }
+            }
+            walk_push(entry->dir);
+        }
+    }
+    closedir(d);
+}
+
+//Read folders until every one has been read
+static void *walk_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        while (pending == 0 && outstanding > 0)
+        {
+            pthread_cond_wait(&work, &lock);
+        }
+        if (outstanding == 0)
+        {
+            break;
+        }
+        WalkDir *dir = pending;
+        pending = dir->next;
+        pthread_mutex_unlock(&lock);
+
+        walk_read(dir);
+
+        pthread_mutex_lock(&lock);
+        if (--outstanding == 0)
+        {
+            pthread_cond_broadcast(&work);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+//Read the whole tree under path, with threads reading folders at once
+//The tree comes back in the same order a recursive readdir would see it, so
+//laying it out afterwards gives the same disk no matter who read what
+WalkDir *dir_walk(char *path, int threads)
+{
+    WalkDir *root = walk_dir_new(path);
+    walk_push(root);
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (; started < threads - 1; started++)
+    {
+        if (pthread_create(&workers[started], 0, walk_worker, 0) != 0)
+        {
+            break;
+        }
+    }
+    walk_worker(0);
+    for (int a = 0; a < started; a++)
+    {
+        pthread_join(workers[a], 0);
+    }
+    free(workers);
+    return root;
+}
+
+//Free the tree. The root's path belongs to the caller
+void dir_walk_free(WalkDir *dir)
+{
+    for (uint32_t a = 0; a < dir->count; a++)
+    {
+        if (dir->entries[a].dir != 0)
+        {
+            free(dir->entries[a].dir->path);
+            dir_walk_free(dir->entries[a].dir);
+        }
+    }
+    free(dir->entries);
+    free(dir->names);
+    free(dir);
+}
@@ -0,0 +1,55 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef DIRWALK_H_INCLUDED
+#define DIRWALK_H_INCLUDED
+
+#include <stdint.h>
+#include <time.h>
+
+//Threads reading folders while the export is scanned
+#define Walk_Threads 8
+//Most folders held open waiting to be read, the rest are opened by path
+#define Walk_Max_Open_Dirs 256
+
+typedef struct WalkEntry
+{
+    uint32_t name; // Offset in the folder's names
+    uint64_t size;
+    struct WalkDir *dir; // Set for folders
+} WalkEntry;
+
+//One folder of the export, with its entries in the order readdir gave them
+typedef struct WalkDir
+{
+    char *path; // Only kept while walking, the layout has the path table
+    int fd;     // Opened by whoever found it, or -1 to open by path
+    struct timespec mtime;
+    WalkEntry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    char *names;
+    uint32_t names_size;
+    uint32_t names_capacity;
+    struct WalkDir *next; // Waiting to be read
+} WalkDir;
+
+WalkDir *dir_walk(char *path, int threads);
+void dir_walk_free(WalkDir *dir);
+
+#endif /* DIRWALK_H_INCLUDED */
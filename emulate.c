@@ -0,0 +1,293 @@
+/*
+ * emulate - latency and bandwidth emulation wrapper for BUSE backends
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buse.h"
+#include "qos.h"
+#include "emulate.h"
+
+struct emu_profile
+{
+  const char *name;
+  struct emu_config config;
+};
+
+/*
+ * Rough figures for the media we deploy on. They are meant to reproduce the
+ * shape of each device (where the time goes) rather than any one product.
+ */
+static const struct emu_profile profiles[] = {
+    {"sd", {.read_lat = 400, .write_lat = 1500, .flush_lat = 5000, .trim_lat = 2000, .jitter = 300, .dist = EMU_DIST_EXPONENTIAL, .tail_permille = 10, .tail_lat = 80000, .read_bps = 20 << 20, .write_bps = 8 << 20, .seek_min = 300, .seek_max = 300}},
+    {"usbhdd", {.read_lat = 100, .write_lat = 100, .flush_lat = 10000, .trim_lat = 50, .jitter = 11100, .dist = EMU_DIST_UNIFORM, .read_bps = 35 << 20, .write_bps = 30 << 20, .seek_min = 2000, .seek_max = 18000}},
+    {"emmc", {.read_lat = 150, .write_lat = 250, .flush_lat = 2000, .trim_lat = 500, .jitter = 50, .dist = EMU_DIST_EXPONENTIAL, .tail_permille = 2, .tail_lat = 20000, .read_bps = 120 << 20, .write_bps = 40 << 20, .seek_min = 60, .seek_max = 60}},
+};
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Uniform in [0, 1) from the device's own generator, so runs with the same
+ * seed see the same sequence of delays. */
+static double draw(struct emu_device *dev)
+{
+  return rand_r(&dev->rand_state) / ((double)RAND_MAX + 1.0);
+}
+
+static uint64_t jitter(struct emu_device *dev)
+{
+  const struct emu_config *c = &dev->config;
+
+  switch (c->dist)
+  {
+  case EMU_DIST_UNIFORM:
+    return (uint64_t)(draw(dev) * c->jitter);
+  case EMU_DIST_EXPONENTIAL:
+    return (uint64_t)(-log(1.0 - draw(dev)) * c->jitter);
+  default:
+    return c->jitter;
+  }
+}
+
+static uint64_t seek(struct emu_device *dev, uint64_t offset)
+{
+  const struct emu_config *c = &dev->config;
+  uint64_t distance;
+
+  if (offset == dev->head || !dev->size)
+    return 0;
+  distance = offset > dev->head ? offset - dev->head : dev->head - offset;
+  return c->seek_min + (uint64_t)((c->seek_max - c->seek_min) *
+                                  sqrt((double)distance / dev->size));
+}
+
+/* Work out how long this request would have taken on the emulated media. */
+static uint64_t service_time(struct emu_device *dev, uint64_t base, uint64_t bps,
+                             uint32_t len, uint64_t offset)
+{
+  uint64_t us = base + jitter(dev) + seek(dev, offset);
+
+  if (dev->config.tail_permille &&
+      draw(dev) * 1000 < dev->config.tail_permille)
+    us += dev->config.tail_lat;
+  if (bps)
+    us += (uint64_t)len * 1000000 / bps;
+  dev->head = offset + len;
+  return us;
+}
+
+/* Sleep out whatever the real backend didn't already spend. */
+static void finish(uint64_t start, uint64_t us)
+{
+  uint64_t spent = now_us() - start;
+
+  if (spent < us)
+    qos_wait((us - spent) * 1000);
+}
+
+static int emu_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct emu_device *dev = userdata;
+  uint64_t start = now_us();
+  uint64_t us = service_time(dev, dev->config.read_lat, dev->config.read_bps, len, offset);
+  int ret = dev->inner->read(buf, len, offset, dev->inner_userdata);
+
+  finish(start, us);
+  return ret;
+}
+
+static int emu_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct emu_device *dev = userdata;
+  uint64_t start = now_us();
+  uint64_t us = service_time(dev, dev->config.write_lat, dev->config.write_bps, len, offset);
+  int ret = dev->inner->write(buf, len, offset, dev->inner_userdata);
+
+  finish(start, us);
+  return ret;
+}
+
+static int emu_trim(uint64_t from, uint32_t len, void *userdata)
+{
+  struct emu_device *dev = userdata;
+  uint64_t start = now_us();
+  int ret = dev->inner->trim(from, len, dev->inner_userdata);
+
+  finish(start, dev->config.trim_lat);
+  return ret;
+}
+
+static int emu_write_zeroes(uint64_t from, uint32_t len, void *userdata)
+{
+  struct emu_device *dev = userdata;
+  uint64_t start = now_us();
+  int ret = dev->inner->write_zeroes(from, len, dev->inner_userdata);
+
+  finish(start, dev->config.trim_lat);
+  return ret;
+}
+
+static int emu_flush(void *userdata)
+{
+  struct emu_device *dev = userdata;
+  uint64_t start = now_us();
+  int ret = dev->inner->flush(dev->inner_userdata);
+
+  finish(start, dev->config.flush_lat);
+  return ret;
+}
+
+static void emu_disc(void *userdata)
+{
+  struct emu_device *dev = userdata;
+
+  dev->inner->disc(dev->inner_userdata);
+}
+
+/*
+ * Fill `config' from a profile name optionally followed by comma separated
+ * overrides, e.g. "usbhdd,seek_max=25000,seed=7" or "sd,dist=uniform".
+ * Times are microseconds, rates accept K/M/G suffixes.
+ */
+int emu_parse(struct emu_config *config, const char *spec)
+{
+  char *copy = strdup(spec);
+  char *save = NULL;
+  int ret = 0;
+  int first = 1;
+
+  if (!copy)
+    return -1;
+  memset(config, 0, sizeof(struct emu_config));
+
+  for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save), first = 0)
+  {
+    char *value = strchr(item, '=');
+    uint64_t amount = 0;
+
+    if (!value && first)
+    {
+      size_t p;
+
+      for (p = 0; p < sizeof(profiles) / sizeof(profiles[0]); p++)
+      {
+        if (strcmp(item, profiles[p].name) == 0)
+        {
+          *config = profiles[p].config;
+          break;
+        }
+      }
+      if (p == sizeof(profiles) / sizeof(profiles[0]))
+      {
+        ret = -1;
+        break;
+      }
+      continue;
+    }
+    if (!value)
+    {
+      ret = -1;
+      break;
+    }
+    *value++ = '\0';
+
+    if (strcmp(item, "dist") == 0)
+    {
+      if (strcmp(value, "fixed") == 0)
+        config->dist = EMU_DIST_FIXED;
+      else if (strcmp(value, "uniform") == 0)
+        config->dist = EMU_DIST_UNIFORM;
+      else if (strcmp(value, "exp") == 0)
+        config->dist = EMU_DIST_EXPONENTIAL;
+      else
+        ret = -1;
+    }
+    else if (buse_parse_amount(value, &amount) == -1)
+      ret = -1;
+    else if (strcmp(item, "read_lat") == 0)
+      config->read_lat = amount;
+    else if (strcmp(item, "write_lat") == 0)
+      config->write_lat = amount;
+    else if (strcmp(item, "flush_lat") == 0)
+      config->flush_lat = amount;
+    else if (strcmp(item, "trim_lat") == 0)
+      config->trim_lat = amount;
+    else if (strcmp(item, "jitter") == 0)
+      config->jitter = amount;
+    else if (strcmp(item, "tail_permille") == 0)
+      config->tail_permille = amount;
+    else if (strcmp(item, "tail_lat") == 0)
+      config->tail_lat = amount;
+    else if (strcmp(item, "read_bps") == 0)
+      config->read_bps = amount;
+    else if (strcmp(item, "write_bps") == 0)
+      config->write_bps = amount;
+    else if (strcmp(item, "seek_min") == 0)
+      config->seek_min = amount;
+    else if (strcmp(item, "seek_max") == 0)
+      config->seek_max = amount;
+    else if (strcmp(item, "seed") == 0)
+      config->seed = amount;
+    else
+      ret = -1;
+    if (ret)
+      break;
+  }
+
+  if (config->seek_max < config->seek_min)
+    config->seek_max = config->seek_min;
+  free(copy);
+  return ret;
+}
+
+/*
+ * Build `outer' so that it forwards to `inner' with the configured delays
+ * added. Size, QoS and statistics are carried over, and only the callbacks
+ * the inner backend implements are wrapped. Zero-copy reads would skip the
+ * delays and concurrent requests would break the single head model, so
+ * `outer' serves one request at a time through read. Call buse_main with
+ * `outer' and `dev' as the userdata. dev->config must already be filled in.
+ */
+void emu_wrap(struct emu_device *dev, struct buse_operations *outer,
+              const struct buse_operations *inner, void *inner_userdata)
+{
+  *outer = *inner;
+  dev->inner = inner;
+  dev->inner_userdata = inner_userdata;
+  dev->head = 0;
+  dev->size = inner->size ? inner->size : (uint64_t)inner->blksize * inner->size_blocks;
+  dev->rand_state = dev->config.seed;
+
+  outer->read = inner->read ? emu_read : NULL;
+  outer->write = inner->write ? emu_write : NULL;
+  outer->trim = inner->trim ? emu_trim : NULL;
+  outer->write_zeroes = inner->write_zeroes ? emu_write_zeroes : NULL;
+  outer->flush = inner->flush ? emu_flush : NULL;
+  outer->disc = inner->disc ? emu_disc : NULL;
+  outer->read_splice = NULL;
+  outer->threads = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * emulate - latency and bandwidth emulation wrapper for BUSE backends
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef EMULATE_H_INCLUDED
+#define EMULATE_H_INCLUDED
+
+#include <stdint.h>
+
+#include "buse.h"
+
+/* How the random part of each request's service time is drawn. */
+enum emu_dist
+{
+  EMU_DIST_FIXED = 0,
+  EMU_DIST_UNIFORM,
+  EMU_DIST_EXPONENTIAL
+};
+
+/* All times are in microseconds and all rates in bytes per second. */
+struct emu_config
+{
+  uint64_t read_lat;
+  uint64_t write_lat;
+  uint64_t flush_lat;
+  uint64_t trim_lat;
+  uint64_t jitter;
+  enum emu_dist dist;
+  // a `tail_permille' chance per request of an extra `tail_lat' stall,
+  // which is how flash garbage collection shows up from the outside
+  uint32_t tail_permille;
+  uint64_t tail_lat;
+  uint64_t read_bps;
+  uint64_t write_bps;
+  // non sequential requests pay seek_min, growing towards seek_max with the
+  // square root of the distance travelled (rotating media). Flash profiles
+  // set both to the same random access penalty.
+  uint64_t seek_min;
+  uint64_t seek_max;
+  unsigned int seed;
+};
+
+struct emu_device
+{
+  struct emu_config config;
+  const struct buse_operations *inner;
+  void *inner_userdata;
+  uint64_t head;
+  uint64_t size;
+  unsigned int rand_state;
+};
+
+int emu_parse(struct emu_config *config, const char *spec);
+void emu_wrap(struct emu_device *dev, struct buse_operations *outer,
+              const struct buse_operations *inner, void *inner_userdata);
+
+#endif /* EMULATE_H_INCLUDED */
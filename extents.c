@@ -0,0 +1,168 @@
+/*
+ * extents - cached map of the allocated parts of a sparse image
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extents.h"
+
+/* Index of the first extent that ends after `offset'. */
+static size_t first_after(const struct extent_map *map, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = map->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (map->extents[mid].end > offset)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/* Replace extents [first, last) with the `count' given ones. */
+static int replace(struct extent_map *map, size_t first, size_t last,
+                   const struct extent *with, size_t count)
+{
+    size_t need = map->count - (last - first) + count;
+
+    if (need > map->capacity)
+    {
+        size_t capacity = map->capacity ? map->capacity * 2 : 64;
+        struct extent *extents;
+
+        while (capacity < need)
+            capacity *= 2;
+        extents = realloc(map->extents, capacity * sizeof(struct extent));
+        if (!extents)
+            return -1;
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+    memmove(map->extents + first + count, map->extents + last,
+            (map->count - last) * sizeof(struct extent));
+    memcpy(map->extents + first, with, count * sizeof(struct extent));
+    map->count = need;
+    return 0;
+}
+
+/* Build the map from the file system's idea of where the data is. Fails if
+ * the file system can't say, in which case the map shouldn't be used. */
+int extent_map_load(struct extent_map *map, int fd)
+{
+    off_t data = 0;
+    off_t hole;
+
+    memset(map, 0, sizeof(struct extent_map));
+    while ((data = lseek(fd, data, SEEK_DATA)) != -1)
+    {
+        struct extent e;
+
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1)
+            return -1;
+        e.start = data;
+        e.end = hole;
+        if (replace(map, map->count, map->count, &e, 1) == -1)
+            return -1;
+        data = hole;
+    }
+    return errno == ENXIO ? 0 : -1;
+}
+
+/* A write landed here, so it's no longer a hole. Fails only if memory runs
+ * out, after which the map is out of date and mustn't be used. */
+int extent_map_add(struct extent_map *map, uint64_t from, uint64_t len)
+{
+    struct extent e = {from, from + len};
+    size_t first;
+    size_t last;
+
+    if (!len)
+        return 0;
+    /* Merge with anything overlapping or touching. */
+    first = first_after(map, from ? from - 1 : 0);
+    for (last = first; last < map->count && map->extents[last].start <= e.end; last++)
+        ;
+    if (first < last)
+    {
+        if (map->extents[first].start < e.start)
+            e.start = map->extents[first].start;
+        if (map->extents[last - 1].end > e.end)
+            e.end = map->extents[last - 1].end;
+    }
+    return replace(map, first, last, &e, 1);
+}
+
+/* The range now reads as zeros (punched or zeroed), so treat it as a hole.
+ * Splitting an extent can need one more slot; without it, leave the map be. */
+void extent_map_remove(struct extent_map *map, uint64_t from, uint64_t len)
+{
+    struct extent keep[2];
+    size_t kept = 0;
+    size_t first = first_after(map, from);
+    size_t last;
+
+    for (last = first; last < map->count && map->extents[last].start < from + len; last++)
+        ;
+    if (first == last)
+        return;
+    if (map->extents[first].start < from)
+    {
+        keep[kept].start = map->extents[first].start;
+        keep[kept++].end = from;
+    }
+    if (map->extents[last - 1].end > from + len)
+    {
+        keep[kept].start = from + len;
+        keep[kept++].end = map->extents[last - 1].end;
+    }
+    replace(map, first, last, keep, kept);
+}
+
+/* How much of [offset, offset + len) has the same state as `offset', and
+ * whether that is data (1) or a hole (0). */
+uint64_t extent_map_run(const struct extent_map *map, uint64_t offset, uint64_t len, int *data)
+{
+    size_t i = first_after(map, offset);
+    uint64_t end;
+
+    if (i < map->count && map->extents[i].start <= offset)
+    {
+        *data = 1;
+        end = map->extents[i].end;
+    }
+    else
+    {
+        *data = 0;
+        end = i < map->count ? map->extents[i].start : UINT64_MAX;
+    }
+    return end - offset < len ? end - offset : len;
+}
@@ -0,0 +1,47 @@
+/*
+ * extents - cached map of the allocated parts of a sparse image
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef EXTENTS_H_INCLUDED
+#define EXTENTS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct extent
+{
+    uint64_t start;
+    uint64_t end;
+};
+
+/* The allocated ranges of an image, sorted and never touching each other.
+ * Anything outside them is a hole and reads as zeros. */
+struct extent_map
+{
+    struct extent *extents;
+    size_t count;
+    size_t capacity;
+};
+
+int extent_map_load(struct extent_map *map, int fd);
+int extent_map_add(struct extent_map *map, uint64_t from, uint64_t len);
+void extent_map_remove(struct extent_map *map, uint64_t from, uint64_t len);
+uint64_t extent_map_run(const struct extent_map *map, uint64_t offset, uint64_t len, int *data);
+
+#endif /* EXTENTS_H_INCLUDED */
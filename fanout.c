@@ -0,0 +1,124 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fanout.h"
+#include "fileio.h"
+
+//The batch currently being worked on, everything is protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static FanoutRead *batch = 0;
+static uint32_t batch_count = 0;
+static uint32_t batch_next = 0;
+static uint32_t batch_done = 0;
+
+//Take pieces off the current batch until there are none left
+//Called and returns with the lock held
+static void fanout_drain()
+{
+    while (batch_next < batch_count)
+    {
+        FanoutRead *read = &batch[batch_next++];
+        pthread_mutex_unlock(&lock);
+        read->err = pread_all(read->fd, read->buf, read->len, read->offset);
+        pthread_mutex_lock(&lock);
+        if (++batch_done == batch_count)
+        {
+            pthread_cond_signal(&done);
+        }
+    }
+}
+
+static void *fanout_worker(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        while (batch_next >= batch_count)
+        {
+            pthread_cond_wait(&work, &lock);
+        }
+        fanout_drain();
+    }
+    return 0;
+}
+
+//Start the threads that help out with fanout_run
+void fanout_init(int threads)
+{
+    for (int a = 0; a < threads; a++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, fanout_worker, 0) != 0)
+        {
+            fprintf(stderr, "Only started %d of %d read threads\n", a, threads);
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
+//Do all the reads at once and wait for them to land
+//Only one batch runs at a time. The caller works on it too
+//Returns the first error any of the reads hit, or 0
+int fanout_run(FanoutRead *reads, uint32_t count)
+{
+    //Not worth waking anybody up for
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (count == 1)
+    {
+        reads[0].err = pread_all(reads[0].fd, reads[0].buf, reads[0].len,
+                                 reads[0].offset);
+        return reads[0].err;
+    }
+
+    pthread_mutex_lock(&lock);
+    batch = reads;
+    batch_count = count;
+    batch_next = 0;
+    batch_done = 0;
+    pthread_cond_broadcast(&work);
+    fanout_drain();
+    while (batch_done < batch_count)
+    {
+        pthread_cond_wait(&done, &lock);
+    }
+    batch_count = 0;
+    batch_next = 0;
+    pthread_mutex_unlock(&lock);
+
+    for (uint32_t a = 0; a < count; a++)
+    {
+        if (reads[a].err)
+        {
+            return reads[a].err;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef FANOUT_H_INCLUDED
+#define FANOUT_H_INCLUDED
+
+#include <stdint.h>
+
+//Threads that read source files in parallel when one request spans several
+#define Fanout_Threads 8
+//Most file pieces gathered from one request before they're issued
+#define Fanout_Max_Reads 64
+
+typedef struct FanoutRead
+{
+    int fd;
+    void *buf;
+    uint32_t len;
+    uint64_t offset;
+    int err;
+} FanoutRead;
+
+void fanout_init(int threads);
+int fanout_run(FanoutRead *reads, uint32_t count);
+
+#endif /* FANOUT_H_INCLUDED */
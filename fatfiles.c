@@ -27,29 +27,15 @@
 #include "utils.h"
 #include "address.h"
 #include "fatfiles.h"
+#include "fattable.h"
+#include "dirtables.h"
 #include "Fat32_Attr.h"
 
-static unsigned const char fat_end[] = {0xFF, 0xFF, 0xFF, 0xFF};
-
-//Advance the pointer to the next free sector in the fat
-void fat_find_free()
-{
-    while (fat[current_fat_position] != 0)
-    {
-        current_fat_position++;
-        //Bail if we go off the end
-        if (current_fat_position >= (bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec) / 4)
-        {
-            return;
-        }
-    }
-}
-
-//Pass in either a memory segment or a filepath
+//Pass in either a memory segment or a path from the path table
 //This will load the proper mappings and configure the fat
 //Directory entries should be handled above here
-//This assumes we have 0 fragmentation (which should always be true, since we don't allow deleting)
-int fat_new_file(uint32_t file_fat_position, unsigned char *data, char *filepath, uint32_t length)
+//Files always get one contiguous run of clusters, since we don't allow deleting
+int fat_new_file(uint32_t file_fat_position, unsigned char *data, uint32_t path, uint32_t length)
 {
     //length always has to be at least 1
     if (length <= 0)
@@ -60,142 +46,60 @@ int fat_new_file(uint32_t file_fat_position, unsigned char *data, char *filepath
     //Make sure we have enough space
     uint32_t cluster_size = (bootentry.BPB_BytsPerSec * bootentry.BPB_SecPerClus);
     uint32_t clusters_required = ceil_div(length, cluster_size); //Ceiling division
-    if (clusters_required >
-        ((bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec) / 4) - file_fat_position)
+    if (file_fat_position >= fat_entries() ||
+        clusters_required > fat_entries() - file_fat_position)
     { //Free clusters
         return -1;
     }
-    add_address_region(address_from_fatclus(file_fat_position), length, data, filepath);
-
-    //Remove the space for our first cluster
-    if (length > cluster_size)
-    {
-        length -= cluster_size;
-    }
-    else
-    {
-        length = 0;
-    }
+    add_address_region(address_from_fatclus(file_fat_position), length, data, path);
 
-    //Mark any additional sectors in the FAT that we're using
-    while (length > 0)
-    {
-        fat[file_fat_position] = file_fat_position + 1;
-        file_fat_position++;
-        //Unsigned, so the subtraction could loop us around
-        if (length > cluster_size)
-        {
-            length -= cluster_size;
-        }
-        else
-        {
-            length = 0;
-        }
-    }
-
-    memcpy(&fat[file_fat_position], fat_end, sizeof(fat_end)); // Terminate this chain
+    //Claim the clusters, the next file goes right after them
+    fat_add_run(file_fat_position, clusters_required);
+    current_fat_position = file_fat_position + clusters_required;
     return 0;
 }
 
-//Check if the current directory entry has space available
-int dir_entry_sectors_needed(uint32_t entries_needed)
+//Reserve count entries at the end of the current directory, extending it as needed
+//The entries themselves are only built when the directory is read
+int dir_add_entries(uint32_t count, uint32_t *slot)
 {
-    if (entries_needed == 0)
-    {
-        entries_needed = 1;
-    }
-
     uint32_t cluster_size = (bootentry.BPB_BytsPerSec * bootentry.BPB_SecPerClus);
     uint32_t entrys_per_cluster = cluster_size / sizeof(DirEntry);
 
-    if (current_dir->dirtables == 0)
+    //Make sure we don't exceed the 2Mb limit for directory size
+    if (current_dir->current_dir_position + count > (1024 * 1024 * 2) / sizeof(DirEntry))
     {
-        return ceil_div(entries_needed, entrys_per_cluster);
+        return -1;
     }
-    uint32_t free_entries = entrys_per_cluster - (current_dir->current_dir_position % entrys_per_cluster);
-    if (free_entries > entries_needed)
+
+    //Make sure there's room for the clusters these need
+    uint32_t have = ceil_div(current_dir->current_dir_position, entrys_per_cluster);
+    if (have == 0)
     {
-        return 0;
+        have = 1; // The first cluster is mapped with the directory
     }
-    //Subtract the last of what we already have
-    entries_needed -= free_entries;
-    return ceil_div(entries_needed, entrys_per_cluster);
-}
-
-//This does accept multiple entries. However, it does not accept more than a single file worth
-int dir_add_entry(unsigned char *entry, uint32_t length)
-{
-    while (length > 0)
+    uint32_t need = ceil_div(current_dir->current_dir_position + count, entrys_per_cluster);
+    if (need > have && need - have > fat_entries() - current_fat_position)
     {
-        uint32_t cluster_size = (bootentry.BPB_BytsPerSec * bootentry.BPB_SecPerClus);
-        uint32_t entrys_per_cluster = cluster_size / sizeof(DirEntry);
-        uint32_t current_cluster_free = current_dir->current_dir_position % entrys_per_cluster;
-
-        //Make sure we have an initial entry
-        if (current_dir->dirtables == 0)
-        {
-            current_dir->dirtables = malloc(sizeof(DirTable));
-            current_dir->dirtables->next = 0;
-
-            current_dir->dirtables->dirtable = malloc(cluster_size);
-            memset(current_dir->dirtables->dirtable, 0, cluster_size);
-
-            uint64_t dest = address_from_fatclus(current_dir->dir_location);
-            add_address_region(dest, cluster_size, current_dir->dirtables->dirtable, 0);
-            current_cluster_free = entrys_per_cluster;
-
-            memcpy(&fat[current_dir->dir_location], fat_end, sizeof(fat_end)); // Terminate this chain in the FAT
-        }
-
-        //Make sure we don't exceed the 2Mb limit for directory size
-        if (current_dir->current_dir_position + 1 > (1024 * 1024 * 2) / sizeof(DirEntry))
-        {
-            return -1;
-        }
+        return -1;
+    }
 
+    *slot = current_dir->current_dir_position;
+    for (uint32_t a = 0; a < count; a++)
+    {
         //Add another cluster if needed
-        if (current_cluster_free < 1)
+        uint32_t position = current_dir->current_dir_position;
+        if (position > 0 && position % entrys_per_cluster == 0)
         {
-            fat_find_free();
-
-            //Add a new entry to the dirtables linked list
-            //Find the end of the list
-            DirTable *final_dir_table = current_dir->dirtables;
-            while (final_dir_table->next != 0)
-            {
-                final_dir_table = final_dir_table->next;
-            }
-
-            final_dir_table->next = malloc(sizeof(DirTable));
-            final_dir_table = final_dir_table->next;
-
-            final_dir_table->dirtable = malloc(cluster_size);
-            memset(final_dir_table->dirtable, 0, cluster_size);
-            final_dir_table->next = 0;
-            add_address_region(address_from_fatclus(current_fat_position), cluster_size, final_dir_table->dirtable, 0);
-
             //Update the fat for the previous link in the chain to point to the new one
-            fat[current_dir->dir_location] = current_fat_position;
+            fat_add_run(current_fat_position, 1);
+            fat_link(current_dir->dir_location, current_fat_position);
+            dir_map_cluster(current_dir->listing, current_fat_position);
             //Advance this pointer to the extended fat sector
             current_dir->dir_location = current_fat_position;
-            memcpy(&fat[current_dir->dir_location], fat_end, sizeof(fat_end)); // Terminate this chain in the FAT
-        }
-
-        //Find the last dir_table in this chain and the last unused position
-        DirTable *final_dir_table = current_dir->dirtables;
-        uint32_t final_table_pos = current_dir->current_dir_position;
-        while (final_dir_table->next != 0)
-        {
-            final_dir_table = final_dir_table->next;
-            final_table_pos -= entrys_per_cluster;
+            current_fat_position++;
         }
-
-        //copy the data in
-        memcpy(final_dir_table->dirtable + final_table_pos * sizeof(DirEntry), entry, sizeof(DirEntry));
         current_dir->current_dir_position++;
-        //Move to the next one
-        length--;
-        entry += sizeof(DirEntry);
     }
     //Profit!
     return 0;
@@ -204,63 +108,32 @@ int dir_add_entry(unsigned char *entry, uint32_t length)
 void up_dir()
 {
     //Free the current dir (we shouldn't be leaving until we're done with it)
-    //Commented out for debugging - will need to be removed for tracking if writing is desired
+    //The listing stays, the directory's clusters are built from it
+    Fat_Directory *parent = current_dir->parent;
     if (current_dir != &root_dir)
     {
-        //I purposely don't free dirtables, because it's mapped
-        free(current_dir->path);
         free(current_dir);
-
-        //Clear the filename entries as well
-        FileEntry *freeFile = current_dir->files;
-        while (freeFile != 0)
-        {
-            FileEntry *next = freeFile->next;
-            free(freeFile);
-            freeFile = next;
-        }
     }
 
     //If the parent is root, we just stay at the root
-    current_dir = current_dir->parent;
+    current_dir = parent;
 }
 
 //Add a file to the mapping space
-void add_file(char *name, char *filepath, uint32_t size, u_char isDirectory)
+void add_file(char *name, uint32_t path, uint32_t size, u_char isDirectory)
 {
-    DirEntry entry;
-    unsigned char *lfn, *lfn_original;
+    DirChild child;
+    unsigned char lfn[LFN_Max_length];
     unsigned int lfnlength = 0;
-    lfn = malloc(LFN_Max_length);
-    lfn_original = lfn;
 
     //Make sure it's clear
-    memset(&entry, 0, sizeof(DirEntry));
+    memset(&child, 0, sizeof(DirChild));
 
     //For now, just stupid 8.3
     //Format uses unsigned char so it can potentially handle UTF-16 in the future
     //We don't currently get 7 bit ascii input, so this cast clears the warning
     //and will work correctly with the input we're given
-    format_name_83(current_dir, (unsigned char *)name, strlen(name), entry.DIR_Name, entry.DIR_Ext, lfn, &lfnlength);
-
-    //Add this filename to the 8.3 linked list to prevent colisions on LFNs
-    //If this directory is empty
-    if (current_dir->files == 0)
-    {
-        current_dir->files = malloc(sizeof(FileEntry));
-        current_dir->files->next = 0;
-    }
-
-    //Find the last entry (which is a new entry)
-    FileEntry *newFile = current_dir->files;
-    while (newFile->next != 0)
-    {
-        newFile = newFile->next;
-    }
-    newFile->next = malloc(sizeof(FileEntry));
-    memset(newFile->next, 0, sizeof(FileEntry));
-    memcpy(newFile->Filename, entry.DIR_Name, 8);
-    memcpy(newFile->Ext, entry.DIR_Ext, 3);
+    format_name_83(current_dir, (unsigned char *)name, strlen(name), child.name83, child.name83 + 8, lfn, &lfnlength);
 
     //Figure out how many lfn directory entries we'll need
     int lfnEntryCount = ceil_div(lfnlength, LFN_Chars_Per_Entry);
@@ -268,123 +141,61 @@ void add_file(char *name, char *filepath, uint32_t size, u_char isDirectory)
     {
         lfnEntryCount = LFN_Max_Entries;
     }
+    child.lfn_entries = lfnEntryCount;
 
-    //No point adding entries if we don't have an LFN
-    if (lfnlength > 0)
-    {
-        //Build the LFN directory entries
-        LfnEntry *lfnEntries = malloc(sizeof(LfnEntry) * lfnEntryCount);
-        memset(lfnEntries, 0xFF, sizeof(LfnEntry) * lfnEntryCount);
-
-        for (int entryCount = 0; entryCount < lfnEntryCount; entryCount++)
-        {
-            int currentEntry = lfnEntryCount - entryCount - 1;
-            //Set the flag on the last entry
-            if (currentEntry == 0)
-            {
-                lfnEntries[currentEntry].LFN_Seq = ((entryCount + 1) & LFN_Seq_Mask) | LFN_First_Flag;
-            }
-            else
-            {
-                lfnEntries[currentEntry].LFN_Seq = (entryCount + 1) & LFN_Seq_Mask;
-            }
-            int chars = min(lfnlength, 5);
-            memset(&lfnEntries[currentEntry].LFN_Name, 0, 10);
-            memcpy(&lfnEntries[currentEntry].LFN_Name, lfn, chars * 2);
-            lfnlength -= chars;
-            lfn += chars * 2;
-
-            lfnEntries[currentEntry].LFN_Attributes = LFN_Attr;
-            lfnEntries[currentEntry].LFN_Type = 0x00;
-            lfnEntries[currentEntry].LFN_Checksum = fn_checksum(entry.DIR_Name, entry.DIR_Ext);
-
-            chars = min(lfnlength, 6);
-            memset(&lfnEntries[currentEntry].LFN_Name2, 0, 12);
-            memcpy(&lfnEntries[currentEntry].LFN_Name2, lfn, chars * 2);
-            lfnlength -= chars;
-            lfn += chars * 2;
-
-            lfnEntries[currentEntry].LFN_Cluster_HI = 0x00;
-            lfnEntries[currentEntry].LFN_Cluster_LO = 0x00;
-
-            chars = min(lfnlength, 2);
-            memset(&lfnEntries[currentEntry].LFN_Name3, 0, 4);
-            memcpy(&lfnEntries[currentEntry].LFN_Name3, lfn, chars * 2);
-            lfnlength -= chars;
-            lfn += chars * 2;
-        }
-
-        dir_add_entry((unsigned char *)lfnEntries, lfnEntryCount);
-        free(lfnEntries);
-    }
+    //The long name comes back out of the path table when it's needed
+    child.path = path;
 
     //If this is a directory, add the directory bit
-    if (isDirectory)
+    //Otherwise set the "Archive" bit
+    child.attr = isDirectory ? DIR_Attr_Directory : DIR_Attr_Archive;
+
+    //A new directory needs its own first cluster on top of any for the entries
+    if (isDirectory && current_fat_position + 2 > fat_entries())
     {
-        entry.DIR_Attr |= DIR_Attr_Directory;
+        return;
     }
-    else
+
+    //Take the directory entries first. If they needed a new cluster
+    //our file ends up in the one after it
+    if (dir_add_entries(lfnEntryCount + 1, &child.slot) != 0)
     {
-        //Set the "Archive" bit
-        entry.DIR_Attr = DIR_Attr_Archive;
+        return;
     }
+    child.cluster = current_fat_position;
 
-    //entry.DIR_NRRes = 0x08 | 0x10; //Everything is lowercase
-
-    fat_find_free();
-
-    //If the directory entry for this file will require a cluster
-    //Then our file will end up in the next cluster after that
-    //So, we need to increase this now to generate the correct entry
-    uint32_t filePosition = current_fat_position;
-    uint32_t clusters_needed = dir_entry_sectors_needed(lfnEntryCount);
-    filePosition += clusters_needed;
-
-    entry.DIR_FstClusLO = (uint16_t)(filePosition & 0xFFFF);
-    entry.DIR_FstClusHI = (uint16_t)((filePosition & 0xFFFF0000) >> 16);
-    entry.DIR_FileSize = size;
-
-    //dir_add_entry wants a byte array so it can have multiple entries chained together
-    //We just cast the struct pointer and tell it how many there are (1 for short filename)
-
-    if (dir_add_entry((unsigned char *)&entry, 1) == 0)
+    if (!isDirectory)
     {
-        if (!isDirectory)
-        {
-            //Allocate the array for the actual data
-            fat_new_file(filePosition, 0, filepath, size);
-        }
-        else
+        //Allocate the array for the actual data
+        //If it doesn't fit, it shows up empty instead of pointing past the end
+        child.size = size;
+        if (fat_new_file(child.cluster, 0, path, size) != 0)
         {
-            //Make a new directory entry and change to it
-            Fat_Directory *new_dir = malloc(sizeof(Fat_Directory));
-            new_dir->path = filepath;
-            new_dir->dirtables = 0;
-            new_dir->current_dir_position = 0;
-            new_dir->parent = current_dir;
-            new_dir->dir_location = filePosition;
-            new_dir->files = 0;
-            current_dir = new_dir;
-
-            //Add the . and .. entries to this dir
-
-            DirEntry dotentry;
-            //Adding the . entry automatically maps the memory space for the first cluster of this
-            //dir entry
-            // .
-            memset(&dotentry, 0, sizeof(DirEntry));
-            dotentry.DIR_Attr = DIR_Attr_Archive | DIR_Attr_Directory;
-            dotentry.DIR_Name[0] = '.';
-            dotentry.DIR_FstClusLO = (uint16_t)(current_dir->dir_location & 0x00FF);
-            dotentry.DIR_FstClusHI = (uint16_t)(current_dir->dir_location & 0xFF00) >> 16;
-            dir_add_entry((unsigned char *)&dotentry, 1);
-
-            //..
-            dotentry.DIR_Name[1] = '.';
-            dotentry.DIR_FstClusLO = (uint16_t)(current_dir->parent->dir_location & 0x00FF);
-            dotentry.DIR_FstClusHI = (uint16_t)(current_dir->parent->dir_location & 0xFF00) >> 16;
-            dir_add_entry((unsigned char *)&dotentry, 1);
+            child.cluster = 0;
+            child.size = 0;
         }
+        dir_listing_add(current_dir->listing, &child);
     }
-    free(lfn_original);
-}
\ No newline at end of file
+    else
+    {
+        dir_listing_add(current_dir->listing, &child);
+
+        //Claim the first cluster of the new directory
+        fat_add_run(child.cluster, 1);
+        current_fat_position = child.cluster + 1;
+
+        //Make a new directory entry and change to it
+        //It starts with the . and .. entries
+        Fat_Directory *new_dir = malloc(sizeof(Fat_Directory));
+        new_dir->path = path;
+        new_dir->current_dir_position = 2;
+        new_dir->parent = current_dir;
+        new_dir->dir_location = child.cluster;
+        new_dir->listing = dir_listing_new(child.cluster,
+                                           current_dir == &root_dir ? 0 : current_dir->listing->first_cluster, 1);
+        new_dir->listing->path = path;
+        new_dir->listing->parent = current_dir->listing->id;
+        dir_map_cluster(new_dir->listing, child.cluster);
+        current_dir = new_dir;
+    }
+}
@@ -19,9 +19,7 @@
 
 #include <ctype.h>
 
-void fat_find_free();
-int fat_new_file(uint32_t file_fat_position, unsigned char *data, char *filepath, uint32_t length);
-int dir_entry_sectors_needed(uint32_t entries_needed);
-int dir_add_entry(unsigned char *entry, uint32_t length);
+int fat_new_file(uint32_t file_fat_position, unsigned char *data, uint32_t path, uint32_t length);
+int dir_add_entries(uint32_t count, uint32_t *slot);
 void up_dir();
-void add_file(char *name, char *filepath, uint32_t size, u_char isDirectory);
+void add_file(char *name, uint32_t path, uint32_t size, u_char isDirectory);
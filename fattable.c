@@ -0,0 +1,203 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vsfat.h"
+#include "address.h"
+#include "fattable.h"
+
+static FatRun *fat_runs = 0;
+static uint32_t fat_runs_count = 0;
+static uint32_t fat_runs_capacity = 0;
+
+static void fat_render(void *context, unsigned char *buf, uint64_t pos, uint32_t len);
+static RegionGenerator fat_generator = {fat_render, 0};
+
+//Number of entries in each FAT
+uint32_t fat_entries()
+{
+    return (bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec) / 4;
+}
+
+//Find the last run that starts at or before cluster, or -1 if there isn't one
+static int32_t fat_find_run(uint32_t cluster)
+{
+    uint32_t low = 0;
+    uint32_t high = fat_runs_count;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (fat_runs[mid].start <= cluster)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return (int32_t)low - 1;
+}
+
+//Chain count clusters together from start and end the chain there
+void fat_add_run(uint32_t start, uint32_t count)
+{
+    if (fat_runs_count == fat_runs_capacity)
+    {
+        fat_runs_capacity = fat_runs_capacity ? fat_runs_capacity * 2 : 256;
+        fat_runs = realloc(fat_runs, fat_runs_capacity * sizeof(FatRun));
+    }
+
+    //Clusters are handed out in order, so this is almost always an append
+    uint32_t at = fat_find_run(start) + 1;
+    memmove(&fat_runs[at + 1], &fat_runs[at],
+            (fat_runs_count - at) * sizeof(FatRun));
+    fat_runs[at].start = start;
+    fat_runs[at].count = count;
+    fat_runs[at].next = Fat_End_Of_Chain;
+    fat_runs_count++;
+}
+
+//Point the last cluster of a run at the start of the next piece of its chain
+void fat_link(uint32_t cluster, uint32_t next)
+{
+    int32_t run = fat_find_run(cluster);
+    if (run >= 0 && fat_runs[run].start + fat_runs[run].count - 1 == cluster)
+    {
+        fat_runs[run].next = next;
+    }
+}
+
+//All the runs, in order of their first cluster
+FatRun *fat_runs_get(uint32_t *count)
+{
+    *count = fat_runs_count;
+    return fat_runs;
+}
+
+//Replace the runs with a saved set, which has to be in order
+void fat_runs_set(FatRun *runs, uint32_t count)
+{
+    free(fat_runs);
+    fat_runs_capacity = count > 256 ? count : 256;
+    fat_runs = malloc(fat_runs_capacity * sizeof(FatRun));
+    memcpy(fat_runs, runs, count * sizeof(FatRun));
+    fat_runs_count = count;
+}
+
+//Map both copies of the FAT. They're generated from the same runs
+void fat_map()
+{
+    add_generated_region(address_from_fatsec(fat_location(0)),
+                         bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec,
+                         &fat_generator);
+    add_generated_region(address_from_fatsec(fat_location(1)),
+                         bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec,
+                         &fat_generator);
+}
+
+//Write the part of one entry that falls inside the buffer
+static void fat_put_partial(unsigned char *buf, uint64_t pos, uint32_t len,
+                            uint32_t entry, uint32_t value)
+{
+    unsigned char bytes[4];
+    memcpy(bytes, &value, 4);
+    for (uint32_t a = 0; a < 4; a++)
+    {
+        uint64_t at = (uint64_t)entry * 4 + a;
+        if (at >= pos && at < pos + len)
+        {
+            buf[at - pos] = bytes[a];
+        }
+    }
+}
+
+//Build the FAT entries covering pos to pos + len bytes
+static void fat_render(void *context, unsigned char *buf, uint64_t pos, uint32_t len)
+{
+    (void)context;
+    //These first two entries are part of the spec
+    static const uint32_t fatspecial[] = {0x0FFFFFF8, 0x0FFFFFFF};
+
+    uint32_t entry = pos / 4;
+    uint32_t last = (pos + len + 3) / 4;
+    int32_t run = fat_find_run(entry);
+    if (run < 0)
+    {
+        run = 0;
+    }
+
+    while (entry < last)
+    {
+        if (entry < 2)
+        {
+            fat_put_partial(buf, pos, len, entry, fatspecial[entry]);
+            entry++;
+            continue;
+        }
+
+        //Skip the runs that end before here
+        while ((uint32_t)run < fat_runs_count &&
+               fat_runs[run].start + fat_runs[run].count <= entry)
+        {
+            run++;
+        }
+        //Free clusters are 0, which the buffer already is
+        if ((uint32_t)run == fat_runs_count)
+        {
+            break;
+        }
+        if (fat_runs[run].start > entry)
+        {
+            entry = fat_runs[run].start;
+            continue;
+        }
+
+        //Inside a run each cluster points to the next, except the last
+        uint32_t run_end = fat_runs[run].start + fat_runs[run].count;
+        uint32_t stop = run_end < last ? run_end : last;
+        if ((uint64_t)entry * 4 < pos)
+        {
+            fat_put_partial(buf, pos, len, entry, entry + 1 == run_end ? fat_runs[run].next : entry + 1);
+            entry++;
+        }
+        //The whole entries in the middle are a simple sequence
+        uint32_t whole = stop;
+        if ((uint64_t)whole * 4 > pos + len)
+        {
+            whole--;
+        }
+        if (whole == run_end)
+        {
+            whole--;
+        }
+        unsigned char *out = buf + ((uint64_t)entry * 4 - pos);
+        for (uint32_t value = entry + 1; entry < whole; entry++, value++, out += 4)
+        {
+            memcpy(out, &value, 4);
+        }
+        for (; entry < stop; entry++)
+        {
+            fat_put_partial(buf, pos, len, entry, entry + 1 == run_end ? fat_runs[run].next : entry + 1);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef FATTABLE_H_INCLUDED
+#define FATTABLE_H_INCLUDED
+
+#include <stdint.h>
+
+//What the last cluster of a chain points to
+#define Fat_End_Of_Chain 0xFFFFFFFF
+
+//Every file is one contiguous run of clusters, and each directory cluster is
+//a run of its own. So instead of keeping the whole FAT around, we keep the runs
+//and work out the entries when a host reads them
+typedef struct FatRun
+{
+    uint32_t start;
+    uint32_t count;
+    uint32_t next; // What the last cluster of the run points to
+} FatRun;
+
+uint32_t fat_entries();
+void fat_add_run(uint32_t start, uint32_t count);
+void fat_link(uint32_t cluster, uint32_t next);
+FatRun *fat_runs_get(uint32_t *count);
+void fat_runs_set(FatRun *runs, uint32_t count);
+void fat_map();
+
+#endif /* FATTABLE_H_INCLUDED */
@@ -0,0 +1,245 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <linux/limits.h>
+
+#include "filecache.h"
+#include "address.h"
+#include "pathtable.h"
+
+//LRU cache of open descriptors for file backed address regions
+//Entries are linked by index, -1 ends a list
+typedef struct FileCacheEntry
+{
+    uint32_t region;
+    int fd;
+    int32_t newer;
+    int32_t older;
+    int32_t next; // Hash chain
+} FileCacheEntry;
+
+static FileCacheEntry *entries = 0;
+static uint32_t entries_max = 0;
+static uint32_t entries_used = 0; // Slots ever handed out
+static uint32_t entries_open = 0;
+static int32_t free_slots = -1;
+static int holding = 0;
+static uint32_t entries_held = 0;
+static int32_t *buckets = 0;
+static uint32_t bucket_mask = 0;
+static int32_t newest = -1;
+static int32_t oldest = -1;
+
+//Size the cache from RLIMIT_NOFILE, leaving some room for everyone else
+void file_cache_init()
+{
+    struct rlimit limit;
+    uint64_t max = File_Cache_Max_Entries;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    {
+        if (limit.rlim_cur > File_Cache_Reserved_FDs)
+        {
+            max = limit.rlim_cur - File_Cache_Reserved_FDs;
+        }
+        else
+        {
+            max = 1;
+        }
+        if (max > File_Cache_Max_Entries)
+        {
+            max = File_Cache_Max_Entries;
+        }
+    }
+    entries_max = max;
+    entries = malloc(entries_max * sizeof(FileCacheEntry));
+
+    //Power of two buckets, at least twice the entries so chains stay short
+    uint32_t bucket_count = 1;
+    while (bucket_count < entries_max * 2)
+    {
+        bucket_count <<= 1;
+    }
+    bucket_mask = bucket_count - 1;
+    buckets = malloc(bucket_count * sizeof(int32_t));
+    memset(buckets, 0xFF, bucket_count * sizeof(int32_t));
+}
+
+static void lru_unlink(int32_t e)
+{
+    if (entries[e].newer >= 0)
+    {
+        entries[entries[e].newer].older = entries[e].older;
+    }
+    else
+    {
+        newest = entries[e].older;
+    }
+    if (entries[e].older >= 0)
+    {
+        entries[entries[e].older].newer = entries[e].newer;
+    }
+    else
+    {
+        oldest = entries[e].newer;
+    }
+}
+
+static void lru_push(int32_t e)
+{
+    entries[e].newer = -1;
+    entries[e].older = newest;
+    if (newest >= 0)
+    {
+        entries[newest].newer = e;
+    }
+    newest = e;
+    if (oldest < 0)
+    {
+        oldest = e;
+    }
+}
+
+//Close the least recently used descriptor and hand back its slot
+static int32_t evict_oldest()
+{
+    int32_t e = oldest;
+    int32_t *link = &buckets[entries[e].region & bucket_mask];
+    while (*link != e)
+    {
+        link = &entries[*link].next;
+    }
+    *link = entries[e].next;
+    lru_unlink(e);
+    close(entries[e].fd);
+    return e;
+}
+
+//Return an open descriptor for a file backed region, or -1 if it can't be opened
+//The descriptor belongs to the cache, don't close it
+int file_cache_get(uint32_t region)
+{
+    int32_t e = buckets[region & bucket_mask];
+    while (e >= 0 && entries[e].region != region)
+    {
+        e = entries[e].next;
+    }
+    if (e >= 0)
+    {
+        if (e != newest)
+        {
+            lru_unlink(e);
+            lru_push(e);
+        }
+        if (holding)
+        {
+            entries_held++;
+        }
+        return entries[e].fd;
+    }
+
+    //Only the path table is kept, so the full path is put together to open it
+    char path[PATH_MAX];
+    if (path_build(address_regions[region].path, path, sizeof(path)) < 0)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    //Someone else is holding more descriptors than we left room for
+    //Give up ours until it fits, and don't grow past that point again
+    while (fd < 0 && (errno == EMFILE || errno == ENFILE) &&
+           entries_open > entries_held)
+    {
+        e = evict_oldest();
+        entries[e].next = free_slots;
+        free_slots = e;
+        entries_open--;
+        entries_max = entries_open > 0 ? entries_open : 1;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (entries_open >= entries_max && entries_open > entries_held)
+    {
+        e = evict_oldest();
+    }
+    else
+    {
+        entries_open++;
+        if (free_slots >= 0)
+        {
+            e = free_slots;
+            free_slots = entries[e].next;
+        }
+        else
+        {
+            e = entries_used++;
+        }
+    }
+    entries[e].region = region;
+    entries[e].fd = fd;
+    entries[e].next = buckets[region & bucket_mask];
+    buckets[region & bucket_mask] = e;
+    lru_push(e);
+    if (holding)
+    {
+        entries_held++;
+    }
+    return fd;
+}
+
+//While holding, every descriptor handed out stays open until we stop
+//Used while a batch of reads on them is still in flight
+void file_cache_hold(int hold)
+{
+    holding = hold;
+    entries_held = 0;
+}
+
+//Check if we're holding as many descriptors as we're allowed to have open
+//Nothing else can be handed out safely until the holds are released
+int file_cache_full()
+{
+    return holding && entries_held >= entries_max;
+}
+
+//Close everything we're holding
+void file_cache_close()
+{
+    while (oldest >= 0)
+    {
+        evict_oldest();
+    }
+    entries_used = 0;
+    entries_open = 0;
+    free_slots = -1;
+}
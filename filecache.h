@@ -0,0 +1,35 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef FILECACHE_H_INCLUDED
+#define FILECACHE_H_INCLUDED
+
+#include <stdint.h>
+
+//Descriptors we keep back from RLIMIT_NOFILE for the socket, stdio, etc.
+#define File_Cache_Reserved_FDs 32
+//Upper bound when the limit is huge or unlimited
+#define File_Cache_Max_Entries 4096
+
+void file_cache_init();
+int file_cache_get(uint32_t region);
+void file_cache_hold(int hold);
+int file_cache_full();
+void file_cache_close();
+
+#endif /* FILECACHE_H_INCLUDED */
@@ -0,0 +1,197 @@
+/*
+ * fileio - positional I/O helpers shared by the loopback backends
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fileio.h"
+
+/* Where a SIGBUS in this thread should land, while a mapped copy runs.
+ * Volatile, or the stores around the memcpy can be dropped as dead. */
+static __thread sigjmp_buf *volatile copy_fault;
+static pthread_once_t copy_guard = PTHREAD_ONCE_INIT;
+
+/* Read exactly `len' bytes at `offset'. Anything past the end of a regular
+ * file reads as zeros, the way an unwritten part of a disk would. Returns 0,
+ * or an errno value. */
+int pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+    ssize_t bytes_read;
+
+    while (len > 0)
+    {
+        bytes_read = pread(fd, buf, len, offset);
+        if (bytes_read == -1 && errno == EINTR)
+            continue;
+        if (bytes_read == -1)
+            return errno;
+        if (bytes_read == 0)
+        {
+            memset(buf, 0, len);
+            return 0;
+        }
+        len -= bytes_read;
+        offset += bytes_read;
+        buf = (char *)buf + bytes_read;
+    }
+
+    return 0;
+}
+
+/* Write exactly `len' bytes at `offset'. Returns 0, or an errno value. */
+int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    ssize_t bytes_written;
+
+    while (len > 0)
+    {
+        bytes_written = pwrite(fd, buf, len, offset);
+        if (bytes_written == -1 && errno == EINTR)
+            continue;
+        if (bytes_written <= 0)
+            return bytes_written == 0 ? EIO : errno;
+        len -= bytes_written;
+        offset += bytes_written;
+        buf = (const char *)buf + bytes_written;
+    }
+
+    return 0;
+}
+
+/* Scatter/gather version of the above. The iovec array is used up as the
+ * transfer goes. Reads past the end of a regular file give zeros. */
+static int pvec_all(int fd, struct iovec *iov, int iovcnt, uint64_t offset, int write)
+{
+    ssize_t done;
+
+    while (iovcnt > 0)
+    {
+        int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+
+        done = write ? pwritev(fd, iov, count, offset) : preadv(fd, iov, count, offset);
+        if (done == -1 && errno == EINTR)
+            continue;
+        if (done == -1)
+            return errno;
+        if (done == 0)
+        {
+            if (write)
+                return EIO;
+            for (; iovcnt > 0; iov++, iovcnt--)
+                memset(iov->iov_base, 0, iov->iov_len);
+            return 0;
+        }
+        offset += done;
+        while (iovcnt > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    return 0;
+}
+
+int preadv_all(int fd, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    return pvec_all(fd, iov, iovcnt, offset, 0);
+}
+
+int pwritev_all(int fd, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    return pvec_all(fd, iov, iovcnt, offset, 1);
+}
+
+/* Size of a block device or regular file, in bytes. */
+int fd_size(int fd, uint64_t *size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKGETSIZE64, size) == -1 ? -1 : 0;
+    if (S_ISREG(st.st_mode))
+    {
+        *size = st.st_size;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static void copy_fault_handler(int sig)
+{
+    if (copy_fault)
+        siglongjmp(*copy_fault, 1);
+    /* Not ours: crash the way the fault would have. */
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void install_copy_guard(void)
+{
+    struct sigaction sa;
+
+    /* SA_NODEFER, since jumping out of the handler doesn't restore the
+     * mask and a later fault must still get through. */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = copy_fault_handler;
+    sa.sa_flags = SA_NODEFER;
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/* memcpy to or from a shared file mapping. The kernel reports an I/O
+ * error, a full filesystem while filling a hole, or a page the file no
+ * longer has as SIGBUS on the access, so that is caught and turned into
+ * EIO. Part of the copy may have happened by then. Returns 0, or EIO. */
+int copy_mapped(void *dst, const void *src, size_t len)
+{
+    sigjmp_buf jump;
+
+    pthread_once(&copy_guard, install_copy_guard);
+    if (sigsetjmp(jump, 0))
+    {
+        copy_fault = NULL;
+        return EIO;
+    }
+    copy_fault = &jump;
+    memcpy(dst, src, len);
+    copy_fault = NULL;
+    return 0;
+}
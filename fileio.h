@@ -0,0 +1,35 @@
+/*
+ * fileio - positional I/O helpers shared by the loopback backends
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef FILEIO_H_INCLUDED
+#define FILEIO_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+int pread_all(int fd, void *buf, size_t len, uint64_t offset);
+int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset);
+int preadv_all(int fd, struct iovec *iov, int iovcnt, uint64_t offset);
+int pwritev_all(int fd, struct iovec *iov, int iovcnt, uint64_t offset);
+int fd_size(int fd, uint64_t *size);
+int copy_mapped(void *dst, const void *src, size_t len);
+
+#endif /* FILEIO_H_INCLUDED */
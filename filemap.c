@@ -0,0 +1,269 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "filemap.h"
+#include "filecache.h"
+#include "fileio.h"
+
+//LRU of mapped windows of source files, keyed by region and window number
+//Entries are linked by index, -1 ends a list
+typedef struct FileMapEntry
+{
+    uint32_t region;
+    uint32_t window;
+    unsigned char *mem;
+    uint32_t length; // Can be short, or 0, at the end of the file
+    int32_t newer;
+    int32_t older;
+    int32_t next; // Hash chain
+} FileMapEntry;
+
+static FileMapEntry *entries = 0;
+static uint32_t entries_max = 0;
+static uint32_t entries_used = 0;
+static int32_t *buckets = 0;
+static uint32_t bucket_mask = 0;
+static int32_t newest = -1;
+static int32_t oldest = -1;
+
+static uint32_t map_hash(uint32_t region, uint32_t window)
+{
+    return (region * 2654435761U + window) & bucket_mask;
+}
+
+//Size the window table from the address space and mapping count budgets
+void file_map_init()
+{
+    entries_max = File_Map_Budget / File_Map_Window;
+    if (entries_max > File_Map_Max_Windows)
+    {
+        entries_max = File_Map_Max_Windows;
+    }
+    entries = malloc(entries_max * sizeof(FileMapEntry));
+
+    uint32_t bucket_count = 1;
+    while (bucket_count < entries_max * 2)
+    {
+        bucket_count <<= 1;
+    }
+    bucket_mask = bucket_count - 1;
+    buckets = malloc(bucket_count * sizeof(int32_t));
+    memset(buckets, 0xFF, bucket_count * sizeof(int32_t));
+}
+
+static void lru_unlink(int32_t e)
+{
+    if (entries[e].newer >= 0)
+    {
+        entries[entries[e].newer].older = entries[e].older;
+    }
+    else
+    {
+        newest = entries[e].older;
+    }
+    if (entries[e].older >= 0)
+    {
+        entries[entries[e].older].newer = entries[e].newer;
+    }
+    else
+    {
+        oldest = entries[e].newer;
+    }
+}
+
+static void lru_push(int32_t e)
+{
+    entries[e].newer = -1;
+    entries[e].older = newest;
+    if (newest >= 0)
+    {
+        entries[newest].newer = e;
+    }
+    newest = e;
+    if (oldest < 0)
+    {
+        oldest = e;
+    }
+}
+
+//Unmap the least recently used window and hand back its slot
+static int32_t evict_oldest()
+{
+    int32_t e = oldest;
+    int32_t *link = &buckets[map_hash(entries[e].region, entries[e].window)];
+    while (*link != e)
+    {
+        link = &entries[*link].next;
+    }
+    *link = entries[e].next;
+    lru_unlink(e);
+    if (entries[e].length > 0)
+    {
+        munmap(entries[e].mem, entries[e].length);
+    }
+    return e;
+}
+
+//Map as much of one window as the file has now
+//Returns 0, or -1 with errno set
+static int map_range(uint32_t region, uint32_t window, unsigned char **mem, uint32_t *length)
+{
+    int fd = file_cache_get(region);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    //Touching a page past the end of a mapping raises SIGBUS, so only map
+    //what the file has. It can still shrink later, which file_map_copy
+    //catches and deals with by mapping the window again
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return -1;
+    }
+    uint64_t start = (uint64_t)window * File_Map_Window;
+    *length = 0;
+    if ((uint64_t)st.st_size > start)
+    {
+        *length = (uint64_t)st.st_size - start < File_Map_Window
+                      ? (uint64_t)st.st_size - start
+                      : File_Map_Window;
+    }
+
+    *mem = 0;
+    if (*length > 0)
+    {
+        *mem = mmap(0, *length, PROT_READ, MAP_SHARED, fd, start);
+        if (*mem == MAP_FAILED)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Map a window again after the file changed size under it
+//Returns 0, or -1 with errno set and the window left empty
+static int remap_window(int32_t e)
+{
+    if (entries[e].length > 0)
+    {
+        munmap(entries[e].mem, entries[e].length);
+    }
+    if (map_range(entries[e].region, entries[e].window, &entries[e].mem, &entries[e].length) != 0)
+    {
+        entries[e].mem = 0;
+        entries[e].length = 0;
+        return -1;
+    }
+    return 0;
+}
+
+//Find or create the mapping for one window of a region's file
+//Returns the entry, or -1 with errno set
+static int32_t map_window(uint32_t region, uint32_t window)
+{
+    uint32_t hash = map_hash(region, window);
+    int32_t e = buckets[hash];
+    while (e >= 0 && (entries[e].region != region || entries[e].window != window))
+    {
+        e = entries[e].next;
+    }
+    if (e >= 0)
+    {
+        if (e != newest)
+        {
+            lru_unlink(e);
+            lru_push(e);
+        }
+        return e;
+    }
+
+    unsigned char *mem;
+    uint32_t length;
+    if (map_range(region, window, &mem, &length) != 0)
+    {
+        return -1;
+    }
+
+    if (entries_used < entries_max)
+    {
+        e = entries_used++;
+    }
+    else
+    {
+        e = evict_oldest();
+    }
+    entries[e].region = region;
+    entries[e].window = window;
+    entries[e].mem = mem;
+    entries[e].length = length;
+    entries[e].next = buckets[hash];
+    buckets[hash] = e;
+    lru_push(e);
+    return e;
+}
+
+//Copy part of a file backed region out of its mappings
+//Anything past the end of the file is left alone, buf is expected to be zeroed
+//A window the file has shrunk out of faults on the copy, and is mapped again
+//at the new size, so the part that's gone reads as 0s
+//Returns 0, or an errno value if the file couldn't be mapped or read
+int file_map_copy(uint32_t region, void *buf, uint64_t pos, uint32_t len)
+{
+    while (len > 0)
+    {
+        uint32_t window = pos / File_Map_Window;
+        uint32_t inside = pos % File_Map_Window;
+        uint32_t chunk = File_Map_Window - inside < len ? File_Map_Window - inside : len;
+
+        int32_t e = map_window(region, window);
+        if (e < 0)
+        {
+            return errno ? errno : EIO;
+        }
+        for (int tries = 0; inside < entries[e].length; tries++)
+        {
+            uint32_t have = entries[e].length - inside;
+            if (copy_mapped(buf, entries[e].mem + inside, have < chunk ? have : chunk) == 0)
+            {
+                break;
+            }
+            if (tries > 0 || remap_window(e) != 0)
+            {
+                return EIO;
+            }
+        }
+
+        buf = (unsigned char *)buf + chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef FILEMAP_H_INCLUDED
+#define FILEMAP_H_INCLUDED
+
+#include <stdint.h>
+
+#include "vsfat.h"
+
+//Source files are mapped a window at a time, so big files don't need to fit
+//in the address space. Has to be a multiple of the page size
+#define File_Map_Window (4 * 1024 * 1024)
+
+//Most address space we'll keep mapped, a 32 bit board doesn't have much
+#if defined(ENV64BIT)
+#define File_Map_Budget (4ULL * 1024 * 1024 * 1024)
+#else
+#define File_Map_Budget (256ULL * 1024 * 1024)
+#endif
+
+//Most mappings we'll keep, well under the default vm.max_map_count
+#define File_Map_Max_Windows 1024
+
+void file_map_init();
+int file_map_copy(uint32_t region, void *buf, uint64_t pos, uint32_t len);
+
+#endif /* FILEMAP_H_INCLUDED */
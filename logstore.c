@@ -0,0 +1,563 @@
+/*
+ * logstore - log-structured write mode for loopback on flash
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "logstore.h"
+
+#define LOG_MAGIC 0x474f4c4553554201ULL
+#define LOG_DATA_BLOCKS (LOG_SEGMENT_BLOCKS - 1)
+#define LOG_NO_LBA UINT32_MAX
+/* Foreground writes start cleaning below this many free segments. One is
+ * kept back so the cleaner always has somewhere to move blocks to. */
+#define LOG_MIN_FREE 2
+
+enum
+{
+    SEG_FREE = 0,
+    SEG_SEALED,
+    SEG_OPEN
+};
+
+struct log_summary
+{
+    uint64_t magic;
+    uint64_t seq;
+    uint32_t seg_blocks;
+    uint32_t count;
+    uint32_t lba[LOG_DATA_BLOCKS];
+};
+
+struct seg_seq
+{
+    uint64_t seq;
+    uint32_t seg;
+};
+
+static int clean_one(struct log_device *dev, uint32_t max_live);
+
+static uint64_t seg_offset(uint32_t seg)
+{
+    return (uint64_t)seg * LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE;
+}
+
+static uint32_t phys_seg(uint32_t phys)
+{
+    return phys / LOG_SEGMENT_BLOCKS;
+}
+
+/* Background cleaning starts once free space drops below this. */
+static uint32_t high_water(struct log_device *dev)
+{
+    return dev->segments / 32 + LOG_MIN_FREE + 1;
+}
+
+/* Write whatever the open segment has gained since it was last written,
+ * data first and then the summary that makes it visible to replay. The data
+ * is synced in between: in a reused segment, a summary that got there first
+ * would map new blocks onto slots still holding the old ones. */
+static int sync_open(struct log_device *dev)
+{
+    struct log_summary *summary = (struct log_summary *)dev->open_buf;
+    int err = 0;
+
+    if (dev->open_used > dev->open_synced)
+        err = pwrite_all(dev->fd, dev->open_buf + (1 + dev->open_synced) * LOG_BLOCK_SIZE,
+                         (dev->open_used - dev->open_synced) * LOG_BLOCK_SIZE,
+                         seg_offset(dev->open) + (1 + dev->open_synced) * LOG_BLOCK_SIZE);
+    if (!err && dev->open_used > dev->open_synced && fdatasync(dev->fd) == -1)
+        err = errno;
+    if (err)
+        return err;
+    summary->count = dev->open_used > dev->open_kept ? dev->open_used : dev->open_kept;
+    err = pwrite_all(dev->fd, dev->open_buf, LOG_BLOCK_SIZE, seg_offset(dev->open));
+    if (!err)
+        dev->open_synced = dev->open_used;
+    return err;
+}
+
+/* Put the summary of a segment being reused on the media before any of its
+ * data blocks are overwritten. Until then the old summary would map blocks
+ * to slots holding new data after a crash. */
+static int start_segment(struct log_device *dev)
+{
+    int err = pwrite_all(dev->fd, dev->open_buf, LOG_BLOCK_SIZE, seg_offset(dev->open));
+
+    if (!err && fdatasync(dev->fd) == -1)
+        err = errno;
+    return err;
+}
+
+static int open_segment(struct log_device *dev)
+{
+    struct log_summary *summary = (struct log_summary *)dev->open_buf;
+    uint32_t seg = dev->open;
+
+    if (!dev->free_segments)
+        return ENOSPC;
+
+    /* Round robin from the last one, which spreads wear a little. */
+    do
+        seg = (seg + 1) % dev->segments;
+    while (dev->state[seg] != SEG_FREE);
+
+    dev->state[seg] = SEG_OPEN;
+    dev->free_segments--;
+    dev->open = seg;
+    dev->open_used = 0;
+    dev->open_synced = 0;
+    dev->open_kept = 0;
+
+    memset(summary, 0, LOG_BLOCK_SIZE);
+    summary->magic = LOG_MAGIC;
+    summary->seq = dev->next_seq++;
+    summary->seg_blocks = LOG_SEGMENT_BLOCKS;
+    memset(summary->lba, 0xff, sizeof(summary->lba));
+
+    if (dev->free_segments < high_water(dev))
+        pthread_cond_signal(&dev->wake);
+    return start_segment(dev);
+}
+
+/* Append one block for `lba' to the open segment and repoint the map at it.
+ * The cleaner passes `cleaning' so it can use the reserved segments. */
+static int append_block(struct log_device *dev, uint32_t lba, const unsigned char *data, int cleaning)
+{
+    struct log_summary *summary = (struct log_summary *)dev->open_buf;
+    uint32_t old;
+    uint32_t idx;
+    int err;
+
+    if (!cleaning)
+    {
+        for (uint32_t tries = 0; dev->free_segments < LOG_MIN_FREE && tries < dev->segments; tries++)
+            if (clean_one(dev, LOG_DATA_BLOCKS - 1) == -1)
+                break;
+    }
+
+    /* A compacted segment still holds its live blocks; skip over them. */
+    while (dev->open_used < LOG_DATA_BLOCKS && summary->lba[dev->open_used] != LOG_NO_LBA)
+        dev->open_used++;
+    if (dev->open_used == LOG_DATA_BLOCKS)
+    {
+        err = sync_open(dev);
+        if (err)
+            return err;
+        dev->state[dev->open] = SEG_SEALED;
+        err = open_segment(dev);
+        if (err)
+            return err;
+    }
+
+    idx = dev->open_used++;
+    memcpy(dev->open_buf + (1 + idx) * LOG_BLOCK_SIZE, data, LOG_BLOCK_SIZE);
+    summary->lba[idx] = lba;
+
+    /* Looked up late, since cleaning above may have moved the old copy. */
+    old = dev->map[lba];
+    if (old)
+        dev->live[phys_seg(old)]--;
+    dev->map[lba] = dev->open * LOG_SEGMENT_BLOCKS + 1 + idx;
+    dev->live[dev->open]++;
+    return 0;
+}
+
+/* Move the live blocks out of the sealed segment with the fewest, if that
+ * is no more than `max_live', and free it. Returns -1 if nothing qualifies. */
+static int clean_one(struct log_device *dev, uint32_t max_live)
+{
+    struct log_summary *summary = (struct log_summary *)dev->clean_buf;
+    uint32_t victim = dev->segments;
+
+    for (uint32_t seg = 0; seg < dev->segments; seg++)
+        if (dev->state[seg] == SEG_SEALED &&
+            (victim == dev->segments || dev->live[seg] < dev->live[victim]))
+            victim = seg;
+    if (victim == dev->segments || dev->live[victim] > max_live)
+        return -1;
+
+    if (dev->live[victim])
+    {
+        if (pread_all(dev->fd, dev->clean_buf, LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE, seg_offset(victim)))
+            return -1;
+        for (uint32_t i = 0; i < summary->count && i < LOG_DATA_BLOCKS; i++)
+        {
+            uint32_t lba = summary->lba[i];
+
+            if (lba == LOG_NO_LBA || lba >= dev->blocks ||
+                dev->map[lba] != victim * LOG_SEGMENT_BLOCKS + 1 + i)
+                continue;
+            if (append_block(dev, lba, dev->clean_buf + (1 + i) * LOG_BLOCK_SIZE, 1))
+                return -1;
+            dev->moved++;
+        }
+        /* The moved blocks must be on the media before the victim can be
+         * reused, or a crash could lose them. */
+        if (sync_open(dev) || fdatasync(dev->fd) == -1)
+            return -1;
+    }
+
+    dev->state[victim] = SEG_FREE;
+    dev->free_segments++;
+    dev->cleaned++;
+    return 0;
+}
+
+/* Used when a log is reopened with no free segment at all. There is
+ * nowhere to move live blocks to, so they stay where they are: the emptiest
+ * segment gets a new summary that keeps its live entries and drops the
+ * stale ones, and it is reopened with new blocks going into the freed slots.
+ * That summary is synced before any slot is overwritten, so a crash leaves
+ * either the old summary over untouched data or the new one. */
+static int compact_in_place(struct log_device *dev)
+{
+    struct log_summary *summary = (struct log_summary *)dev->open_buf;
+    uint32_t victim = 0;
+
+    for (uint32_t seg = 1; seg < dev->segments; seg++)
+        if (dev->live[seg] < dev->live[victim])
+            victim = seg;
+    if (dev->live[victim] == LOG_DATA_BLOCKS)
+        return ENOSPC;
+    int err = pread_all(dev->fd, dev->open_buf, LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE, seg_offset(victim));
+    if (err)
+        return err;
+
+    dev->state[victim] = SEG_OPEN;
+    dev->open = victim;
+    dev->open_used = 0;
+    dev->open_synced = 0;
+    dev->open_kept = 0;
+    for (uint32_t i = 0; i < LOG_DATA_BLOCKS; i++)
+    {
+        uint32_t lba = summary->lba[i];
+
+        if (i < summary->count && lba < dev->blocks &&
+            dev->map[lba] == victim * LOG_SEGMENT_BLOCKS + 1 + i)
+            dev->open_kept = i + 1;
+        else
+            summary->lba[i] = LOG_NO_LBA;
+    }
+    /* Newer than everything, so the blocks written here win at replay. */
+    summary->seq = dev->next_seq++;
+    summary->count = dev->open_kept;
+    return start_segment(dev);
+}
+
+static void *cleaner(void *arg)
+{
+    struct log_device *dev = arg;
+
+    pthread_mutex_lock(&dev->lock);
+    while (!dev->stopping)
+    {
+        /* Only bother with segments that are at least half stale; the
+         * foreground path takes anything when it's really out of space. */
+        if (dev->free_segments < high_water(dev) && clean_one(dev, LOG_DATA_BLOCKS / 2) == 0)
+        {
+            pthread_mutex_unlock(&dev->lock);
+            sched_yield();
+            pthread_mutex_lock(&dev->lock);
+            continue;
+        }
+        pthread_cond_wait(&dev->wake, &dev->lock);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+static int seq_compare(const void *a, const void *b)
+{
+    const struct seg_seq *left = a;
+    const struct seg_seq *right = b;
+
+    return left->seq < right->seq ? -1 : left->seq > right->seq;
+}
+
+/* Rebuild the map by replaying every valid summary, oldest first. */
+static int replay(struct log_device *dev)
+{
+    struct log_summary *summary = (struct log_summary *)dev->clean_buf;
+    struct seg_seq *order = malloc(dev->segments * sizeof(struct seg_seq));
+    uint32_t valid = 0;
+
+    if (!order)
+        return -1;
+    for (uint32_t seg = 0; seg < dev->segments; seg++)
+    {
+        if (pread_all(dev->fd, summary, LOG_BLOCK_SIZE, seg_offset(seg)))
+        {
+            free(order);
+            return -1;
+        }
+        if (summary->magic != LOG_MAGIC || summary->seg_blocks != LOG_SEGMENT_BLOCKS)
+            continue;
+        order[valid].seq = summary->seq;
+        order[valid].seg = seg;
+        valid++;
+    }
+    qsort(order, valid, sizeof(struct seg_seq), seq_compare);
+
+    for (uint32_t v = 0; v < valid; v++)
+    {
+        uint32_t seg = order[v].seg;
+
+        if (pread_all(dev->fd, summary, LOG_BLOCK_SIZE, seg_offset(seg)))
+        {
+            free(order);
+            return -1;
+        }
+        for (uint32_t i = 0; i < summary->count && i < LOG_DATA_BLOCKS; i++)
+            if (summary->lba[i] < dev->blocks)
+                dev->map[summary->lba[i]] = seg * LOG_SEGMENT_BLOCKS + 1 + i;
+        dev->state[seg] = SEG_SEALED;
+        dev->next_seq = order[v].seq + 1;
+    }
+    free(order);
+
+    for (uint64_t lba = 0; lba < dev->blocks; lba++)
+        if (dev->map[lba])
+            dev->live[phys_seg(dev->map[lba])]++;
+    for (uint32_t seg = 0; seg < dev->segments; seg++)
+    {
+        if (dev->state[seg] == SEG_SEALED && !dev->live[seg])
+            dev->state[seg] = SEG_FREE;
+        if (dev->state[seg] == SEG_FREE)
+            dev->free_segments++;
+    }
+    return 0;
+}
+
+int log_open(struct log_device *dev, const char *path, int debug)
+{
+    uint64_t raw;
+    uint32_t reserve;
+
+    memset(dev, 0, sizeof(struct log_device));
+    dev->debug = debug;
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd == -1 || fd_size(dev->fd, &raw) == -1)
+    {
+        fprintf(stderr, "Failed to open `%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Block addresses are 32 bits, which covers a little under 16T. */
+    if (raw / (LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE) > LOG_MAX_SEGMENTS)
+    {
+        fprintf(stderr, "Only the first %uM of `%s' will be used for the log\n",
+                LOG_MAX_SEGMENTS, path);
+        raw = (uint64_t)LOG_MAX_SEGMENTS * LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE;
+    }
+    dev->segments = raw / (LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE);
+    if (dev->segments < 16)
+    {
+        fprintf(stderr, "`%s' is too small for a log (16M minimum)\n", path);
+        return -1;
+    }
+    /* Over-provision by about 6%, which keeps cleaning cheap, plus the
+     * segments the cleaner keeps back and the open one. */
+    reserve = dev->segments / 16 + LOG_MIN_FREE + 1;
+    dev->blocks = (uint64_t)(dev->segments - reserve) * LOG_DATA_BLOCKS;
+    dev->size = dev->blocks * LOG_BLOCK_SIZE;
+
+    dev->map = calloc(dev->blocks, sizeof(uint32_t));
+    dev->live = calloc(dev->segments, sizeof(uint32_t));
+    dev->state = calloc(dev->segments, 1);
+    dev->open_buf = malloc(LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE);
+    dev->clean_buf = malloc(LOG_SEGMENT_BLOCKS * LOG_BLOCK_SIZE);
+    if (!dev->map || !dev->live || !dev->state || !dev->open_buf || !dev->clean_buf)
+        return -1;
+
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->wake, NULL);
+    if (replay(dev) == -1)
+    {
+        fprintf(stderr, "Failed to read the log summaries: %s\n", strerror(errno));
+        return -1;
+    }
+    dev->open = dev->segments - 1;
+    if (dev->free_segments ? open_segment(dev) : compact_in_place(dev))
+    {
+        fprintf(stderr, "The log on `%s' has no room left to write\n", path);
+        return -1;
+    }
+
+    return pthread_create(&dev->cleaner, NULL, cleaner, dev) ? -1 : 0;
+}
+
+int log_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct log_device *dev = userdata;
+    unsigned char *out = buf;
+    int err = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+
+    pthread_mutex_lock(&dev->lock);
+    while (len > 0 && !err)
+    {
+        uint32_t lba = offset / LOG_BLOCK_SIZE;
+        uint32_t inner = offset % LOG_BLOCK_SIZE;
+        uint32_t n = LOG_BLOCK_SIZE - inner;
+        uint32_t phys = dev->map[lba];
+
+        if (n > len)
+            n = len;
+
+        if (!phys)
+        {
+            memset(out, 0, n);
+        }
+        else if (phys_seg(phys) == dev->open)
+        {
+            memcpy(out, dev->open_buf + (phys % LOG_SEGMENT_BLOCKS) * LOG_BLOCK_SIZE + inner, n);
+        }
+        else
+        {
+            uint64_t start = (uint64_t)phys * LOG_BLOCK_SIZE + inner;
+
+            /* Blocks written together usually sit together, so extend the
+             * read over physically contiguous successors. */
+            while (n < len && lba + 1 < dev->blocks && dev->map[lba + 1] == phys + 1 &&
+                   phys_seg(phys + 1) == phys_seg(phys))
+            {
+                uint32_t step = len - n < LOG_BLOCK_SIZE ? len - n : LOG_BLOCK_SIZE;
+
+                lba++;
+                phys++;
+                n += step;
+            }
+            err = pread_all(dev->fd, out, n, start);
+        }
+
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+int log_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct log_device *dev = userdata;
+    const unsigned char *src = buf;
+    unsigned char block[LOG_BLOCK_SIZE];
+    int err = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "W - %lu, %u\n", offset, len);
+
+    while (len > 0 && !err)
+    {
+        uint32_t lba = offset / LOG_BLOCK_SIZE;
+        uint32_t inner = offset % LOG_BLOCK_SIZE;
+        uint32_t n = LOG_BLOCK_SIZE - inner;
+
+        if (n > len)
+            n = len;
+
+        if (n == LOG_BLOCK_SIZE)
+        {
+            pthread_mutex_lock(&dev->lock);
+            err = append_block(dev, lba, src, 0);
+            pthread_mutex_unlock(&dev->lock);
+        }
+        else
+        {
+            err = log_read(block, LOG_BLOCK_SIZE, (uint64_t)lba * LOG_BLOCK_SIZE, dev);
+            memcpy(block + inner, src, n);
+            pthread_mutex_lock(&dev->lock);
+            if (!err)
+                err = append_block(dev, lba, block, 0);
+            pthread_mutex_unlock(&dev->lock);
+        }
+
+        src += n;
+        offset += n;
+        len -= n;
+    }
+    return err;
+}
+
+/* Unmap whole blocks. This isn't written to the log, so after a restart a
+ * trimmed block may read back an earlier version of itself, which trim
+ * permits. It never reads another block's data: a segment's summary is
+ * replaced on the media before any of its slots are reused. */
+int log_trim(uint64_t from, uint32_t len, void *userdata)
+{
+    struct log_device *dev = userdata;
+    uint64_t first = (from + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE;
+    uint64_t last = (from + len) / LOG_BLOCK_SIZE;
+
+    if (dev->debug)
+        fprintf(stderr, "T - %lu, %u\n", from, len);
+
+    pthread_mutex_lock(&dev->lock);
+    for (uint64_t lba = first; lba < last && lba < dev->blocks; lba++)
+    {
+        if (!dev->map[lba])
+            continue;
+        dev->live[phys_seg(dev->map[lba])]--;
+        dev->map[lba] = 0;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return 0;
+}
+
+int log_flush(void *userdata)
+{
+    struct log_device *dev = userdata;
+    int err;
+
+    pthread_mutex_lock(&dev->lock);
+    err = sync_open(dev);
+    pthread_mutex_unlock(&dev->lock);
+    if (!err && fdatasync(dev->fd) == -1)
+        err = errno;
+    return err;
+}
+
+void log_disc(void *userdata)
+{
+    struct log_device *dev = userdata;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->stopping = 1;
+    pthread_cond_signal(&dev->wake);
+    pthread_mutex_unlock(&dev->lock);
+    pthread_join(dev->cleaner, NULL);
+
+    log_flush(dev);
+    fprintf(stderr, "log: %u of %u segments free, %lu cleaned, %lu blocks moved\n",
+            dev->free_segments, dev->segments, dev->cleaned, dev->moved);
+}
@@ -0,0 +1,77 @@
+/*
+ * logstore - log-structured write mode for loopback on flash
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef LOGSTORE_H_INCLUDED
+#define LOGSTORE_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOG_BLOCK_SIZE 4096
+#define LOG_SEGMENT_BLOCKS 256
+/* Most segments whose block addresses still fit the 32 bit map. */
+#define LOG_MAX_SEGMENTS ((UINT32_MAX - 1) / LOG_SEGMENT_BLOCKS)
+
+/*
+ * The backing store is cut into 1M segments. Block 0 of each segment is a
+ * summary naming the logical block held in each of the others, plus a
+ * sequence number. Writes only ever fill the open segment, front to back,
+ * so the media sees sequential writes whatever the host does. Replaying the
+ * summaries in sequence order rebuilds the logical to physical map, which is
+ * how the map persists. A cleaner thread moves the live blocks out of the
+ * emptiest segments so there is always somewhere to write.
+ */
+struct log_device
+{
+    int fd;
+    uint64_t size;
+    uint64_t blocks;
+    uint32_t segments;
+    uint32_t free_segments;
+    uint64_t next_seq;
+    /* logical block -> physical block, 0 when unmapped */
+    uint32_t *map;
+    uint32_t *live;
+    unsigned char *state;
+    /* the open segment, summary first, kept in memory until it's sealed */
+    uint32_t open;
+    uint32_t open_used;
+    uint32_t open_synced;
+    uint32_t open_kept; /* live blocks a compacted segment kept end here */
+    unsigned char *open_buf;
+    unsigned char *clean_buf;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t cleaner;
+    int stopping;
+    uint64_t moved;
+    uint64_t cleaned;
+    int debug;
+};
+
+int log_open(struct log_device *dev, const char *path, int debug);
+int log_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int log_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int log_trim(uint64_t from, uint32_t len, void *userdata);
+int log_flush(void *userdata);
+void log_disc(void *userdata);
+
+#endif /* LOGSTORE_H_INCLUDED */
@@ -21,34 +21,167 @@
 #define _LARGEFILE64_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <sys/mount.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "buse.h"
+#include "emulate.h"
+#include "extents.h"
+#include "fileio.h"
+#include "overlay.h"
+#include "logstore.h"
+#include "mapped.h"
+#include "tier.h"
+#include "stripe.h"
+#include "mirror.h"
+#include "wbcache.h"
+
+#define DIRECT_ALIGN 4096
 
 static int fd;
+static int loopback_debug = 0;
+static struct extent_map extents;
+static int have_extents = 0;
+static int direct = 0;
+/* Only needed when requests are served by several threads at once. */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rmw_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buse_qos qos;
+static struct buse_stats stats;
+static struct emu_device emu;
+static struct buse_operations emu_bop;
+static int emulate = 0;
+static struct overlay_device overlay;
+static struct log_device logdev;
+static int logmode = 0;
+static struct tier_device tier;
+static struct stripe_device stripe;
+static struct mirror_device mirror;
+static int mirrored = 0;
+static struct wb_device cache;
+static struct mapped_device mapped;
+static struct buse_operations cache_bop;
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage: loopback <phyical device> <virtual device>\n");
+    fprintf(stderr,
+            "Usage: loopback [options] <phyical device> <virtual device>\n"
+            "       loopback --stripe SIZE [options] <device>... <virtual device>\n"
+            "       loopback --mirror [options] <device>... <virtual device>\n"
+            "  --size SIZE      create the image file if needed and grow it, sparsely,\n"
+            "                   to at least SIZE bytes\n"
+            "  --threads N      serve up to N requests at once (default 1)\n"
+            "  --direct         bypass the page cache with O_DIRECT\n"
+            "  --mmap           serve requests by copying to and from a shared mapping\n"
+            "  --cache SIZE     acknowledge writes from up to SIZE bytes of memory and\n"
+            "                   write them back in sorted batches\n"
+            "  --overlay DELTA  open the device or image read-only and keep all\n"
+            "                   writes in the sparse file DELTA (copy-on-write)\n"
+            "  --chunk SIZE     overlay copy-up granularity (default 64K)\n"
+            "  --log            write the device or image as a log of 1M segments,\n"
+            "                   so the media only ever sees sequential writes\n"
+            "  --stripe SIZE    spread the virtual device over all the given devices\n"
+            "                   or images, SIZE bytes on each in turn\n"
+            "  --mirror         write every given device or image, read from the\n"
+            "                   least busy one\n"
+            "  --hedge MS       with --mirror, also read from another copy when the\n"
+            "                   first hasn't answered after MS milliseconds\n"
+            "  --tier RAM       keep up to RAM bytes of the hottest blocks in memory\n"
+            "                   and write them back in the background\n"
+            "  --qos SPEC       rate limit requests, e.g. read_iops=500,write_bps=8M\n"
+            "  --emulate SPEC   add the latency of sd, usbhdd or emmc media,\n"
+            "                   e.g. usbhdd,seek_max=25000,seed=7\n"
+            "  --debug          log every request\n"
+            "Send SIGUSR1 to print request and throttling statistics.\n");
+}
+
+/* With O_DIRECT the buffer, offset and length must all be multiples of
+ * this; anything else goes through an aligned bounce buffer. */
+static int is_aligned(const void *buf, uint32_t len, uint64_t offset)
+{
+    return ((uintptr_t)buf | len | offset) % DIRECT_ALIGN == 0;
+}
+
+static int file_read(void *buf, uint32_t len, uint64_t offset)
+{
+    uint64_t start = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+    size_t span = (offset + len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN - start;
+    void *bounce;
+    int err;
+
+    if (!direct || is_aligned(buf, len, offset))
+        return pread_all(fd, buf, len, offset);
+
+    if (posix_memalign(&bounce, DIRECT_ALIGN, span))
+        return ENOMEM;
+    err = pread_all(fd, bounce, span, start);
+    if (!err)
+        memcpy(buf, (char *)bounce + (offset - start), len);
+    free(bounce);
+    return err;
+}
+
+static int file_write(const void *buf, uint32_t len, uint64_t offset)
+{
+    uint64_t start = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+    size_t span = (offset + len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN - start;
+    void *bounce;
+    int err = 0;
+
+    if (!direct || is_aligned(buf, len, offset))
+        return pwrite_all(fd, buf, len, offset);
+
+    if (posix_memalign(&bounce, DIRECT_ALIGN, span))
+        return ENOMEM;
+    /* A partial block has to be read, patched and written back. Two of
+     * those on the same block at once would lose one of the writes. */
+    pthread_mutex_lock(&rmw_lock);
+    if (offset != start || len != span)
+        err = pread_all(fd, bounce, span, start);
+    if (!err)
+    {
+        memcpy((char *)bounce + (offset - start), buf, len);
+        err = pwrite_all(fd, bounce, span, start);
+    }
+    pthread_mutex_unlock(&rmw_lock);
+    free(bounce);
+    return err;
 }
 
 static int loopback_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
 {
-    int bytes_read;
     (void)(userdata);
 
-    lseek64(fd, offset, SEEK_SET);
+    /* On a sparse image, holes are filled in here rather than read. */
     while (len > 0)
     {
-        bytes_read = read(fd, buf, len);
-        assert(bytes_read > 0);
-        len -= bytes_read;
-        buf = (char *)buf + bytes_read;
+        int data = 1;
+        uint32_t run = len;
+        int err = 0;
+
+        pthread_mutex_lock(&map_lock);
+        if (have_extents)
+            run = extent_map_run(&extents, offset, len, &data);
+        pthread_mutex_unlock(&map_lock);
+
+        if (data)
+            err = file_read(buf, run, offset);
+        else
+            memset(buf, 0, run);
+        if (err)
+            return err;
+        len -= run;
+        offset += run;
+        buf = (char *)buf + run;
     }
 
     return 0;
@@ -56,53 +189,380 @@ static int loopback_read(void *buf, uint32_t len, uint64_t offset, void *userdat
 
 static int loopback_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
 {
-    int bytes_written;
     (void)(userdata);
 
-    lseek64(fd, offset, SEEK_SET);
-    while (len > 0)
+    pthread_mutex_lock(&map_lock);
+    if (have_extents && extent_map_add(&extents, offset, len) == -1)
+        have_extents = 0;
+    pthread_mutex_unlock(&map_lock);
+
+    return file_write(buf, len, offset);
+}
+
+/* On an image this punches a hole, so the file only keeps the space the
+ * guest is using; on a block device it's a discard. */
+static int loopback_trim(uint64_t from, uint32_t len, void *userdata)
+{
+    (void)(userdata);
+
+    /* Trim is only advice, so media that can't do it just ignore it. */
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, len) == -1)
+        return errno == EOPNOTSUPP ? 0 : errno;
+    pthread_mutex_lock(&map_lock);
+    if (have_extents)
+        extent_map_remove(&extents, from, len);
+    pthread_mutex_unlock(&map_lock);
+    return 0;
+}
+
+static int loopback_write_zeroes(uint64_t from, uint32_t len, void *userdata)
+{
+    static const char zeros[64 * 1024];
+    int err = 0;
+    (void)(userdata);
+
+    /* However it's done the range reads as zeros, which the map can call
+     * a hole even where the file system keeps zeroed blocks. */
+    pthread_mutex_lock(&map_lock);
+    if (have_extents)
+        extent_map_remove(&extents, from, len);
+    pthread_mutex_unlock(&map_lock);
+
+    /* Either of these is a metadata update rather than a write of `len'
+     * bytes; a hole reads back as zeros too. */
+    if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, from, len) == 0)
+        return 0;
+    if (errno == EOPNOTSUPP &&
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, len) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP)
     {
-        bytes_written = write(fd, buf, len);
-        assert(bytes_written > 0);
-        len -= bytes_written;
-        buf = (char *)buf + bytes_written;
+        /* It's unknown how much was zeroed, so stop trusting the map. */
+        err = errno;
+        pthread_mutex_lock(&map_lock);
+        have_extents = 0;
+        pthread_mutex_unlock(&map_lock);
+        return err;
     }
 
-    return 0;
+    while (len > 0 && !err)
+    {
+        uint32_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+
+        err = file_write(zeros, n, from);
+        from += n;
+        len -= n;
+    }
+    return err;
+}
+
+static int loopback_flush(void *userdata)
+{
+    (void)(userdata);
+
+    return fdatasync(fd) == -1 ? errno : 0;
 }
 
 static struct buse_operations bop = {
     .read = loopback_read,
-    .write = loopback_write};
+    .write = loopback_write,
+    .stats = &stats};
+
+static const struct option options[] = {
+    {"qos", required_argument, NULL, 'q'},
+    {"emulate", required_argument, NULL, 'e'},
+    {"debug", no_argument, NULL, 'd'},
+    {"size", required_argument, NULL, 'S'},
+    {"threads", required_argument, NULL, 'T'},
+    {"direct", no_argument, NULL, 'D'},
+    {"cache", required_argument, NULL, 'C'},
+    {"mmap", no_argument, NULL, 'M'},
+    {"overlay", required_argument, NULL, 'o'},
+    {"chunk", required_argument, NULL, 'c'},
+    {"log", no_argument, NULL, 'l'},
+    {"tier", required_argument, NULL, 't'},
+    {"stripe", required_argument, NULL, 's'},
+    {"mirror", no_argument, NULL, 'm'},
+    {"hedge", required_argument, NULL, 'h'},
+    {0, 0, 0, 0}};
 
 int main(int argc, char *argv[])
 {
     struct stat buf;
-    int err;
-    int64_t size;
+    uint64_t size;
+    uint64_t image_size = 0;
+    int opt;
+    const char *delta = NULL;
+    uint64_t chunk = OVERLAY_DEFAULT_CHUNK;
+    uint64_t ram = 0;
+    uint64_t stripe_size = 0;
+    unsigned long hedge_ms = 0;
+    unsigned long threads = 1;
+    uint64_t cache_size = 0;
+    int use_mmap = 0;
+    const struct buse_operations *ops = &bop;
+    char *end;
+    void *userdata = NULL;
+
+    while ((opt = getopt_long(argc, argv, "q:e:dS:T:DC:Mo:c:lt:s:mh:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            if (buse_parse_qos(&qos, optarg) == -1)
+            {
+                fprintf(stderr, "Invalid QoS specification `%s'\n", optarg);
+                return -1;
+            }
+            bop.qos = &qos;
+            break;
+        case 'e':
+            if (emu_parse(&emu.config, optarg) == -1)
+            {
+                fprintf(stderr, "Invalid emulation profile `%s'\n", optarg);
+                return -1;
+            }
+            emulate = 1;
+            break;
+        case 'd':
+            loopback_debug = 1;
+            bop.debug = 1;
+            break;
+        case 'S':
+            if (buse_parse_amount(optarg, &image_size) == -1 || image_size == 0)
+            {
+                fprintf(stderr, "Invalid size `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'T':
+            threads = strtoul(optarg, &end, 10);
+            if (*end || threads == 0 || threads > 1024)
+            {
+                fprintf(stderr, "Invalid thread count `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'D':
+            direct = 1;
+            break;
+        case 'C':
+            if (buse_parse_amount(optarg, &cache_size) == -1 || cache_size == 0)
+            {
+                fprintf(stderr, "Invalid cache size `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'M':
+            use_mmap = 1;
+            break;
+        case 'o':
+            delta = optarg;
+            break;
+        case 'c':
+            if (buse_parse_amount(optarg, &chunk) == -1 || chunk > UINT32_MAX)
+            {
+                fprintf(stderr, "Invalid chunk size `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'l':
+            logmode = 1;
+            break;
+        case 't':
+            if (buse_parse_amount(optarg, &ram) == -1 || ram == 0)
+            {
+                fprintf(stderr, "Invalid RAM tier size `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 's':
+            if (buse_parse_amount(optarg, &stripe_size) == -1 || stripe_size == 0 || stripe_size > UINT32_MAX)
+            {
+                fprintf(stderr, "Invalid stripe size `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm':
+            mirrored = 1;
+            break;
+        case 'h':
+            hedge_ms = strtoul(optarg, &end, 10);
+            if (*end || hedge_ms == 0 || hedge_ms > 60000)
+            {
+                fprintf(stderr, "Invalid hedge delay `%s'\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
 
-    if (argc != 3)
+    if (argc - optind < 2 || (argc - optind != 2 && !stripe_size && !mirrored))
     {
         usage();
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR | O_LARGEFILE);
-    assert(fd != -1);
+    if ((delta != NULL) + logmode + (ram != 0) + (stripe_size != 0) + mirrored > 1)
+    {
+        fprintf(stderr, "Only one of --overlay, --log, --tier, --stripe and --mirror can be used\n");
+        return -1;
+    }
+    if ((image_size || threads > 1 || direct || cache_size || use_mmap) && (delta || logmode || ram || stripe_size || mirrored))
+    {
+        fprintf(stderr, "--size, --threads, --direct, --cache and --mmap only apply to a single device or image\n");
+        return -1;
+    }
+    if (use_mmap && direct)
+    {
+        fprintf(stderr, "--mmap goes through the page cache, so it can't be used with --direct\n");
+        return -1;
+    }
+    if (threads > 1 && emulate)
+    {
+        fprintf(stderr, "--emulate models a single queue, so it can't be used with --threads\n");
+        return -1;
+    }
+    if (hedge_ms && !mirrored)
+    {
+        fprintf(stderr, "--hedge only applies to --mirror\n");
+        return -1;
+    }
 
-    /* Let's verify that this file is actually a block device. We could support
-     * regular files, too, but we don't need to right now. */
-    fstat(fd, &buf);
-    assert(S_ISBLK(buf.st_mode));
+    if (delta)
+    {
+        /* The base may be a device or an image file; it is only ever read. */
+        if (overlay_open(&overlay, argv[optind], delta, chunk, loopback_debug) == -1)
+            return -1;
+        fprintf(stderr, "The size of this device is %lu bytes.\n", overlay.size);
+        bop.size = overlay.size;
+        bop.read = overlay_read;
+        bop.write = overlay_write;
+        bop.trim = overlay_trim;
+        bop.flush = overlay_flush;
+        bop.disc = overlay_disc;
+        userdata = &overlay;
+    }
+    else if (logmode)
+    {
+        /* Part of the backing store is held back as cleaning headroom. */
+        if (log_open(&logdev, argv[optind], loopback_debug) == -1)
+            return -1;
+        fprintf(stderr, "The size of this device is %lu bytes.\n", logdev.size);
+        bop.size = logdev.size;
+        bop.read = log_read;
+        bop.write = log_write;
+        bop.trim = log_trim;
+        bop.flush = log_flush;
+        bop.disc = log_disc;
+        userdata = &logdev;
+    }
+    else if (ram)
+    {
+        if (tier_open(&tier, argv[optind], ram, loopback_debug) == -1)
+            return -1;
+        fprintf(stderr, "The size of this device is %lu bytes.\n", tier.size);
+        bop.size = tier.size;
+        bop.read = tier_read;
+        bop.write = tier_write;
+        bop.flush = tier_flush;
+        bop.disc = tier_disc;
+        userdata = &tier;
+    }
+    else if (stripe_size)
+    {
+        if (stripe_open(&stripe, argv + optind, argc - optind - 1, stripe_size, loopback_debug) == -1)
+            return -1;
+        fprintf(stderr, "The size of this device is %lu bytes.\n", stripe.size);
+        bop.size = stripe.size;
+        bop.read = stripe_read;
+        bop.write = stripe_write;
+        bop.flush = stripe_flush;
+        bop.disc = stripe_disc;
+        userdata = &stripe;
+    }
+    else if (mirrored)
+    {
+        if (mirror_open(&mirror, argv + optind, argc - optind - 1, hedge_ms * 1000, loopback_debug) == -1)
+            return -1;
+        fprintf(stderr, "The size of this device is %lu bytes.\n", mirror.size);
+        bop.size = mirror.size;
+        bop.read = mirror_read;
+        bop.write = mirror_write;
+        bop.flush = mirror_flush;
+        bop.disc = mirror_disc;
+        userdata = &mirror;
+    }
+    else
+    {
+        fd = open(argv[optind], O_RDWR | O_LARGEFILE | (image_size ? O_CREAT : 0) | (direct ? O_DIRECT : 0), 0644);
+        if (fd == -1 || fstat(fd, &buf) == -1)
+        {
+            fprintf(stderr, "Failed to open `%s': %s\n", argv[optind], strerror(errno));
+            return -1;
+        }
 
-    /* Figure out the size of the underlying block device. */
-    err = ioctl(fd, BLKGETSIZE64, &size);
-    assert(err != -1);
-    (void)err;
-    fprintf(stderr, "The size of this device is %ld bytes.\n", size);
-    bop.size = size;
+        /* Block devices and image files both work. Growing an image only
+         * moves its end, so the new space is a hole until it's written. */
+        if (image_size && S_ISREG(buf.st_mode) && (uint64_t)buf.st_size < image_size &&
+            ftruncate(fd, image_size) == -1)
+        {
+            fprintf(stderr, "Failed to grow `%s': %s\n", argv[optind], strerror(errno));
+            return -1;
+        }
+        if (fd_size(fd, &size) == -1)
+        {
+            fprintf(stderr, "`%s' is neither a block device nor a regular file\n", argv[optind]);
+            return -1;
+        }
+        fprintf(stderr, "The size of this device is %lu bytes.\n", size);
+        if (direct && size % DIRECT_ALIGN)
+        {
+            fprintf(stderr, "--direct needs a size that is a multiple of %d bytes\n", DIRECT_ALIGN);
+            return -1;
+        }
+        /* Holes come out of a mapping as zeros without any help. */
+        if (!use_mmap && S_ISREG(buf.st_mode) && extent_map_load(&extents, fd) == 0)
+        {
+            have_extents = 1;
+            fprintf(stderr, "The image has %zu allocated extents.\n", extents.count);
+        }
+        bop.size = size;
+        bop.trim = loopback_trim;
+        bop.write_zeroes = loopback_write_zeroes;
+        bop.flush = loopback_flush;
+        /* Everything above is positional I/O, so requests can overlap. */
+        bop.threads = threads;
+
+        if (use_mmap)
+        {
+            if (mapped_open(&mapped, fd, size, loopback_debug) == -1)
+                return -1;
+            bop.read = mapped_read;
+            bop.write = mapped_write;
+            bop.flush = mapped_flush;
+            bop.disc = mapped_disc;
+            userdata = &mapped;
+        }
+    }
 
-    buse_main(argv[2], &bop, NULL);
+    if (cache_size)
+    {
+        if (wb_wrap(&cache, &cache_bop, ops, userdata, cache_size) == -1)
+            return -1;
+        ops = &cache_bop;
+        userdata = &cache;
+    }
+    if (emulate)
+    {
+        emu_wrap(&emu, &emu_bop, ops, userdata);
+        ops = &emu_bop;
+        userdata = &emu;
+    }
+    buse_main(argv[argc - 1], ops, userdata);
 
     return 0;
 }
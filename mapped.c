@@ -0,0 +1,170 @@
+/*
+ * mapped - serve a loopback device or image through mmap
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "mapped.h"
+
+/* Requests in a row that must follow on, or not, before the advice for
+ * the mapping is changed. */
+#define MAPPED_STREAK 8
+/* How far ahead of a sequential reader to ask for pages. */
+#define MAPPED_READAHEAD (4 * 1024 * 1024)
+
+/* Adjust the kernel's readahead to what the host seems to be doing. This
+ * is only a hint, so when another thread is already at it, skip it. */
+static void advise(struct mapped_device *dev, uint64_t offset, uint32_t len)
+{
+    int advice;
+
+    if (pthread_mutex_trylock(&dev->hint_lock))
+        return;
+
+    if (offset == dev->next_offset)
+    {
+        dev->sequential++;
+        dev->random = 0;
+    }
+    else
+    {
+        dev->random++;
+        dev->sequential = 0;
+    }
+    dev->next_offset = offset + len;
+
+    advice = dev->advice;
+    if (dev->sequential >= MAPPED_STREAK)
+        advice = MADV_SEQUENTIAL;
+    else if (dev->random >= MAPPED_STREAK)
+        advice = MADV_RANDOM;
+    if (advice != dev->advice)
+    {
+        madvise(dev->base, dev->size, advice);
+        dev->advice = advice;
+    }
+
+    if (dev->advice == MADV_SEQUENTIAL && offset + len < dev->size)
+    {
+        uint64_t start = (offset + len) & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+        uint64_t ahead = dev->size - start < MAPPED_READAHEAD ? dev->size - start : MAPPED_READAHEAD;
+
+        madvise(dev->base + start, ahead, MADV_WILLNEED);
+    }
+    pthread_mutex_unlock(&dev->hint_lock);
+}
+
+int mapped_open(struct mapped_device *dev, int fd, uint64_t size, int debug)
+{
+    memset(dev, 0, sizeof(struct mapped_device));
+    dev->debug = debug;
+    dev->fd = fd;
+    dev->size = size;
+    dev->advice = MADV_NORMAL;
+    pthread_mutex_init(&dev->hint_lock, NULL);
+
+    dev->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (dev->base == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map the device: %s\n", strerror(errno));
+        return -1;
+    }
+    dev->words = ((size + MAPPED_CHUNK - 1) / MAPPED_CHUNK + 63) / 64;
+    dev->dirty = calloc(dev->words, sizeof(uint64_t));
+    return dev->dirty ? 0 : -1;
+}
+
+int mapped_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct mapped_device *dev = userdata;
+
+    if (dev->debug)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+    advise(dev, offset, len);
+    return copy_mapped(buf, dev->base + offset, len);
+}
+
+int mapped_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct mapped_device *dev = userdata;
+    int err;
+
+    if (dev->debug)
+        fprintf(stderr, "W - %lu, %u\n", offset, len);
+    advise(dev, offset, len);
+    /* Filling a hole can fail for want of space, which is only reported
+     * by the fault; the chunk is still marked so a flush reports it too. */
+    err = copy_mapped(dev->base + offset, buf, len);
+
+    /* Requests may be served by several threads, so set bits atomically.
+     * A flush clears a word before syncing its chunks, so a bit set while
+     * it runs is kept for the next one. */
+    for (uint64_t c = offset / MAPPED_CHUNK; len && c <= (offset + len - 1) / MAPPED_CHUNK; c++)
+        __atomic_fetch_or(&dev->dirty[c / 64], 1ULL << (c % 64), __ATOMIC_RELEASE);
+    return err;
+}
+
+int mapped_flush(void *userdata)
+{
+    struct mapped_device *dev = userdata;
+    int err = 0;
+
+    for (uint64_t w = 0; w < dev->words; w++)
+    {
+        uint64_t bits = __atomic_exchange_n(&dev->dirty[w], 0, __ATOMIC_ACQUIRE);
+
+        while (bits)
+        {
+            uint64_t c = w * 64 + __builtin_ctzll(bits);
+            uint64_t start = c * MAPPED_CHUNK;
+            uint64_t len = dev->size - start < MAPPED_CHUNK ? dev->size - start : MAPPED_CHUNK;
+
+            bits &= bits - 1;
+            if (msync(dev->base + start, len, MS_SYNC) == -1)
+            {
+                if (!err)
+                    err = errno;
+                /* Keep it dirty so the next flush tries again. */
+                __atomic_fetch_or(&dev->dirty[w], 1ULL << (c % 64), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    /* msync covers the data; this covers the file's own metadata. */
+    if (!err && fdatasync(dev->fd) == -1)
+        err = errno;
+    return err;
+}
+
+void mapped_disc(void *userdata)
+{
+    struct mapped_device *dev = userdata;
+
+    mapped_flush(dev);
+    munmap(dev->base, dev->size);
+}
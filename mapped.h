@@ -0,0 +1,57 @@
+/*
+ * mapped - serve a loopback device or image through mmap
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef MAPPED_H_INCLUDED
+#define MAPPED_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Dirty tracking granularity; a flush msyncs whole chunks. */
+#define MAPPED_CHUNK (1024 * 1024)
+
+/* The whole device or image is mapped shared, so reads and writes are a
+ * memcpy and the page cache does the I/O. Writes set a bit per chunk, and
+ * a flush only syncs chunks with their bit set. Errors the kernel raises as
+ * SIGBUS during a copy come back as EIO. */
+struct mapped_device
+{
+    int fd;
+    uint64_t size;
+    unsigned char *base;
+    uint64_t *dirty;
+    uint64_t words;
+    /* access pattern tracking for madvise, guarded by `hint_lock' */
+    pthread_mutex_t hint_lock;
+    uint64_t next_offset;
+    uint32_t sequential;
+    uint32_t random;
+    int advice;
+    int debug;
+};
+
+int mapped_open(struct mapped_device *dev, int fd, uint64_t size, int debug);
+int mapped_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int mapped_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int mapped_flush(void *userdata);
+void mapped_disc(void *userdata);
+
+#endif /* MAPPED_H_INCLUDED */
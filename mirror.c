@@ -0,0 +1,561 @@
+/*
+ * mirror - RAID1 mirroring with hedged reads for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "mirror.h"
+
+/* One request from buse, possibly in flight on several members at once.
+ * It's freed when the caller and every job are done with it, since a
+ * hedged read can return while the slow copy is still running. */
+struct mirror_request
+{
+    int refs;
+    int pending;
+    int winner;
+    int succeeded;
+    int err;
+    void *result;
+};
+
+struct mirror_job
+{
+    struct mirror_job *next;
+    struct mirror_request *req;
+    int write;
+    /* reads land in a private buffer, writes come from the caller's */
+    void *data;
+    uint32_t len;
+    uint64_t offset;
+};
+
+static void put_request(struct mirror_request *req)
+{
+    if (--req->refs == 0)
+    {
+        free(req->result);
+        free(req);
+    }
+}
+
+#define MIRROR_MAGIC 0x5352524f5252494dULL
+#define LABEL_SIZE 4096
+/* Copy size when bringing a stale member up to date. */
+#define RESYNC_CHUNK (1024 * 1024)
+
+static int write_label(struct mirror_device *dev, struct mirror_member *m)
+{
+    unsigned char block[LABEL_SIZE] = {0};
+    struct mirror_label label = {MIRROR_MAGIC, dev->set_id, dev->events, dev->failed,
+                                 dev->count, m - dev->members};
+    int err;
+
+    memcpy(block, &label, sizeof(label));
+    err = pwrite_all(m->fd, block, LABEL_SIZE, m->label_at);
+    if (!err && fdatasync(m->fd) == -1)
+        err = errno;
+    return err;
+}
+
+/* Stamp every healthy member with a new event count. A member whose label
+ * can't be written is dropped too, and the rest are stamped again so that
+ * they all record it. Returns how many members are left. */
+static uint32_t save_labels(struct mirror_device *dev)
+{
+    uint32_t healthy;
+
+again:
+    dev->events++;
+    healthy = 0;
+    for (uint32_t i = 0; i < dev->count; i++)
+    {
+        struct mirror_member *m = &dev->members[i];
+        int err;
+
+        if (m->failed)
+            continue;
+        err = write_label(dev, m);
+        if (err)
+        {
+            fprintf(stderr, "mirror: dropping member %u: %s\n", i, strerror(err));
+            m->failed = 1;
+            dev->failed |= 1ULL << i;
+            goto again;
+        }
+        healthy++;
+    }
+    return healthy;
+}
+
+/* Called with the lock held. The drop is on the survivors' labels before
+ * this returns, so a restart can't bring the member back with old data. */
+static void drop_member(struct mirror_member *m, int err)
+{
+    struct mirror_device *dev = m->dev;
+
+    if (m->failed)
+        return;
+    fprintf(stderr, "mirror: dropping member %ld: %s\n", (long)(m - dev->members), strerror(err));
+    m->failed = 1;
+    dev->failed |= 1ULL << (m - dev->members);
+    save_labels(dev);
+}
+
+static int queue_job(struct mirror_member *m, struct mirror_request *req, int write,
+                     const void *data, uint32_t len, uint64_t offset)
+{
+    struct mirror_job *job = calloc(1, sizeof(struct mirror_job));
+
+    if (!job)
+        return ENOMEM;
+    job->req = req;
+    job->write = write;
+    job->len = len;
+    job->offset = offset;
+    job->data = write ? (void *)data : malloc(len);
+    if (!job->data)
+    {
+        free(job);
+        return ENOMEM;
+    }
+
+    req->refs++;
+    req->pending++;
+    m->outstanding++;
+    if (m->tail)
+        m->tail->next = job;
+    else
+        m->head = job;
+    m->tail = job;
+    pthread_cond_signal(&m->work);
+    return 0;
+}
+
+/* Called with the lock held once a job has run, or been skipped. */
+static void finish_job(struct mirror_member *m, struct mirror_job *job, int err)
+{
+    struct mirror_request *req = job->req;
+
+    m->outstanding--;
+    req->pending--;
+    if (err)
+    {
+        drop_member(m, err);
+        req->err = err;
+    }
+    else if (job->write)
+    {
+        req->succeeded++;
+    }
+    else if (req->winner == -1)
+    {
+        req->winner = m - m->dev->members;
+        req->result = job->data;
+        job->data = NULL;
+    }
+
+    if (!job->write)
+        free(job->data);
+    free(job);
+    put_request(req);
+    pthread_cond_broadcast(&m->dev->done);
+}
+
+static void *member_thread(void *arg)
+{
+    struct mirror_member *m = arg;
+    struct mirror_device *dev = m->dev;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;)
+    {
+        struct mirror_job *job;
+        int err;
+
+        while (!m->head && !dev->stopping)
+            pthread_cond_wait(&m->work, &dev->lock);
+        if (!m->head)
+            break;
+        job = m->head;
+        m->head = job->next;
+        if (!m->head)
+            m->tail = NULL;
+
+        /* A read someone else already answered needn't touch the disk. */
+        if (!job->write && job->req->winner != -1)
+        {
+            finish_job(m, job, 0);
+            continue;
+        }
+
+        pthread_mutex_unlock(&dev->lock);
+        if (job->write)
+            err = pwrite_all(m->fd, job->data, job->len, job->offset);
+        else
+            err = pread_all(m->fd, job->data, job->len, job->offset);
+        pthread_mutex_lock(&dev->lock);
+
+        if (job->write)
+            m->writes++;
+        else
+            m->reads++;
+        finish_job(m, job, err);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+/* The healthy member with the fewest jobs in flight that isn't in `tried',
+ * starting from a rotating point so equal members share the load. */
+static int pick_member(struct mirror_device *dev, uint64_t tried)
+{
+    int best = -1;
+
+    for (uint32_t i = 0; i < dev->count; i++)
+    {
+        uint32_t idx = (dev->next + i) % dev->count;
+        struct mirror_member *m = &dev->members[idx];
+
+        if (m->failed || (tried >> idx) & 1)
+            continue;
+        if (best == -1 || m->outstanding < dev->members[best].outstanding)
+            best = idx;
+    }
+    dev->next++;
+    return best;
+}
+
+/* Copy the whole virtual device from one member to another. */
+static int resync(struct mirror_device *dev, uint32_t from, uint32_t to)
+{
+    unsigned char *buf = malloc(RESYNC_CHUNK);
+    int err = buf ? 0 : ENOMEM;
+
+    fprintf(stderr, "mirror: copying member %u to member %u\n", from, to);
+    for (uint64_t off = 0; off < dev->size && !err; off += RESYNC_CHUNK)
+    {
+        uint32_t n = dev->size - off < RESYNC_CHUNK ? dev->size - off : RESYNC_CHUNK;
+
+        err = pread_all(dev->members[from].fd, buf, n, off);
+        if (!err)
+            err = pwrite_all(dev->members[to].fd, buf, n, off);
+    }
+    if (!err && fdatasync(dev->members[to].fd) == -1)
+        err = errno;
+    free(buf);
+    return err;
+}
+
+/* Work out which members are current from their labels and copy the rest
+ * from one that is. A new mirror is taken from its first member. */
+static int check_labels(struct mirror_device *dev)
+{
+    struct mirror_label *labels = calloc(dev->count, sizeof(struct mirror_label));
+    int current = -1;
+    int err = 0;
+
+    if (!labels)
+        return -1;
+    for (uint32_t i = 0; i < dev->count; i++)
+    {
+        struct mirror_member *m = &dev->members[i];
+
+        if (pread_all(m->fd, &labels[i], sizeof(struct mirror_label), m->label_at))
+            labels[i].magic = 0;
+        if (labels[i].magic == MIRROR_MAGIC &&
+            (current == -1 || labels[i].events > labels[current].events))
+            current = i;
+    }
+
+    if (current == -1)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        dev->set_id = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        dev->set_id ^= (uint64_t)getpid() << 32;
+        fprintf(stderr, "mirror: starting a new mirror\n");
+    }
+    else
+    {
+        dev->set_id = labels[current].set_id;
+        dev->events = labels[current].events;
+        dev->failed = labels[current].failed;
+        if (labels[current].count != dev->count)
+        {
+            fprintf(stderr, "This mirror was set up with %u members\n", labels[current].count);
+            err = -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < dev->count && !err; i++)
+    {
+        struct mirror_label *label = &labels[i];
+
+        if (label->magic != MIRROR_MAGIC)
+            continue;
+        if (label->set_id != dev->set_id)
+        {
+            fprintf(stderr, "Member %u belongs to another mirror\n", i);
+            err = -1;
+        }
+        else if (label->member != i)
+        {
+            fprintf(stderr, "Member %u was given as member %u before\n", i, label->member);
+            err = -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < dev->count && !err; i++)
+    {
+        uint32_t from = current == -1 ? 0 : current;
+        int stale = labels[i].magic != MIRROR_MAGIC || labels[i].events < dev->events ||
+                    ((dev->failed >> i) & 1);
+
+        if (i == from || !stale)
+            continue;
+        err = resync(dev, from, i);
+        if (err)
+            fprintf(stderr, "Failed to bring member %u up to date: %s\n", i, strerror(err));
+    }
+    free(labels);
+    if (err)
+        return -1;
+
+    dev->failed = 0;
+    return save_labels(dev) ? 0 : -1;
+}
+
+static void add_us(struct timespec *ts, uint32_t us)
+{
+    ts->tv_nsec += (long)us * 1000;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+int mirror_open(struct mirror_device *dev, char *const paths[], uint32_t count,
+                uint32_t hedge_us, int debug)
+{
+    pthread_condattr_t attr;
+
+    memset(dev, 0, sizeof(struct mirror_device));
+    dev->debug = debug;
+    dev->count = count;
+    dev->hedge_us = hedge_us;
+    dev->size = UINT64_MAX;
+    if (count > MIRROR_MAX_MEMBERS)
+    {
+        fprintf(stderr, "A mirror can have at most %d members\n", MIRROR_MAX_MEMBERS);
+        return -1;
+    }
+
+    dev->members = calloc(count, sizeof(struct mirror_member));
+    if (!dev->members)
+        return -1;
+    pthread_mutex_init(&dev->lock, NULL);
+    /* Hedge deadlines shouldn't jump when the wall clock does. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dev->done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct mirror_member *m = &dev->members[i];
+        uint64_t size;
+
+        m->dev = dev;
+        pthread_cond_init(&m->work, NULL);
+        m->fd = open(paths[i], O_RDWR);
+        if (m->fd == -1 || fd_size(m->fd, &size) == -1)
+        {
+            fprintf(stderr, "Failed to open `%s': %s\n", paths[i], strerror(errno));
+            return -1;
+        }
+        if (size < 2 * LABEL_SIZE)
+        {
+            fprintf(stderr, "`%s' is too small for a mirror\n", paths[i]);
+            return -1;
+        }
+        m->label_at = size / LABEL_SIZE * LABEL_SIZE - LABEL_SIZE;
+        if (m->label_at < dev->size)
+            dev->size = m->label_at;
+    }
+    if (check_labels(dev) == -1)
+        return -1;
+
+    for (uint32_t i = 0; i < count; i++)
+        if (pthread_create(&dev->members[i].thread, NULL, member_thread, &dev->members[i]))
+            return -1;
+    return 0;
+}
+
+int mirror_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct mirror_device *dev = userdata;
+    struct mirror_request *req = calloc(1, sizeof(struct mirror_request));
+    struct timespec deadline;
+    uint64_t tried = 0;
+    int first = -1;
+    int member;
+    int err = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+    if (!req)
+        return ENOMEM;
+    req->refs = 1;
+    req->winner = -1;
+
+    pthread_mutex_lock(&dev->lock);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    add_us(&deadline, dev->hedge_us);
+    while (req->winner == -1)
+    {
+        /* Nothing in flight: the first read, or every copy so far failed. */
+        if (!req->pending)
+        {
+            member = pick_member(dev, tried);
+            if (member == -1)
+            {
+                err = req->err ? req->err : EIO;
+                break;
+            }
+            tried |= 1ULL << member;
+            if (first == -1)
+                first = member;
+            err = queue_job(&dev->members[member], req, 0, NULL, len, offset);
+            if (err)
+                break;
+            continue;
+        }
+
+        if (!dev->hedge_us)
+        {
+            pthread_cond_wait(&dev->done, &dev->lock);
+        }
+        else if (pthread_cond_timedwait(&dev->done, &dev->lock, &deadline) == ETIMEDOUT)
+        {
+            /* Too slow: ask another copy too, and keep whichever wins. */
+            member = pick_member(dev, tried);
+            if (member != -1 && !queue_job(&dev->members[member], req, 0, NULL, len, offset))
+            {
+                tried |= 1ULL << member;
+                dev->hedged++;
+            }
+            add_us(&deadline, dev->hedge_us);
+        }
+    }
+    if (req->winner != -1)
+    {
+        memcpy(buf, req->result, len);
+        if (req->winner != first)
+            dev->members[req->winner].hedge_wins++;
+        err = 0;
+    }
+    put_request(req);
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+int mirror_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct mirror_device *dev = userdata;
+    struct mirror_request *req = calloc(1, sizeof(struct mirror_request));
+    int err = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "W - %lu, %u\n", offset, len);
+    if (!req)
+        return ENOMEM;
+    req->refs = 1;
+    req->winner = -1;
+
+    /* Writes wait for every member, so they can use the caller's buffer. */
+    pthread_mutex_lock(&dev->lock);
+    for (uint32_t i = 0; i < dev->count && !err; i++)
+        if (!dev->members[i].failed)
+            err = queue_job(&dev->members[i], req, 1, buf, len, offset);
+    while (req->pending)
+        pthread_cond_wait(&dev->done, &dev->lock);
+    if (!err && !req->succeeded)
+        err = req->err ? req->err : EIO;
+    put_request(req);
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+int mirror_flush(void *userdata)
+{
+    struct mirror_device *dev = userdata;
+    int synced = 0;
+    int err = EIO;
+
+    for (uint32_t i = 0; i < dev->count; i++)
+    {
+        struct mirror_member *m = &dev->members[i];
+
+        if (m->failed)
+            continue;
+        if (fdatasync(m->fd) == 0)
+        {
+            synced++;
+        }
+        else
+        {
+            err = errno;
+            pthread_mutex_lock(&dev->lock);
+            drop_member(m, err);
+            pthread_mutex_unlock(&dev->lock);
+        }
+    }
+    return synced ? 0 : err;
+}
+
+void mirror_disc(void *userdata)
+{
+    struct mirror_device *dev = userdata;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->stopping = 1;
+    for (uint32_t i = 0; i < dev->count; i++)
+        pthread_cond_signal(&dev->members[i].work);
+    pthread_mutex_unlock(&dev->lock);
+    for (uint32_t i = 0; i < dev->count; i++)
+        pthread_join(dev->members[i].thread, NULL);
+
+    mirror_flush(dev);
+    fprintf(stderr, "mirror: %lu reads hedged\n", dev->hedged);
+    for (uint32_t i = 0; i < dev->count; i++)
+        fprintf(stderr, "mirror: member %u%s: %lu reads, %lu writes, %lu hedges won\n", i,
+                dev->members[i].failed ? " (failed)" : "", dev->members[i].reads,
+                dev->members[i].writes, dev->members[i].hedge_wins);
+}
@@ -0,0 +1,99 @@
+/*
+ * mirror - RAID1 mirroring with hedged reads for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef MIRROR_H_INCLUDED
+#define MIRROR_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Members are tracked in a 64 bit mask while a read picks among them. */
+#define MIRROR_MAX_MEMBERS 64
+
+struct mirror_job;
+
+/*
+ * The last 4K of every member holds a label. Whenever a member is dropped,
+ * the survivors' labels get a new event count and the dropped member's bit
+ * in `failed' before the write that failed it is answered, so at open a
+ * member whose label is behind, marked failed or missing is known to be
+ * stale and is copied from a current one.
+ */
+struct mirror_label
+{
+    uint64_t magic;
+    uint64_t set_id;
+    uint64_t events;
+    uint64_t failed;
+    uint32_t count;
+    uint32_t member;
+};
+
+struct mirror_member
+{
+    struct mirror_device *dev;
+    int fd;
+    uint64_t label_at;
+    pthread_t thread;
+    pthread_cond_t work;
+    struct mirror_job *head;
+    struct mirror_job *tail;
+    /* jobs queued or running; reads go to whoever has the fewest */
+    uint32_t outstanding;
+    int failed;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t hedge_wins;
+};
+
+/*
+ * Every write goes to every member that hasn't failed. A read goes to the
+ * member with the fewest jobs in flight, and if `hedge_us' is set and it
+ * hasn't answered by then, to the next least busy member as well; whichever
+ * copy arrives first is used. A stalled disk keeps its queue, so later reads
+ * steer around it. Members that return an error are dropped, which is
+ * recorded on the others' labels.
+ */
+struct mirror_device
+{
+    uint32_t count;
+    uint64_t size;
+    uint32_t hedge_us;
+    uint32_t next;
+    uint64_t set_id;
+    uint64_t events;
+    uint64_t failed;
+    struct mirror_member *members;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int stopping;
+    uint64_t hedged;
+    int debug;
+};
+
+int mirror_open(struct mirror_device *dev, char *const paths[], uint32_t count,
+                uint32_t hedge_us, int debug);
+int mirror_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int mirror_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int mirror_flush(void *userdata);
+void mirror_disc(void *userdata);
+
+#endif /* MIRROR_H_INCLUDED */
@@ -0,0 +1,336 @@
+/*
+ * overlay - copy-on-write overlay of a read-only image for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "overlay.h"
+
+#define OVERLAY_MAGIC 0x59414c5245564f01ULL
+#define BITMAP_PAGE 4096
+/* How much of each end of the base goes into its checksum. */
+#define BASE_SAMPLE (1024 * 1024)
+
+static int chunk_copied(struct overlay_device *dev, uint64_t chunk)
+{
+    return (dev->bitmap[chunk / 64] >> (chunk % 64)) & 1;
+}
+
+static void mark_chunk(struct overlay_device *dev, uint64_t chunk, int copied)
+{
+    if (chunk_copied(dev, chunk) == copied)
+        return;
+    if (copied)
+        dev->bitmap[chunk / 64] |= 1ULL << (chunk % 64);
+    else
+        dev->bitmap[chunk / 64] &= ~(1ULL << (chunk % 64));
+    dev->bitmap_dirty[chunk / 8 / BITMAP_PAGE] = 1;
+}
+
+/* Write the bitmap pages changed since the last call and sync them. The
+ * chunks they mark must already be on the media. */
+static int save_bitmap(struct overlay_device *dev)
+{
+    int dirty = 0;
+
+    for (uint64_t page = 0; page < dev->bitmap_pages; page++)
+    {
+        int err;
+
+        if (!dev->bitmap_dirty[page])
+            continue;
+        err = pwrite_all(dev->delta_fd, (unsigned char *)dev->bitmap + page * BITMAP_PAGE,
+                         BITMAP_PAGE, BITMAP_PAGE + page * BITMAP_PAGE);
+        if (err)
+            return err;
+        dev->bitmap_dirty[page] = 0;
+        dirty = 1;
+    }
+    return dirty && fdatasync(dev->delta_fd) == -1 ? errno : 0;
+}
+
+/* FNV-1a over the size and both ends of the base. It's cheap enough to run
+ * on every open and catches a delta being paired with the wrong image. */
+static int base_checksum(struct overlay_device *dev, uint64_t *sum)
+{
+    uint64_t starts[2] = {0, dev->size > BASE_SAMPLE ? dev->size - BASE_SAMPLE : 0};
+    uint32_t len = dev->size > BASE_SAMPLE ? BASE_SAMPLE : dev->size;
+    unsigned char *buf = malloc(BASE_SAMPLE);
+    uint64_t hash = 0xcbf29ce484222325ULL ^ dev->size;
+
+    if (!buf)
+        return -1;
+    for (int end = 0; end < 2; end++)
+    {
+        if (pread_all(dev->base_fd, buf, len, starts[end]))
+        {
+            free(buf);
+            return -1;
+        }
+        for (uint32_t i = 0; i < len; i++)
+            hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+    }
+    free(buf);
+    *sum = hash;
+    return 0;
+}
+
+/* Read the header and bitmap of an existing delta, or lay out a new one. */
+static int load_delta(struct overlay_device *dev, const char *delta, uint64_t delta_size)
+{
+    struct overlay_header header;
+    uint64_t sum;
+
+    if (base_checksum(dev, &sum) == -1)
+    {
+        fprintf(stderr, "Failed to read the base: %s\n", strerror(errno));
+        return -1;
+    }
+    dev->data_start = (BITMAP_PAGE + dev->bitmap_pages * BITMAP_PAGE + dev->chunk_size - 1) /
+                      dev->chunk_size * dev->chunk_size;
+
+    if (delta_size == 0)
+    {
+        memset(&header, 0, sizeof(header));
+        header.magic = OVERLAY_MAGIC;
+        header.base_size = dev->size;
+        header.base_sum = sum;
+        header.data_start = dev->data_start;
+        header.chunk_size = dev->chunk_size;
+        if (ftruncate(dev->delta_fd, dev->data_start + dev->size) == -1 ||
+            pwrite_all(dev->delta_fd, &header, sizeof(header), 0) ||
+            fdatasync(dev->delta_fd) == -1)
+        {
+            fprintf(stderr, "Failed to set up delta `%s': %s\n", delta, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (pread_all(dev->delta_fd, &header, sizeof(header), 0) || header.magic != OVERLAY_MAGIC)
+    {
+        fprintf(stderr, "`%s' is not an overlay delta\n", delta);
+        return -1;
+    }
+    if (header.base_size != dev->size || header.base_sum != sum)
+    {
+        fprintf(stderr, "`%s' was made for a different base image\n", delta);
+        return -1;
+    }
+    if (header.chunk_size != dev->chunk_size || header.data_start != dev->data_start)
+    {
+        fprintf(stderr, "`%s' was made with %u byte chunks\n", delta, header.chunk_size);
+        return -1;
+    }
+    if (pread_all(dev->delta_fd, dev->bitmap, dev->bitmap_pages * BITMAP_PAGE, BITMAP_PAGE))
+    {
+        fprintf(stderr, "Failed to read the bitmap of `%s': %s\n", delta, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int overlay_open(struct overlay_device *dev, const char *base, const char *delta,
+                 uint32_t chunk_size, int debug)
+{
+    struct stat st;
+
+    memset(dev, 0, sizeof(struct overlay_device));
+    dev->debug = debug;
+    dev->chunk_size = chunk_size;
+    if (chunk_size < 4096 || (chunk_size & (chunk_size - 1)))
+    {
+        fprintf(stderr, "Overlay chunk size must be a power of two of at least 4K\n");
+        return -1;
+    }
+
+    dev->base_fd = open(base, O_RDONLY);
+    if (dev->base_fd == -1 || fd_size(dev->base_fd, &dev->size) == -1)
+    {
+        fprintf(stderr, "Failed to open base `%s': %s\n", base, strerror(errno));
+        return -1;
+    }
+
+    dev->delta_fd = open(delta, O_RDWR | O_CREAT, 0644);
+    if (dev->delta_fd == -1 || fstat(dev->delta_fd, &st) == -1)
+    {
+        fprintf(stderr, "Failed to open delta `%s': %s\n", delta, strerror(errno));
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "The delta `%s' must be a regular file\n", delta);
+        return -1;
+    }
+
+    dev->chunks = (dev->size + chunk_size - 1) / chunk_size;
+    dev->bitmap_pages = (dev->chunks + BITMAP_PAGE * 8 - 1) / (BITMAP_PAGE * 8);
+    dev->bitmap = calloc(dev->bitmap_pages, BITMAP_PAGE);
+    dev->bitmap_dirty = calloc(dev->bitmap_pages, 1);
+    dev->chunk_buf = malloc(chunk_size);
+    if (!dev->bitmap || !dev->bitmap_dirty || !dev->chunk_buf)
+        return -1;
+
+    return load_delta(dev, delta, st.st_size);
+}
+
+int overlay_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct overlay_device *dev = userdata;
+
+    if (dev->debug)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+
+    /* Serve runs of chunks that live in the same file with one pread. */
+    while (len > 0)
+    {
+        uint64_t chunk = offset / dev->chunk_size;
+        int copied = chunk_copied(dev, chunk);
+        uint32_t n = 0;
+        int err;
+
+        do
+        {
+            uint32_t step = dev->chunk_size - (offset + n) % dev->chunk_size;
+
+            n += step < len - n ? step : len - n;
+            chunk++;
+        } while (n < len && chunk_copied(dev, chunk) == copied);
+
+        if (copied)
+            err = pread_all(dev->delta_fd, buf, n, dev->data_start + offset);
+        else
+            err = pread_all(dev->base_fd, buf, n, offset);
+        if (err)
+            return err;
+
+        buf = (char *)buf + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int overlay_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct overlay_device *dev = userdata;
+    int err;
+
+    if (dev->debug)
+        fprintf(stderr, "W - %lu, %u\n", offset, len);
+
+    while (len > 0)
+    {
+        uint64_t chunk = offset / dev->chunk_size;
+        uint32_t inner = offset % dev->chunk_size;
+        uint32_t n = dev->chunk_size - inner;
+
+        if (n > len)
+            n = len;
+
+        if (chunk_copied(dev, chunk) || n == dev->chunk_size)
+        {
+            err = pwrite_all(dev->delta_fd, buf, n, dev->data_start + offset);
+        }
+        else
+        {
+            /* Copy up: merge the new data into the base chunk and write the
+             * chunk out whole, so the delta never holds part of a chunk. */
+            uint64_t start = chunk * dev->chunk_size;
+            uint32_t whole = dev->chunk_size;
+
+            if (start + whole > dev->size)
+                whole = dev->size - start;
+            err = pread_all(dev->base_fd, dev->chunk_buf, whole, start);
+            if (!err)
+            {
+                memcpy(dev->chunk_buf + inner, buf, n);
+                err = pwrite_all(dev->delta_fd, dev->chunk_buf, whole, dev->data_start + start);
+            }
+            dev->copied++;
+        }
+        if (err)
+            return err;
+        mark_chunk(dev, chunk, 1);
+
+        buf = (const char *)buf + n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Discarded chunks fall back to the base and are punched out of the delta.
+ * Their bits are cleared on the media first, so a crash can't leave a
+ * copied chunk reading back as a hole. Chunks copied up since the last flush
+ * are synced along the way. Partly covered chunks are left alone, which trim
+ * allows. */
+int overlay_trim(uint64_t from, uint32_t len, void *userdata)
+{
+    struct overlay_device *dev = userdata;
+    uint64_t first = (from + dev->chunk_size - 1) / dev->chunk_size;
+    uint64_t last = (from + len) / dev->chunk_size;
+    int present = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "T - %lu, %u\n", from, len);
+
+    for (uint64_t chunk = first; chunk < last; chunk++)
+    {
+        present |= chunk_copied(dev, chunk);
+        mark_chunk(dev, chunk, 0);
+    }
+    if (!present || overlay_flush(dev))
+        return 0;
+    fallocate(dev->delta_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              dev->data_start + first * dev->chunk_size, (last - first) * dev->chunk_size);
+    return 0;
+}
+
+/* Chunks first, then the bitmap pages that mark them as copied. */
+int overlay_flush(void *userdata)
+{
+    struct overlay_device *dev = userdata;
+
+    if (fdatasync(dev->delta_fd) == -1)
+        return errno;
+    return save_bitmap(dev);
+}
+
+void overlay_disc(void *userdata)
+{
+    struct overlay_device *dev = userdata;
+    uint64_t present = 0;
+
+    for (uint64_t c = 0; c < dev->chunks; c++)
+        present += chunk_copied(dev, c);
+    fprintf(stderr, "overlay: %lu of %lu chunks in the delta, %lu copy-ups\n",
+            present, dev->chunks, dev->copied);
+    overlay_flush(dev);
+}
@@ -0,0 +1,71 @@
+/*
+ * overlay - copy-on-write overlay of a read-only image for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef OVERLAY_H_INCLUDED
+#define OVERLAY_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define OVERLAY_DEFAULT_CHUNK (64 * 1024)
+
+/* The base image is never written. The first write to a chunk copies the
+ * whole chunk up into the delta file, and from then on that chunk is served
+ * from the delta. The bitmap says which chunks have been copied up.
+ *
+ * The delta starts with a header identifying its base, then the bitmap,
+ * then the chunks at data_start onwards. Bitmap pages changed since the last
+ * flush are written by the next one, after the chunks they cover are synced,
+ * so a chunk is never marked copied on the media before its data is. */
+struct overlay_header
+{
+    uint64_t magic;
+    uint64_t base_size;
+    uint64_t base_sum; /* of the first and last MiB of the base */
+    uint64_t data_start;
+    uint32_t chunk_size;
+    uint32_t reserved;
+};
+
+struct overlay_device
+{
+    int base_fd;
+    int delta_fd;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint64_t chunks;
+    uint64_t data_start;
+    uint64_t *bitmap;
+    uint64_t bitmap_pages;
+    unsigned char *bitmap_dirty; /* one flag per 4K page of bitmap */
+    unsigned char *chunk_buf;
+    uint64_t copied;
+    int debug;
+};
+
+int overlay_open(struct overlay_device *dev, const char *base, const char *delta,
+                 uint32_t chunk_size, int debug);
+int overlay_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int overlay_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int overlay_trim(uint64_t from, uint32_t len, void *userdata);
+int overlay_flush(void *userdata);
+void overlay_disc(void *userdata);
+
+#endif /* OVERLAY_H_INCLUDED */
@@ -0,0 +1,117 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathtable.h"
+
+//Every name lives in one arena, so deep trees don't repeat their folders
+PathEntry *path_entries = 0;
+uint32_t path_entries_count = 0;
+static uint32_t path_entries_capacity = 0;
+char *path_names = 0;
+uint32_t path_names_size = 0;
+static uint32_t path_names_capacity = 0;
+
+//Add a name under parent, or Path_None for the root
+//Returns its index, or Path_None once the names fill 2GB
+uint32_t path_add(uint32_t parent, const char *name)
+{
+    size_t length = strlen(name) + 1;
+    if (length > UINT32_MAX / 2 - path_names_size)
+    {
+        return Path_None;
+    }
+
+    if (path_entries_count == path_entries_capacity)
+    {
+        path_entries_capacity = path_entries_capacity ? path_entries_capacity * 2 : 1024;
+        path_entries = realloc(path_entries, path_entries_capacity * sizeof(PathEntry));
+    }
+
+    if (path_names_size + length > path_names_capacity)
+    {
+        path_names_capacity = path_names_capacity ? path_names_capacity * 2 : 64 * 1024;
+        while (path_names_size + length > path_names_capacity)
+        {
+            path_names_capacity *= 2;
+        }
+        path_names = realloc(path_names, path_names_capacity);
+    }
+    memcpy(path_names + path_names_size, name, length);
+
+    path_entries[path_entries_count].parent = parent;
+    path_entries[path_entries_count].name = path_names_size;
+    path_names_size += length;
+    return path_entries_count++;
+}
+
+//The last part of a path. Only good until the next path_add
+const char *path_name(uint32_t path)
+{
+    return path_names + path_entries[path].name;
+}
+
+//Put the full path together in buf
+//Returns its length, or -1 if it doesn't fit
+int path_build(uint32_t path, char *buf, size_t size)
+{
+    //Work out the length first, then fill it in from the end
+    size_t length = strlen(path_name(path));
+    for (uint32_t up = path_entries[path].parent; up != Path_None; up = path_entries[up].parent)
+    {
+        length += strlen(path_name(up)) + 1;
+    }
+    if (length + 1 > size)
+    {
+        return -1;
+    }
+
+    buf[length] = 0;
+    size_t end = length;
+    for (uint32_t up = path; up != Path_None; up = path_entries[up].parent)
+    {
+        const char *name = path_name(up);
+        size_t name_length = strlen(name);
+        end -= name_length;
+        memcpy(buf + end, name, name_length);
+        if (end > 0)
+        {
+            buf[--end] = '/';
+        }
+    }
+    return length;
+}
+
+//Replace the table with a saved one
+void path_table_set(PathEntry *entries, uint32_t count, const char *names, uint32_t names_size)
+{
+    free(path_entries);
+    free(path_names);
+    path_entries_capacity = count > 0 ? count : 1;
+    path_entries = malloc(path_entries_capacity * sizeof(PathEntry));
+    memcpy(path_entries, entries, count * sizeof(PathEntry));
+    path_entries_count = count;
+    path_names_capacity = names_size > 0 ? names_size : 1;
+    path_names = malloc(path_names_capacity);
+    memcpy(path_names, names, names_size);
+    path_names_size = names_size;
+}
@@ -0,0 +1,46 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef PATHTABLE_H_INCLUDED
+#define PATHTABLE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Regions and directories that don't come from a source path
+#define Path_None 0xFFFFFFFF
+
+//Each exported file and folder is its name and the index of its folder.
+//The root's name is the whole export path
+typedef struct PathEntry
+{
+    uint32_t parent;
+    uint32_t name; // Offset in path_names
+} PathEntry;
+
+uint32_t path_add(uint32_t parent, const char *name);
+const char *path_name(uint32_t path);
+int path_build(uint32_t path, char *buf, size_t size);
+void path_table_set(PathEntry *entries, uint32_t count, const char *names, uint32_t names_size);
+
+extern PathEntry *path_entries;
+extern uint32_t path_entries_count;
+extern char *path_names;
+extern uint32_t path_names_size;
+
+#endif /* PATHTABLE_H_INCLUDED */
@@ -0,0 +1,262 @@
+/*
+ * qos - token bucket rate limiting for BUSE devices
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buse.h"
+#include "qos.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+/*
+ * Each bucket is kept as a GCRA (virtual scheduling) meter: `tat' is the
+ * theoretical arrival time of the next request if the bucket were drained at
+ * exactly the configured rate, and `tolerance' is how far ahead of the clock
+ * it may run, which is the burst. This is equivalent to a token bucket but
+ * needs no periodic refill.
+ */
+struct qos_bucket
+{
+  uint64_t rate;
+  uint64_t tolerance;
+  uint64_t tat;
+};
+
+struct qos_class
+{
+  struct qos_bucket ios;
+  struct qos_bucket bytes;
+};
+
+struct qos_state
+{
+  struct qos_class cls[BUSE_CLASS_COUNT];
+  struct qos_class total;
+};
+
+uint64_t qos_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void bucket_init(struct qos_bucket *bucket, uint64_t rate, uint64_t burst)
+{
+  bucket->rate = rate;
+  bucket->tat = 0;
+  if (!rate)
+    return;
+  if (!burst)
+    burst = rate;
+  /* Cap at an hour of tolerance, and at what the multiplication below can
+   * take without overflowing, which is less for rates over 5M/s. */
+  if (burst / rate > 3600)
+    burst = rate * 3600;
+  if (burst > UINT64_MAX / NS_PER_SEC)
+    burst = UINT64_MAX / NS_PER_SEC;
+  bucket->tolerance = burst * NS_PER_SEC / rate;
+}
+
+static void class_init(struct qos_class *cls, const struct buse_limit *limit)
+{
+  bucket_init(&cls->ios, limit->iops, limit->burst_ios);
+  bucket_init(&cls->bytes, limit->bps, limit->burst_bytes);
+}
+
+/* Charge `units' against the bucket and return how long the caller has to
+ * wait for it to conform. */
+static uint64_t bucket_charge(struct qos_bucket *bucket, uint64_t units, uint64_t now)
+{
+  uint64_t cost;
+
+  if (!bucket->rate)
+    return 0;
+
+  cost = units * NS_PER_SEC / bucket->rate;
+  if (bucket->tat < now)
+    bucket->tat = now;
+  bucket->tat += cost;
+
+  if (bucket->tat > now + bucket->tolerance)
+    return bucket->tat - now - bucket->tolerance;
+  return 0;
+}
+
+static uint64_t class_charge(struct qos_class *cls, uint32_t len, uint64_t now)
+{
+  uint64_t ios = bucket_charge(&cls->ios, 1, now);
+  uint64_t bytes = bucket_charge(&cls->bytes, len, now);
+
+  return ios > bytes ? ios : bytes;
+}
+
+struct qos_state *qos_create(const struct buse_qos *qos)
+{
+  struct qos_state *state = calloc(1, sizeof(struct qos_state));
+
+  if (!state)
+    return NULL;
+  for (int c = 0; c < BUSE_CLASS_COUNT; c++)
+    class_init(&state->cls[c], &qos->limit[c]);
+  class_init(&state->total, &qos->total);
+  return state;
+}
+
+/* Account for a request and return the delay, in nanoseconds, before it may
+ * be served. The class buckets and the shared bucket are charged at the same
+ * instant, so a request only ever waits for whichever is furthest behind. */
+uint64_t qos_admit(struct qos_state *state, enum buse_class cls, uint32_t len)
+{
+  uint64_t now = qos_now();
+  uint64_t own = class_charge(&state->cls[cls], len, now);
+  uint64_t shared = class_charge(&state->total, len, now);
+
+  return own > shared ? own : shared;
+}
+
+void qos_wait(uint64_t delay_ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = delay_ns / NS_PER_SEC;
+  ts.tv_nsec = delay_ns % NS_PER_SEC;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+void qos_destroy(struct qos_state *state)
+{
+  free(state);
+}
+
+/* Parse a number with an optional K, M or G (binary) suffix. */
+int buse_parse_amount(const char *text, uint64_t *value)
+{
+  char *end;
+
+  errno = 0;
+  *value = strtoull(text, &end, 10);
+  if (errno || end == text)
+    return -1;
+  switch (*end)
+  {
+  case 'G':
+  case 'g':
+    *value <<= 10;
+    /* fall through */
+  case 'M':
+  case 'm':
+    *value <<= 10;
+    /* fall through */
+  case 'K':
+  case 'k':
+    *value <<= 10;
+    end++;
+    break;
+  default:
+    break;
+  }
+  return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Fill `qos' from a comma separated list of <class>_<field>=<value> pairs,
+ * where class is read, write, trim or total and field is iops, bps,
+ * burst_ios or burst_bytes. For example:
+ *
+ *   read_iops=500,write_bps=8M,write_burst_bytes=32M,total_iops=1000
+ */
+int buse_parse_qos(struct buse_qos *qos, const char *spec)
+{
+  static const char *classes[] = {"read", "write", "trim"};
+  char *copy = strdup(spec);
+  char *save = NULL;
+  int ret = 0;
+
+  if (!copy)
+    return -1;
+
+  for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save))
+  {
+    struct buse_limit *limit = NULL;
+    char *field;
+    char *value = strchr(item, '=');
+    uint64_t amount;
+
+    if (!value || buse_parse_amount(value + 1, &amount) == -1)
+    {
+      ret = -1;
+      break;
+    }
+    *value = '\0';
+
+    field = strchr(item, '_');
+    if (!field)
+    {
+      ret = -1;
+      break;
+    }
+    *field++ = '\0';
+
+    if (strcmp(item, "total") == 0)
+      limit = &qos->total;
+    for (int c = 0; c < BUSE_CLASS_COUNT; c++)
+      if (strcmp(item, classes[c]) == 0)
+        limit = &qos->limit[c];
+
+    if (limit && strcmp(field, "iops") == 0)
+      limit->iops = amount;
+    else if (limit && strcmp(field, "bps") == 0)
+      limit->bps = amount;
+    else if (limit && strcmp(field, "burst_ios") == 0)
+      limit->burst_ios = amount;
+    else if (limit && strcmp(field, "burst_bytes") == 0)
+      limit->burst_bytes = amount;
+    else
+    {
+      ret = -1;
+      break;
+    }
+  }
+
+  free(copy);
+  return ret;
+}
+
+void buse_print_stats(FILE *out, const struct buse_stats *stats)
+{
+  static const char *names[] = {"read", "write", "trim"};
+
+  for (int c = 0; c < BUSE_CLASS_COUNT; c++)
+  {
+    fprintf(out, "%-5s ops: %llu bytes: %llu throttled: %llu (%llu ms)\n",
+            names[c],
+            (unsigned long long)stats->ops[c],
+            (unsigned long long)stats->bytes[c],
+            (unsigned long long)stats->throttled[c],
+            (unsigned long long)(stats->throttle_ns[c] / 1000000));
+  }
+  fprintf(out, "flush ops: %llu\n", (unsigned long long)stats->flushes);
+}
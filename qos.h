@@ -0,0 +1,35 @@
+/*
+ * qos - token bucket rate limiting for BUSE devices
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef QOS_H_INCLUDED
+#define QOS_H_INCLUDED
+
+#include <stdint.h>
+
+#include "buse.h"
+
+struct qos_state;
+
+struct qos_state *qos_create(const struct buse_qos *qos);
+uint64_t qos_admit(struct qos_state *state, enum buse_class cls, uint32_t len);
+void qos_wait(uint64_t delay_ns);
+uint64_t qos_now(void);
+void qos_destroy(struct qos_state *state);
+
+#endif /* QOS_H_INCLUDED */
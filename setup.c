@@ -28,20 +28,26 @@
 #include "utils.h"
 #include "address.h"
 #include "vsfat.h"
+#include "fattable.h"
+#include "dirtables.h"
+#include "pathtable.h"
 
 //Create the root directory entry and set it as the current directory
-void build_root_dir()
+void build_root_dir(char *path)
 {
-  root_dir.path = "\\";
+  root_dir.path = path_add(Path_None, path);
   root_dir.current_dir_position = 0;
-  root_dir.dirtables = 0;
-  root_dir.files = 0;
   //This makes sure we can never go above the root_dir
   root_dir.parent = &root_dir;
   root_dir.dir_location = root_dir_loc();
 
   current_dir = &root_dir;
-  current_fat_position = root_dir_loc();
+  //The root directory always has its first cluster
+  fat_add_run(root_dir_loc(), 1);
+  root_dir.listing = dir_listing_new(root_dir_loc(), 0, 0);
+  root_dir.listing->path = root_dir.path;
+  dir_map_cluster(root_dir.listing, root_dir_loc());
+  current_fat_position = root_dir_loc() + 1;
 }
 
 //Build and map the MBR. Note that we just use a fixed 2TB size
@@ -76,7 +82,7 @@ void build_mbr()
     memcpy(mbr + 446 + 16 * a, &parts[a], 16);
   }
   memcpy(mbr + 510, &footer, sizeof(footer));
-  add_address_region(0, 512, mbr, 0);
+  add_address_region(0, 512, mbr, Path_None);
 }
 
 //Build and map the bootsector(s)
@@ -150,11 +156,11 @@ uint32_t build_boot_sector(BootEntry *bootentry, int xmpl_debug)
   }
 
   //Main copy
-  add_address_region(part1_base, 512, bootentry, 0);
+  add_address_region(part1_base, 512, bootentry, Path_None);
   add_address_region(part1_base +
                          bootentry->BPB_BkBootSec * bootentry->BPB_BytsPerSec,
                      512,
-                     bootentry, 0);
+                     bootentry, Path_None);
 
   //Microsoft constants for the signatures
   FSInfo *fsi = malloc(sizeof(FSInfo));
@@ -168,22 +174,14 @@ uint32_t build_boot_sector(BootEntry *bootentry, int xmpl_debug)
   add_address_region(part1_base +
                          bootentry->BPB_FSInfo * bootentry->BPB_BytsPerSec,
                      512,
-                     fsi, 0);
+                     fsi, Path_None);
   return DiskSize;
 }
 
 //Do the initial FAT setup and mapping
 void build_fats()
 {
-  //These first two entries are part of the spec
-  unsigned char fatspecial[] = {0xF8, 0xFF, 0xFF, 0x0F, 0xFF, 0xFF, 0xFF, 0x0F};
-
-  fat = malloc(bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec);
-  memset(fat, 0, bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec);
-
-  memcpy(fat, fatspecial, sizeof(fatspecial));
-
-//There are two copies of the fat, we map the same memory into both
+//There are two copies of the fat, both are generated from the same cluster runs
 #if defined(ENV64BIT)
   printf("fat0: %lx\n", address_from_fatsec(fat_location(0)));
   printf("fat1: %lx\n", address_from_fatsec(fat_location(1)));
@@ -191,10 +189,5 @@ void build_fats()
   printf("fat0: %llx\n", address_from_fatsec(fat_location(0)));
   printf("fat1: %llx\n", address_from_fatsec(fat_location(1)));
 #endif
-  add_address_region(address_from_fatsec(fat_location(0)),
-                     bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec, fat,
-                     0);
-  add_address_region(address_from_fatsec(fat_location(1)),
-                     bootentry.BPB_FATSz32 * bootentry.BPB_BytsPerSec, fat,
-                     0);
-}
\ No newline at end of file
+  fat_map();
+}
@@ -37,7 +37,7 @@
 
 #define FAT32_FAT_Table_Length 8189
 
-void build_root_dir();
+void build_root_dir(char *path);
 void build_mbr();
 uint32_t build_boot_sector(BootEntry *bootentry, int xmpl_debug);
 static const uint32_t part1_base = 1048576;
@@ -0,0 +1,331 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "vsfat.h"
+#include "address.h"
+#include "fattable.h"
+#include "dirtables.h"
+#include "snapshot.h"
+#include "pathtable.h"
+#include "Fat32_Attr.h"
+
+//Sections are written straight from memory through a small buffer
+typedef struct SnapshotWriter
+{
+    FILE *out;
+    uint64_t written;
+} SnapshotWriter;
+
+static void snapshot_write(SnapshotWriter *writer, const void *data, size_t length)
+{
+    if (fwrite(data, 1, length, writer->out) == length)
+    {
+        writer->written += length;
+    }
+}
+
+static uint64_t snapshot_size(SnapshotHeader *header)
+{
+    return sizeof(SnapshotHeader) +
+           (uint64_t)header->dir_count * sizeof(SnapshotDir) +
+           (uint64_t)header->child_count * sizeof(SnapshotChild) +
+           (uint64_t)header->cluster_count * sizeof(uint32_t) +
+           (uint64_t)header->run_count * sizeof(FatRun) +
+           (uint64_t)header->path_count * sizeof(PathEntry) +
+           header->names_size;
+}
+
+//Write the layout built by the scan, so the next start can skip it
+//The file is written next to its final name and moved over it when complete
+int snapshot_save(const char *file, const char *export_path)
+{
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, Snapshot_Magic, 8);
+    header.version = Snapshot_Version;
+    header.cluster_size = bootentry.BPB_BytsPerSec * bootentry.BPB_SecPerClus;
+    header.fat_entries = fat_entries();
+    header.current_fat_position = current_fat_position;
+    header.dir_count = dir_listings_count;
+    header.path_count = path_entries_count;
+    header.names_size = path_names_size;
+
+    //The root has to be the export path, so we can tell if we're asked for another
+    if (dir_listings_count == 0 || strcmp(path_name(dir_listings[0]->path), export_path) != 0)
+    {
+        return -1;
+    }
+
+    FatRun *runs = fat_runs_get(&header.run_count);
+    for (uint32_t a = 0; a < dir_listings_count; a++)
+    {
+        header.child_count += dir_listings[a]->count;
+        header.cluster_count += dir_listings[a]->cluster_count;
+    }
+
+    char *temp = malloc(strlen(file) + 5);
+    sprintf(temp, "%s.tmp", file);
+    SnapshotWriter writer = {fopen(temp, "wb"), 0};
+    if (writer.out == 0)
+    {
+        perror("Unable to write snapshot");
+        free(temp);
+        return -1;
+    }
+
+    snapshot_write(&writer, &header, sizeof(SnapshotHeader));
+
+    //Directories, with their children and clusters laid out in the same order
+    uint32_t child_first = 0;
+    uint32_t cluster_first = 0;
+    for (uint32_t a = 0; a < dir_listings_count; a++)
+    {
+        DirListing *listing = dir_listings[a];
+        SnapshotDir dir;
+        memset(&dir, 0, sizeof(SnapshotDir));
+        dir.mtime_sec = listing->mtime.tv_sec;
+        dir.mtime_nsec = listing->mtime.tv_nsec;
+        dir.parent = listing->parent;
+        dir.path = listing->path;
+        dir.first_cluster = listing->first_cluster;
+        dir.parent_cluster = listing->parent_cluster;
+        dir.child_first = child_first;
+        dir.child_count = listing->count;
+        dir.cluster_first = cluster_first;
+        dir.cluster_count = listing->cluster_count;
+        dir.dots = listing->dots;
+        snapshot_write(&writer, &dir, sizeof(SnapshotDir));
+
+        child_first += listing->count;
+        cluster_first += listing->cluster_count;
+    }
+
+    for (uint32_t a = 0; a < dir_listings_count; a++)
+    {
+        DirListing *listing = dir_listings[a];
+        for (uint32_t b = 0; b < listing->count; b++)
+        {
+            DirChild *child = &listing->children[b];
+            SnapshotChild saved;
+            memset(&saved, 0, sizeof(SnapshotChild));
+            saved.path = child->path;
+            saved.cluster = child->cluster;
+            saved.size = child->size;
+            saved.slot = child->slot;
+            memcpy(saved.name83, child->name83, 11);
+            saved.attr = child->attr;
+            saved.lfn_entries = child->lfn_entries;
+            snapshot_write(&writer, &saved, sizeof(SnapshotChild));
+        }
+    }
+
+    for (uint32_t a = 0; a < dir_listings_count; a++)
+    {
+        snapshot_write(&writer, dir_listings[a]->clusters,
+                       dir_listings[a]->cluster_count * sizeof(uint32_t));
+    }
+    snapshot_write(&writer, runs, header.run_count * sizeof(FatRun));
+    snapshot_write(&writer, path_entries, header.path_count * sizeof(PathEntry));
+    snapshot_write(&writer, path_names, header.names_size);
+
+    int failed = fclose(writer.out) != 0 || writer.written != snapshot_size(&header);
+    if (failed || rename(temp, file) != 0)
+    {
+        fprintf(stderr, "Unable to write snapshot %s\n", file);
+        unlink(temp);
+        free(temp);
+        return -1;
+    }
+    free(temp);
+    return 0;
+}
+
+//Check every index and offset in the snapshot points inside it
+static int snapshot_check(SnapshotHeader *header, SnapshotDir *dirs, SnapshotChild *children,
+                          PathEntry *paths, const char *names)
+{
+    if (header->dir_count == 0 || header->names_size == 0 || names[header->names_size - 1] != 0)
+    {
+        return -1;
+    }
+    for (uint32_t a = 0; a < header->path_count; a++)
+    {
+        if ((paths[a].parent != Path_None && paths[a].parent >= a) ||
+            paths[a].name >= header->names_size)
+        {
+            return -1;
+        }
+    }
+    for (uint32_t a = 0; a < header->dir_count; a++)
+    {
+        if ((a > 0 && dirs[a].parent >= a) ||
+            dirs[a].path >= header->path_count ||
+            dirs[a].child_first > header->child_count ||
+            dirs[a].child_count > header->child_count - dirs[a].child_first ||
+            dirs[a].cluster_first > header->cluster_count ||
+            dirs[a].cluster_count > header->cluster_count - dirs[a].cluster_first)
+        {
+            return -1;
+        }
+    }
+    for (uint32_t a = 0; a < header->child_count; a++)
+    {
+        if (children[a].path >= header->path_count ||
+            children[a].lfn_entries > LFN_Max_Entries)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Check none of the folders changed since the snapshot was written
+static int snapshot_unchanged(SnapshotHeader *header, SnapshotDir *dirs)
+{
+    char path[PATH_MAX];
+    for (uint32_t a = 0; a < header->dir_count; a++)
+    {
+        struct stat st;
+        if (path_build(dirs[a].path, path, sizeof(path)) < 0 ||
+            stat(path, &st) != 0 ||
+            st.st_mtim.tv_sec != dirs[a].mtime_sec ||
+            st.st_mtim.tv_nsec != dirs[a].mtime_nsec)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Restore the layout from a snapshot instead of scanning
+//Nothing but the path table is touched unless the snapshot matches this disk
+//and export, and none of the exported folders has changed since it was written
+int snapshot_load(const char *file, const char *export_path)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *)map;
+    if (memcmp(header->magic, Snapshot_Magic, 8) != 0 ||
+        header->version != Snapshot_Version ||
+        header->cluster_size != (uint32_t)bootentry.BPB_BytsPerSec * bootentry.BPB_SecPerClus ||
+        header->fat_entries != fat_entries() ||
+        snapshot_size(header) != (uint64_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    SnapshotDir *dirs = (SnapshotDir *)(header + 1);
+    SnapshotChild *children = (SnapshotChild *)(dirs + header->dir_count);
+    uint32_t *clusters = (uint32_t *)(children + header->child_count);
+    FatRun *runs = (FatRun *)(clusters + header->cluster_count);
+    PathEntry *paths = (PathEntry *)(runs + header->run_count);
+    const char *names = (const char *)(paths + header->path_count);
+
+    if (snapshot_check(header, dirs, children, paths, names) != 0 ||
+        paths[dirs[0].path].parent != Path_None ||
+        strcmp(names + paths[dirs[0].path].name, export_path) != 0)
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    //The folders are checked with the saved paths, which are dropped again if
+    //anything changed so the scan starts from an empty table
+    path_table_set(paths, header->path_count, names, header->names_size);
+    if (snapshot_unchanged(header, dirs) != 0)
+    {
+        path_table_set(0, 0, 0, 0);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    //Everything checks out, so build the directories and map the files
+    fat_runs_set(runs, header->run_count);
+    for (uint32_t a = 0; a < header->dir_count; a++)
+    {
+        DirListing *listing = dir_listing_new(dirs[a].first_cluster, dirs[a].parent_cluster, dirs[a].dots);
+        listing->path = dirs[a].path;
+        listing->parent = dirs[a].parent;
+        listing->mtime.tv_sec = dirs[a].mtime_sec;
+        listing->mtime.tv_nsec = dirs[a].mtime_nsec;
+        listing->capacity = dirs[a].child_count;
+        listing->children = malloc(listing->capacity * sizeof(DirChild));
+
+        for (uint32_t b = 0; b < dirs[a].child_count; b++)
+        {
+            SnapshotChild *saved = &children[dirs[a].child_first + b];
+            DirChild child;
+            child.path = saved->path;
+            child.cluster = saved->cluster;
+            child.size = saved->size;
+            child.slot = saved->slot;
+            memcpy(child.name83, saved->name83, 11);
+            child.attr = saved->attr;
+            child.lfn_entries = saved->lfn_entries;
+            dir_listing_add(listing, &child);
+
+            //Files that made it onto the disk get their data mapped like the scan does
+            if (!(child.attr & DIR_Attr_Directory) && child.cluster != 0)
+            {
+                add_address_region(address_from_fatclus(child.cluster),
+                                   child.size > 0 ? child.size : 1, 0, child.path);
+            }
+        }
+
+        for (uint32_t b = 0; b < dirs[a].cluster_count; b++)
+        {
+            dir_map_cluster(listing, clusters[dirs[a].cluster_first + b]);
+        }
+    }
+
+    root_dir.path = dirs[0].path;
+    root_dir.listing = dir_listings[0];
+    root_dir.parent = &root_dir;
+    current_dir = &root_dir;
+    current_fat_position = header->current_fat_position;
+    munmap(map, st.st_size);
+    return 0;
+}
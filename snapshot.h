@@ -0,0 +1,76 @@
+/*
+ * vsfat - virtual synthetic FAT filesystem on network block device from local folder
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <stdint.h>
+
+//Bump the version whenever the layout of the file changes
+#define Snapshot_Magic "VSFATSNP"
+#define Snapshot_Version 2
+
+//The file is the header, then the dirs, children, directory clusters,
+//FAT runs, path table and finally the names, each section following the last
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_size;
+    uint32_t fat_entries;
+    uint32_t current_fat_position;
+    uint32_t dir_count;
+    uint32_t child_count;
+    uint32_t cluster_count;
+    uint32_t run_count;
+    uint32_t path_count;
+    uint32_t names_size;
+} SnapshotHeader;
+
+typedef struct SnapshotDir
+{
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t parent;
+    uint32_t path;
+    uint32_t first_cluster;
+    uint32_t parent_cluster;
+    uint32_t child_first;
+    uint32_t child_count;
+    uint32_t cluster_first;
+    uint32_t cluster_count;
+    uint32_t dots;
+    uint32_t reserved;
+} SnapshotDir;
+
+typedef struct SnapshotChild
+{
+    uint32_t path;
+    uint32_t cluster;
+    uint32_t size;
+    uint32_t slot;
+    unsigned char name83[11];
+    uint8_t attr;
+    uint8_t lfn_entries;
+    uint8_t reserved[3];
+} SnapshotChild;
+
+int snapshot_save(const char *file, const char *export_path);
+int snapshot_load(const char *file, const char *export_path);
+
+#endif /* SNAPSHOT_H_INCLUDED */
@@ -0,0 +1,244 @@
+/*
+ * sparse - thin provisioned memory store for busexmp
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+
+static int is_zero(const unsigned char *data, uint32_t len)
+{
+  while (len && ((uintptr_t)data & 7))
+  {
+    if (*data++)
+      return 0;
+    len--;
+  }
+  for (; len >= 8; data += 8, len -= 8)
+    if (*(const uint64_t *)data)
+      return 0;
+  while (len--)
+    if (*data++)
+      return 0;
+  return 1;
+}
+
+/* Return the slot holding page `page', creating its leaf if `create' is set.
+ * Leaves are never freed, so once published they can be read without a
+ * lock. */
+static unsigned char **page_slot(struct sparse_device *dev, uint64_t page, int create)
+{
+  uint64_t l = page / SPARSE_LEAF_PAGES;
+  unsigned char **leaf = __atomic_load_n(&dev->leaves[l], __ATOMIC_ACQUIRE);
+
+  if (!leaf)
+  {
+    if (!create)
+      return NULL;
+    pthread_mutex_lock(&dev->leaves_lock);
+    leaf = dev->leaves[l];
+    if (!leaf)
+    {
+      leaf = calloc(SPARSE_LEAF_PAGES, sizeof(unsigned char *));
+      __atomic_store_n(&dev->leaves[l], leaf, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dev->leaves_lock);
+    if (!leaf)
+      return NULL;
+  }
+  return &leaf[page % SPARSE_LEAF_PAGES];
+}
+
+static pthread_mutex_t *page_lock(struct sparse_device *dev, uint64_t page)
+{
+  return &dev->locks[page % SPARSE_LOCKS];
+}
+
+static void free_page(struct sparse_device *dev, unsigned char **slot)
+{
+  free(*slot);
+  *slot = NULL;
+  __atomic_sub_fetch(&dev->pages, 1, __ATOMIC_RELAXED);
+}
+
+/* Apply `len' bytes of `src' (or zeros when src is NULL) at `offset'. Zero
+ * data never allocates, and a page that ends up all zeros is released. */
+static int update(struct sparse_device *dev, const unsigned char *src, uint32_t len, uint64_t offset)
+{
+  while (len > 0)
+  {
+    uint64_t page = offset >> dev->page_shift;
+    uint32_t inner = offset & (dev->page_size - 1);
+    uint32_t n = dev->page_size - inner;
+    int zero;
+    unsigned char **slot;
+    pthread_mutex_t *lock = page_lock(dev, page);
+
+    if (n > len)
+      n = len;
+    zero = !src || is_zero(src, n);
+
+    slot = page_slot(dev, page, !zero);
+    if (!slot && !zero)
+      return ENOMEM;
+
+    if (slot)
+    {
+      pthread_mutex_lock(lock);
+      if (!*slot && !zero)
+      {
+        *slot = calloc(1, dev->page_size);
+        if (!*slot)
+        {
+          pthread_mutex_unlock(lock);
+          return ENOMEM;
+        }
+        __atomic_add_fetch(&dev->pages, 1, __ATOMIC_RELAXED);
+      }
+      if (*slot)
+      {
+        if (n == dev->page_size && zero)
+        {
+          free_page(dev, slot);
+        }
+        else
+        {
+          if (zero)
+            memset(*slot + inner, 0, n);
+          else
+            memcpy(*slot + inner, src, n);
+          if (zero && is_zero(*slot, dev->page_size))
+            free_page(dev, slot);
+        }
+      }
+      pthread_mutex_unlock(lock);
+    }
+
+    if (src)
+      src += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int sparse_init(struct sparse_device *dev, uint64_t size, uint32_t page_size, int debug)
+{
+  uint64_t pages;
+
+  memset(dev, 0, sizeof(struct sparse_device));
+  if (page_size < 512 || (page_size & (page_size - 1)))
+    return -1;
+  dev->debug = debug;
+  dev->size = size;
+  dev->page_size = page_size;
+  while ((1U << dev->page_shift) < page_size)
+    dev->page_shift++;
+
+  pages = (size + page_size - 1) >> dev->page_shift;
+  dev->leaves_count = (pages + SPARSE_LEAF_PAGES - 1) / SPARSE_LEAF_PAGES;
+  dev->leaves = calloc(dev->leaves_count, sizeof(unsigned char **));
+  if (!dev->leaves)
+    return -1;
+
+  pthread_mutex_init(&dev->leaves_lock, NULL);
+  for (int l = 0; l < SPARSE_LOCKS; l++)
+    pthread_mutex_init(&dev->locks[l], NULL);
+  return 0;
+}
+
+int sparse_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct sparse_device *dev = userdata;
+  unsigned char *out = buf;
+
+  if (dev->debug)
+    fprintf(stderr, "R - %lu, %u\n", offset, len);
+
+  while (len > 0)
+  {
+    uint64_t page = offset >> dev->page_shift;
+    uint32_t inner = offset & (dev->page_size - 1);
+    uint32_t n = dev->page_size - inner;
+    unsigned char **slot = page_slot(dev, page, 0);
+
+    if (n > len)
+      n = len;
+
+    /* Unwritten pages are zeros without touching any memory. */
+    if (!slot)
+    {
+      memset(out, 0, n);
+    }
+    else
+    {
+      pthread_mutex_t *lock = page_lock(dev, page);
+
+      pthread_mutex_lock(lock);
+      if (*slot)
+        memcpy(out, *slot + inner, n);
+      else
+        memset(out, 0, n);
+      pthread_mutex_unlock(lock);
+    }
+
+    out += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int sparse_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct sparse_device *dev = userdata;
+
+  if (dev->debug)
+    fprintf(stderr, "W - %lu, %u\n", offset, len);
+  return update(dev, buf, len, offset);
+}
+
+/* Trim and write-zeroes are the same thing here: release what's covered. */
+int sparse_trim(uint64_t from, uint32_t len, void *userdata)
+{
+  struct sparse_device *dev = userdata;
+
+  if (dev->debug)
+    fprintf(stderr, "T - %lu, %u\n", from, len);
+  return update(dev, NULL, len, from);
+}
+
+void sparse_disc(void *userdata)
+{
+  struct sparse_device *dev = userdata;
+
+  fprintf(stderr, "Received a disconnect request.\n");
+  sparse_print_stats(stderr, dev);
+}
+
+void sparse_print_stats(FILE *out, struct sparse_device *dev)
+{
+  uint64_t pages = __atomic_load_n(&dev->pages, __ATOMIC_RELAXED);
+
+  fprintf(out, "sparse: %lu of %lu bytes resident in %lu pages of %u\n",
+          pages * dev->page_size, dev->size, pages, dev->page_size);
+}
@@ -0,0 +1,56 @@
+/*
+ * sparse - thin provisioned memory store for busexmp
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef SPARSE_H_INCLUDED
+#define SPARSE_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SPARSE_LEAF_PAGES 4096
+#define SPARSE_LOCKS 1024
+
+/* Pages are only allocated when something non-zero is written to them, so
+ * the device can be far larger than memory. The page table is two levels:
+ * a directory sized for the device pointing at leaves that are allocated on
+ * first use and kept. */
+struct sparse_device
+{
+  uint64_t size;
+  uint32_t page_size;
+  uint32_t page_shift;
+  uint64_t leaves_count;
+  unsigned char ***leaves;
+  pthread_mutex_t leaves_lock;
+  // per page locks, striped by page number
+  pthread_mutex_t locks[SPARSE_LOCKS];
+  uint64_t pages;
+  int debug;
+};
+
+int sparse_init(struct sparse_device *dev, uint64_t size, uint32_t page_size, int debug);
+int sparse_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int sparse_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int sparse_trim(uint64_t from, uint32_t len, void *userdata);
+void sparse_disc(void *userdata);
+void sparse_print_stats(FILE *out, struct sparse_device *dev);
+
+#endif /* SPARSE_H_INCLUDED */
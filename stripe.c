@@ -0,0 +1,244 @@
+/*
+ * stripe - striping over several backing files for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "stripe.h"
+
+static int member_io(struct stripe_member *m)
+{
+    if (m->write)
+        return pwritev_all(m->fd, m->iov, m->iovcnt, m->offset);
+    return preadv_all(m->fd, m->iov, m->iovcnt, m->offset);
+}
+
+static void *member_thread(void *arg)
+{
+    struct stripe_member *m = arg;
+    struct stripe_device *dev = m->dev;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;)
+    {
+        while (!m->busy && !dev->stopping)
+            pthread_cond_wait(&dev->go, &dev->lock);
+        if (dev->stopping)
+            break;
+        pthread_mutex_unlock(&dev->lock);
+
+        m->err = member_io(m);
+
+        pthread_mutex_lock(&dev->lock);
+        m->busy = 0;
+        if (--dev->outstanding == 0)
+            pthread_cond_signal(&dev->done);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+static int add_piece(struct stripe_member *m, char *buf, uint32_t len)
+{
+    if (m->iovcnt == m->iovcap)
+    {
+        int cap = m->iovcap ? m->iovcap * 2 : 16;
+        struct iovec *iov = realloc(m->iov, cap * sizeof(struct iovec));
+
+        if (!iov)
+            return ENOMEM;
+        m->iov = iov;
+        m->iovcap = cap;
+    }
+    m->iov[m->iovcnt].iov_base = buf;
+    m->iov[m->iovcnt].iov_len = len;
+    m->iovcnt++;
+    m->bytes += len;
+    return 0;
+}
+
+/* Split the request by member, run every member's share at once and wait.
+ * The calling thread does the first share itself rather than hand it off. */
+static int stripe_rw(struct stripe_device *dev, char *buf, uint32_t len, uint64_t offset, int write)
+{
+    struct stripe_member *first = NULL;
+    int err = 0;
+
+    for (uint32_t i = 0; i < dev->count; i++)
+        dev->members[i].iovcnt = 0;
+
+    while (len > 0 && !err)
+    {
+        uint64_t unit = offset / dev->stripe_size;
+        uint32_t inner = offset % dev->stripe_size;
+        uint32_t n = dev->stripe_size - inner;
+        struct stripe_member *m = &dev->members[unit % dev->count];
+
+        if (n > len)
+            n = len;
+        if (!m->iovcnt)
+        {
+            m->offset = unit / dev->count * dev->stripe_size + inner;
+            m->write = write;
+            m->err = 0;
+            if (!first)
+                first = m;
+        }
+        err = add_piece(m, buf, n);
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+    if (err || !first)
+        return err;
+
+    pthread_mutex_lock(&dev->lock);
+    for (uint32_t i = 0; i < dev->count; i++)
+    {
+        struct stripe_member *m = &dev->members[i];
+
+        if (m != first && m->iovcnt)
+        {
+            m->busy = 1;
+            dev->outstanding++;
+        }
+    }
+    if (dev->outstanding)
+        pthread_cond_broadcast(&dev->go);
+    pthread_mutex_unlock(&dev->lock);
+
+    err = member_io(first);
+
+    pthread_mutex_lock(&dev->lock);
+    while (dev->outstanding)
+        pthread_cond_wait(&dev->done, &dev->lock);
+    pthread_mutex_unlock(&dev->lock);
+
+    for (uint32_t i = 0; i < dev->count && !err; i++)
+        if (dev->members[i].iovcnt)
+            err = dev->members[i].err;
+    return err;
+}
+
+int stripe_open(struct stripe_device *dev, char *const paths[], uint32_t count,
+                uint32_t stripe_size, int debug)
+{
+    uint64_t smallest = UINT64_MAX;
+
+    memset(dev, 0, sizeof(struct stripe_device));
+    dev->debug = debug;
+    dev->count = count;
+    dev->stripe_size = stripe_size;
+    if (stripe_size < 512 || stripe_size % 512)
+    {
+        fprintf(stderr, "Stripe size must be a multiple of 512 bytes\n");
+        return -1;
+    }
+
+    dev->members = calloc(count, sizeof(struct stripe_member));
+    if (!dev->members)
+        return -1;
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->go, NULL);
+    pthread_cond_init(&dev->done, NULL);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        struct stripe_member *m = &dev->members[i];
+        uint64_t size;
+
+        m->dev = dev;
+        m->fd = open(paths[i], O_RDWR);
+        if (m->fd == -1 || fd_size(m->fd, &size) == -1)
+        {
+            fprintf(stderr, "Failed to open `%s': %s\n", paths[i], strerror(errno));
+            return -1;
+        }
+        if (size < smallest)
+            smallest = size;
+        if (pthread_create(&m->thread, NULL, member_thread, m))
+            return -1;
+    }
+
+    /* Every member contributes as many whole stripe units as the smallest. */
+    dev->size = smallest / stripe_size * stripe_size * count;
+    if (dev->size == 0)
+    {
+        fprintf(stderr, "The stripe members are smaller than one stripe\n");
+        return -1;
+    }
+    return 0;
+}
+
+int stripe_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct stripe_device *dev = userdata;
+
+    if (dev->debug)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+    return stripe_rw(dev, buf, len, offset, 0);
+}
+
+int stripe_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct stripe_device *dev = userdata;
+
+    if (dev->debug)
+        fprintf(stderr, "W - %lu, %u\n", offset, len);
+    /* The buffer is only read from, but iovecs aren't const. */
+    return stripe_rw(dev, (char *)buf, len, offset, 1);
+}
+
+int stripe_flush(void *userdata)
+{
+    struct stripe_device *dev = userdata;
+    int err = 0;
+
+    for (uint32_t i = 0; i < dev->count; i++)
+        if (fdatasync(dev->members[i].fd) == -1 && !err)
+            err = errno;
+    return err;
+}
+
+void stripe_disc(void *userdata)
+{
+    struct stripe_device *dev = userdata;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->stopping = 1;
+    pthread_cond_broadcast(&dev->go);
+    pthread_mutex_unlock(&dev->lock);
+    for (uint32_t i = 0; i < dev->count; i++)
+        pthread_join(dev->members[i].thread, NULL);
+
+    stripe_flush(dev);
+    for (uint32_t i = 0; i < dev->count; i++)
+        fprintf(stderr, "stripe: member %u moved %lu bytes\n", i, dev->members[i].bytes);
+}
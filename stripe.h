@@ -0,0 +1,74 @@
+/*
+ * stripe - striping over several backing files for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef STRIPE_H_INCLUDED
+#define STRIPE_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#define STRIPE_DEFAULT_SIZE (64 * 1024)
+
+struct stripe_device;
+
+/* A member's share of the current request. Consecutive stripe units on one
+ * member are adjacent on that member, so the share is always one run at
+ * `offset', gathered from or scattered to pieces of the request buffer. */
+struct stripe_member
+{
+    struct stripe_device *dev;
+    int fd;
+    pthread_t thread;
+    struct iovec *iov;
+    int iovcnt;
+    int iovcap;
+    uint64_t offset;
+    int write;
+    int busy;
+    int err;
+    uint64_t bytes;
+};
+
+/* RAID0: stripe unit u lives on member u % count, at unit u / count. Each
+ * member has a thread, so one large request keeps every disk busy at once. */
+struct stripe_device
+{
+    uint32_t count;
+    uint32_t stripe_size;
+    uint64_t size;
+    struct stripe_member *members;
+    pthread_mutex_t lock;
+    pthread_cond_t go;
+    pthread_cond_t done;
+    uint32_t outstanding;
+    int stopping;
+    int debug;
+};
+
+int stripe_open(struct stripe_device *dev, char *const paths[], uint32_t count,
+                uint32_t stripe_size, int debug);
+int stripe_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int stripe_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int stripe_flush(void *userdata);
+void stripe_disc(void *userdata);
+
+#endif /* STRIPE_H_INCLUDED */
@@ -0,0 +1,394 @@
+/*
+ * tier - RAM tier in front of a loopback backing file
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fileio.h"
+#include "tier.h"
+
+/* Accesses a block needs before it's worth a RAM slot. */
+#define TIER_PROMOTE_HEAT 3
+/* Seconds dirty blocks may sit in RAM before the flusher writes them. */
+#define TIER_WRITEBACK_DELAY 1
+#define TIER_NO_BLOCK UINT32_MAX
+
+static uint32_t block_length(struct tier_device *dev, uint32_t block)
+{
+    uint64_t left = dev->size - (uint64_t)block * TIER_BLOCK_SIZE;
+
+    return left < TIER_BLOCK_SIZE ? left : TIER_BLOCK_SIZE;
+}
+
+/* Apply the halvings a block has missed since its heat was last looked at. */
+static unsigned char heat_of(struct tier_device *dev, uint32_t block)
+{
+    uint16_t behind = dev->epoch - dev->heat_epoch[block];
+
+    if (behind)
+    {
+        dev->heat[block] = behind >= 8 ? 0 : dev->heat[block] >> behind;
+        dev->heat_epoch[block] = dev->epoch;
+    }
+    return dev->heat[block];
+}
+
+static void touch(struct tier_device *dev, uint32_t block)
+{
+    if (heat_of(dev, block) < 255)
+        dev->heat[block]++;
+
+    /* A new epoch every few passes over the RAM tier's worth of accesses,
+     * so old favourites make way for the current working set. */
+    if (++dev->accesses % ((uint64_t)dev->nslots * 8) == 0)
+        dev->epoch++;
+    for (uint32_t i = 0; i < dev->age_step; i++)
+    {
+        heat_of(dev, dev->age_hand);
+        dev->age_hand = dev->age_hand + 1 == dev->blocks ? 0 : dev->age_hand + 1;
+    }
+}
+
+/* Write a slot back in the foreground, with the lock held. */
+static int write_slot(struct tier_device *dev, struct tier_slot *slot)
+{
+    int err = pwrite_all(dev->fd, slot->data, block_length(dev, slot->block),
+                         (uint64_t)slot->block * TIER_BLOCK_SIZE);
+
+    if (!err)
+    {
+        slot->dirty = 0;
+        dev->dirty--;
+        dev->written_back++;
+    }
+    return err;
+}
+
+/* Find a RAM slot for `block', demoting a colder block if the tier is full.
+ * Returns NULL when the block isn't hot enough or nothing can be evicted. */
+static struct tier_slot *promote(struct tier_device *dev, uint32_t block, int fill)
+{
+    struct tier_slot *slot = NULL;
+
+    if (heat_of(dev, block) < TIER_PROMOTE_HEAT)
+        return NULL;
+
+    if (dev->used < dev->nslots)
+    {
+        slot = &dev->slots[dev->used++];
+    }
+    else
+    {
+        /* Clock sweep: a slot that was used since the hand last passed
+         * gets another round. Two turns are enough to find a victim. */
+        for (uint32_t i = 0; i < 2 * dev->nslots; i++)
+        {
+            struct tier_slot *s = &dev->slots[dev->hand];
+
+            dev->hand = (dev->hand + 1) % dev->nslots;
+            if (s->writing)
+                continue;
+            if (s->referenced)
+            {
+                s->referenced = 0;
+                continue;
+            }
+            slot = s;
+            break;
+        }
+        if (!slot)
+            return NULL;
+        if (slot->block != TIER_NO_BLOCK)
+        {
+            if (heat_of(dev, slot->block) >= heat_of(dev, block))
+                return NULL;
+            if (slot->dirty && write_slot(dev, slot))
+                return NULL;
+            dev->slot_of[slot->block] = 0;
+            dev->demoted++;
+        }
+    }
+
+    if (fill && pread_all(dev->fd, slot->data, TIER_BLOCK_SIZE, (uint64_t)block * TIER_BLOCK_SIZE))
+    {
+        /* Leave the slot unowned; the clock will find it again. */
+        slot->block = TIER_NO_BLOCK;
+        slot->dirty = 0;
+        slot->referenced = 0;
+        return NULL;
+    }
+    slot->block = block;
+    slot->dirty = 0;
+    slot->referenced = 1;
+    dev->slot_of[block] = slot - dev->slots + 1;
+    dev->promoted++;
+    return slot;
+}
+
+static void *flusher(void *arg)
+{
+    struct tier_device *dev = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&dev->lock);
+    while (!dev->stopping)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TIER_WRITEBACK_DELAY;
+        pthread_cond_timedwait(&dev->wake, &dev->lock, &deadline);
+
+        for (uint32_t i = 0; i < dev->used && !dev->stopping; i++)
+        {
+            struct tier_slot *slot = &dev->slots[i];
+            uint32_t block = slot->block;
+            int err;
+
+            if (!slot->dirty || slot->writing)
+                continue;
+
+            /* Copy it out so the foreground can keep writing to the slot.
+             * Clearing dirty first means a write that races with us just
+             * marks it dirty again for the next pass. */
+            slot->dirty = 0;
+            slot->writing = 1;
+            dev->dirty--;
+            memcpy(dev->flush_buf, slot->data, TIER_BLOCK_SIZE);
+            pthread_mutex_unlock(&dev->lock);
+
+            err = pwrite_all(dev->fd, dev->flush_buf, block_length(dev, block),
+                             (uint64_t)block * TIER_BLOCK_SIZE);
+
+            pthread_mutex_lock(&dev->lock);
+            slot->writing = 0;
+            if (err)
+            {
+                if (!slot->dirty)
+                    dev->dirty++;
+                slot->dirty = 1;
+                dev->error = err;
+            }
+            else
+            {
+                dev->written_back++;
+            }
+            pthread_cond_broadcast(&dev->written);
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return NULL;
+}
+
+int tier_open(struct tier_device *dev, const char *path, uint64_t ram, int debug)
+{
+    memset(dev, 0, sizeof(struct tier_device));
+    dev->debug = debug;
+    dev->fd = open(path, O_RDWR);
+    if (dev->fd == -1 || fd_size(dev->fd, &dev->size) == -1)
+    {
+        fprintf(stderr, "Failed to open `%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    dev->blocks = (dev->size + TIER_BLOCK_SIZE - 1) / TIER_BLOCK_SIZE;
+    dev->nslots = ram / TIER_BLOCK_SIZE;
+    if (dev->blocks > UINT32_MAX || dev->nslots == 0)
+    {
+        fprintf(stderr, "The RAM tier must hold at least one %dK block\n", TIER_BLOCK_SIZE / 1024);
+        return -1;
+    }
+    if (dev->nslots > dev->blocks)
+        dev->nslots = dev->blocks;
+
+    /* Visit every block at least once per 1024 epochs. */
+    dev->age_step = (dev->blocks + (uint64_t)dev->nslots * 8 * 1024 - 1) / ((uint64_t)dev->nslots * 8 * 1024);
+
+    dev->heat = calloc(dev->blocks, 1);
+    dev->heat_epoch = calloc(dev->blocks, sizeof(uint16_t));
+    dev->slot_of = calloc(dev->blocks, sizeof(uint32_t));
+    dev->slots = calloc(dev->nslots, sizeof(struct tier_slot));
+    dev->flush_buf = malloc(TIER_BLOCK_SIZE);
+    if (!dev->heat || !dev->heat_epoch || !dev->slot_of || !dev->slots || !dev->flush_buf)
+        return -1;
+    for (uint32_t i = 0; i < dev->nslots; i++)
+    {
+        dev->slots[i].data = malloc(TIER_BLOCK_SIZE);
+        if (!dev->slots[i].data)
+        {
+            fprintf(stderr, "Failed to allocate the RAM tier\n");
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->wake, NULL);
+    pthread_cond_init(&dev->written, NULL);
+    return pthread_create(&dev->flusher, NULL, flusher, dev) ? -1 : 0;
+}
+
+int tier_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct tier_device *dev = userdata;
+    unsigned char *out = buf;
+    int err = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "R - %lu, %u\n", offset, len);
+
+    pthread_mutex_lock(&dev->lock);
+    while (len > 0 && !err)
+    {
+        uint32_t block = offset / TIER_BLOCK_SIZE;
+        uint32_t inner = offset % TIER_BLOCK_SIZE;
+        uint32_t n = TIER_BLOCK_SIZE - inner;
+        struct tier_slot *slot = NULL;
+
+        if (n > len)
+            n = len;
+
+        touch(dev, block);
+        if (dev->slot_of[block])
+        {
+            slot = &dev->slots[dev->slot_of[block] - 1];
+            slot->referenced = 1;
+            dev->hits++;
+        }
+        else
+        {
+            slot = promote(dev, block, 1);
+            dev->misses++;
+        }
+
+        if (slot)
+            memcpy(out, slot->data + inner, n);
+        else
+            err = pread_all(dev->fd, out, n, offset);
+
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+int tier_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct tier_device *dev = userdata;
+    const unsigned char *src = buf;
+    int err = 0;
+
+    if (dev->debug)
+        fprintf(stderr, "W - %lu, %u\n", offset, len);
+
+    pthread_mutex_lock(&dev->lock);
+    while (len > 0 && !err)
+    {
+        uint32_t block = offset / TIER_BLOCK_SIZE;
+        uint32_t inner = offset % TIER_BLOCK_SIZE;
+        uint32_t n = TIER_BLOCK_SIZE - inner;
+        struct tier_slot *slot = NULL;
+
+        if (n > len)
+            n = len;
+
+        touch(dev, block);
+        if (dev->slot_of[block])
+        {
+            slot = &dev->slots[dev->slot_of[block] - 1];
+            slot->referenced = 1;
+            dev->hits++;
+        }
+        else
+        {
+            /* A write over the whole block needn't read it first. */
+            slot = promote(dev, block, n < TIER_BLOCK_SIZE);
+            dev->misses++;
+        }
+
+        if (slot)
+        {
+            memcpy(slot->data + inner, src, n);
+            if (!slot->dirty)
+                dev->dirty++;
+            slot->dirty = 1;
+        }
+        else
+        {
+            err = pwrite_all(dev->fd, src, n, offset);
+        }
+
+        src += n;
+        offset += n;
+        len -= n;
+    }
+    if (dev->dirty > dev->nslots / 2)
+        pthread_cond_signal(&dev->wake);
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+int tier_flush(void *userdata)
+{
+    struct tier_device *dev = userdata;
+    int err = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    for (uint32_t i = 0; i < dev->used && !err; i++)
+    {
+        /* A block the flusher is writing may be dirty again already, so
+         * wait for it rather than race it to the disk. */
+        while (dev->slots[i].writing)
+            pthread_cond_wait(&dev->written, &dev->lock);
+        if (dev->slots[i].dirty)
+            err = write_slot(dev, &dev->slots[i]);
+    }
+    if (!err)
+        err = dev->error;
+    dev->error = 0;
+    pthread_mutex_unlock(&dev->lock);
+
+    if (!err && fdatasync(dev->fd) == -1)
+        err = errno;
+    return err;
+}
+
+void tier_disc(void *userdata)
+{
+    struct tier_device *dev = userdata;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->stopping = 1;
+    pthread_cond_signal(&dev->wake);
+    pthread_mutex_unlock(&dev->lock);
+    pthread_join(dev->flusher, NULL);
+
+    tier_flush(dev);
+    fprintf(stderr, "tier: %lu hits, %lu misses, %lu promoted, %lu demoted, %lu written back\n",
+            dev->hits, dev->misses, dev->promoted, dev->demoted, dev->written_back);
+}
@@ -0,0 +1,92 @@
+/*
+ * tier - RAM tier in front of a loopback backing file
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef TIER_H_INCLUDED
+#define TIER_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TIER_BLOCK_SIZE (64 * 1024)
+
+/* One RAM copy of a backing block. */
+struct tier_slot
+{
+    uint32_t block;
+    unsigned char referenced;
+    unsigned char dirty;
+    /* being written back by the flusher thread, so it can't be evicted */
+    unsigned char writing;
+    unsigned char *data;
+};
+
+/*
+ * The backing file keeps the whole device; a fixed number of its 64K blocks
+ * also live in RAM. Every access bumps the block's heat, and a block that
+ * gets hot enough is promoted, pushing out a colder one picked by a clock
+ * sweep. Heat is halved once per epoch so yesterday's working set cools off;
+ * each block remembers the epoch its heat was last brought up to date for,
+ * and catches up when it's next looked at.
+ * Writes to RAM blocks just mark them dirty; the flusher thread writes them
+ * back in the background, and a flush waits until everything is on disk.
+ */
+struct tier_device
+{
+    int fd;
+    uint64_t size;
+    uint64_t blocks;
+    unsigned char *heat;
+    uint16_t *heat_epoch;
+    /* block -> slot + 1, 0 when the block is only on disk */
+    uint32_t *slot_of;
+    struct tier_slot *slots;
+    uint32_t nslots;
+    uint32_t used;
+    uint32_t hand;
+    uint32_t dirty;
+    uint64_t accesses;
+    uint16_t epoch;
+    /* blocks brought up to date per access, so none falls an epoch count
+     * wrap behind; the next one is at `age_hand' */
+    uint32_t age_step;
+    uint32_t age_hand;
+    unsigned char *flush_buf;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t written;
+    pthread_t flusher;
+    int stopping;
+    int error;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t promoted;
+    uint64_t demoted;
+    uint64_t written_back;
+    int debug;
+};
+
+int tier_open(struct tier_device *dev, const char *path, uint64_t ram, int debug);
+int tier_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int tier_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int tier_flush(void *userdata);
+void tier_disc(void *userdata);
+
+#endif /* TIER_H_INCLUDED */
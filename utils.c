@@ -24,6 +24,7 @@
 #include <ctype.h>
 
 #include "utils.h"
+#include "dirtables.h"
 
 int32_t min(int32_t left, int32_t right)
 {
@@ -59,14 +60,14 @@ uint32_t ceil_div(uint32_t x, uint32_t y)
 //Check if a file exists in the given directory
 int8_t file_exists(Fat_Directory *current_dir, uint8_t *filename, uint8_t *extension)
 {
-  FileEntry *testFile = current_dir->files;
-  while (testFile != 0)
+  DirListing *listing = current_dir->listing;
+  for (uint32_t a = 0; a < listing->count; a++)
   {
-    if (arrays_equal(testFile->Filename, filename, 8) && arrays_equal(testFile->Ext, extension, 3))
+    if (arrays_equal(listing->children[a].name83, filename, 8) &&
+        arrays_equal(listing->children[a].name83 + 8, extension, 3))
     {
       return 1;
     }
-    testFile = testFile->next;
   }
 
   return 0;
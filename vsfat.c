@@ -32,26 +32,36 @@
 #include "setup.h"
 #include "address.h"
 #include "fatfiles.h"
+#include "filecache.h"
+#include "fanout.h"
+#include "filemap.h"
+#include "dirtables.h"
+#include "snapshot.h"
+#include "dirwalk.h"
+#include "pathtable.h"
 
 //Global variables
 BootEntry bootentry;
-uint32_t *fat = 0;
 uint32_t current_fat_position; // 0 and 1 are special and 2 is the root dir
 Fat_Directory root_dir;
 Fat_Directory *current_dir;
 unsigned char *mbr;
 
-//Local file caching variables
-char *cachedFilePath = 0;
-FILE *cachedFile = 0;
-uint32_t cachedRegion = 0;
-
 //Debug flag
 static int xmpl_debug = 0;
+//Serve source files out of mmap'd windows instead of reading them
+static int map_files = 0;
+//Splice source files straight to the socket
+static int splice_files = 0;
+//Where the layout is saved between runs
+static char *snapshot_file = 0;
 
 //Function prototypes for API
 static int xmp_read(void *buf, uint32_t len, uint64_t offset,
                     void *userdata);
+static int xmp_read_splice(void *buf, uint32_t len, uint64_t offset,
+                           struct buse_segment *segs, uint32_t *count,
+                           void *userdata);
 static int xmp_write(const void *buf, uint32_t len, uint64_t offset,
                      void *userdata);
 static void xmp_disc(void *userdata);
@@ -69,8 +79,28 @@ static struct buse_operations aop = {
     .size_blocks = 4292870144,
 };
 
+//Say which source file a piece of a read came from
+static void debug_file(const char *how, uint32_t path, uint32_t pos, uint32_t len)
+{
+  char name[PATH_MAX];
+  if (path_build(path, name, sizeof(name)) < 0)
+  {
+    strcpy(name, "(path too long)");
+  }
+  fprintf(stderr, "%s: %s pos: %u len: %u\n", how, name, pos, len);
+}
+
 //API Functions
 static int xmp_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  return xmp_read_splice(buf, len, offset, 0, 0, userdata);
+}
+
+//Fill buf with what's mapped at offset. If segs is given, file backed pieces
+//are handed back in it to be spliced to the socket instead of being read
+static int xmp_read_splice(void *buf, uint32_t len, uint64_t offset,
+                           struct buse_segment *segs, uint32_t *count,
+                           void *userdata)
 {
   if (*(int *)userdata)
   {
@@ -80,142 +110,151 @@ static int xmp_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
     fprintf(stderr, "Read %#x bytes from  %#llx\n", len, offset);
 #endif
   }
-  //Make sure the buffer is zeroed
+  //Make sure the buffer is zeroed, anything not mapped reads back as 0s
   memset(buf, 0, len);
-  //Check if this read falls within a mapped area
-  //No point doing this if we've already used up len
-  for (uint32_t a = 0; a < address_regions_count && len > 0; a++)
+
+  //File backed pieces are gathered up and read together at the end
+  FanoutRead reads[Fanout_Max_Reads];
+  uint32_t nreads = 0;
+  uint32_t nsegs = 0;
+  //The cache can't close anything in the batch until it's been read
+  file_cache_hold(1);
+
+  //Walk only the regions that overlap this read, starting with the first one
+  //that ends after our offset. They're sorted, so we can stop at the first one
+  //that starts past our end
+  uint64_t end = offset + len;
+  for (uint32_t a = address_region_find(offset);
+       a < address_regions_count && address_regions[a].base < end; a++)
   {
-    //Check if this read is within our cache
-    if (cachedRegion != 0)
+    AddressRegion *region = &address_regions[a];
+    uint64_t region_end = region->base + region->length;
+    if (region_end <= offset)
     {
-      //We only cache if the entire request is within the cached region
-      if (offset > address_regions[cachedRegion].base &&
-          offset + len <= address_regions[a].base + address_regions[a].length)
-      {
-        a = cachedRegion;
-      }
+      continue;
     }
-    if ((offset >= address_regions[a].base && // See if the beginning is inside our range
-         offset <= address_regions[a].base + address_regions[a].length) ||
-        (offset + len >= address_regions[a].base && // See if the end is (we'll also accept both)
-         offset + len <= address_regions[a].base + address_regions[a].length) ||
-        (offset <= address_regions[a].base && //Or, we're entirely contained within it
-         offset + len >= address_regions[a].base + address_regions[a].length))
+
+    //Position within the region, position within buf and how much to copy
+    uint32_t usepos;
+    uint32_t usetarget;
+    uint32_t uselen;
+    if (offset < region->base)
+    {
+      usepos = 0;
+      usetarget = region->base - offset;
+    }
+    else
     {
-      uint32_t uselen = len;
-      uint32_t usepos;
-      uint32_t usetarget;
+      usepos = offset - region->base;
+      usetarget = 0;
+    }
+    uselen = (region_end < end ? region_end : end) - (offset + usetarget);
 
-      //Figure out who's first and set the offset variables accordingly
-      if (offset < address_regions[a].base)
-      {
-        usepos = 0;
-        usetarget = address_regions[a].base - offset;
-      }
-      else
-      {
-        usepos = offset - address_regions[a].base;
-        usetarget = 0;
-      }
+    if (*(int *)userdata)
+    {
+#if defined(ENV64BIT)
+      fprintf(stderr,
+              "base: %#lx length: %#x usepos: %#x offset: %#lx len: %#x usetarget: %#x uselen: %#x\n",
+              region->base, region->length,
+              usepos, offset, len, usetarget, uselen);
+#else
+      fprintf(stderr,
+              "base: %#llx length: %#x usepos: %#x offset: %#llx len: %#x usetarget: %#x uselen: %#x\n",
+              region->base, region->length,
+              usepos, offset, len, usetarget, uselen);
 
-      //If they're only asking for part of what we have
-      if (address_regions[a].base + address_regions[a].length >= offset + len)
-      {
-        uselen = offset + len - address_regions[a].base;
-      }
+#endif
+    }
 
-      //Make sure we don't go off the end
-      if (uselen > address_regions[a].length - usepos)
-      {
-        uselen = address_regions[a].length - usepos;
-      }
-      //Or give them more than what they want
-      if (uselen > len)
+    //Generated on the fly
+    if (region->flags & Region_Generated)
+    {
+      RegionGenerator *generator = region->mem_pointer;
+      generator->generate(generator->context, (unsigned char *)buf + usetarget,
+                          usepos, uselen);
+    }
+    //For real memory mapped stuff
+    else if (region->mem_pointer)
+    {
+      memcpy((unsigned char *)buf + usetarget,
+             (unsigned char *)region->mem_pointer + usepos, uselen);
+    }
+    else if (region->path != Path_None) //Mapped in file
+    {
+      if (segs)
       {
-        uselen = len;
+        //If we're out of segments, or the cache can't keep another descriptor
+        //open until the reply has gone out, start over and just read it all
+        if (nsegs == *count || file_cache_full())
+        {
+          *count = 0;
+          return xmp_read_splice(buf, len, offset, 0, 0, userdata);
+        }
+        int fd = file_cache_get(a);
+        if (fd >= 0)
+        {
+          segs[nsegs].fd = fd;
+          segs[nsegs].offset = usepos;
+          segs[nsegs].pos = usetarget;
+          segs[nsegs].len = uselen;
+          nsegs++;
+          if (*(int *)userdata)
+          {
+            debug_file("spliced file", region->path, usepos, uselen);
+          }
+        }
+        continue;
       }
 
-      if (*(int *)userdata)
+      //Issue what we've gathered so far if the cache can't hold another one open
+      if (nreads == Fanout_Max_Reads || file_cache_full())
       {
-#if defined(ENV64BIT)
-        fprintf(stderr,
-                "base: %#lx length: %#lx usepos: %#x offset: %#lx len: %#x usetarget: %#x uselen: %#x\n",
-                address_regions[a].base, address_regions[a].length,
-                usepos, offset, len, usetarget, uselen);
-#else
-        fprintf(stderr,
-                "base: %#llx length: %#llx usepos: %#x offset: %#llx len: %#x usetarget: %#x uselen: %#x\n",
-                address_regions[a].base, address_regions[a].length,
-                usepos, offset, len, usetarget, uselen);
-
-#endif
+        int err = fanout_run(reads, nreads);
+        nreads = 0;
+        file_cache_hold(1);
+        if (err)
+        {
+          return err;
+        }
       }
 
-      //For real memory mapped stuff
-      if (address_regions[a].mem_pointer)
+      //Mapped files are copied straight out of the page cache
+      //If the file can't be mapped, it gets read like any other
+      if (map_files && file_map_copy(a, (unsigned char *)buf + usetarget, usepos, uselen) == 0)
       {
-        memcpy((unsigned char *)buf + usetarget,
-               (unsigned char *)address_regions[a].mem_pointer + usepos, uselen);
-        len = len - (uselen + usetarget);
-        offset += uselen + usetarget;
-        buf = (unsigned char *)buf + uselen + usetarget;
+        if (*(int *)userdata)
+        {
+          debug_file("mapped file", region->path, usepos, uselen);
+        }
+        continue;
       }
-      else //Mapped in file
+
+      int fd = file_cache_get(a);
+      if (fd >= 0)
       {
-        if (address_regions[a].file_path)
+        //Anything past the end of the file reads back as 0s
+        reads[nreads].fd = fd;
+        reads[nreads].buf = (unsigned char *)buf + usetarget;
+        reads[nreads].len = uselen;
+        reads[nreads].offset = usepos;
+        nreads++;
+        if (*(int *)userdata)
         {
-          FILE *fd;
-          //Check our cached file descriptor first
-          //Note that this is comparing the pointers, not the strings
-          if (cachedFilePath == address_regions[a].file_path)
-          {
-            fd = cachedFile;
-          }
-          else
-          {
-            //If it's not, close the cached file
-            if (cachedFile != 0)
-            {
-              fclose(cachedFile);
-              cachedFile = 0;
-            }
-            fd = fopen(address_regions[a].file_path, "rb");
-            cachedFile = fd;
-            cachedFilePath = address_regions[a].file_path;
-          }
-          if (fd)
-          {
-
-            fseek(fd, usepos, SEEK_SET);
-            size_t read_count = fread((unsigned char *)buf + usetarget, uselen, 1, fd);
-            if (*(int *)userdata)
-            {
-#if defined(ENV64BIT)
-              fprintf(stderr,
-                      "file: %s pos: %u len: %u read_count: %lu\n", address_regions[a].file_path, usepos, uselen, read_count);
-#else
-              fprintf(stderr,
-                      "file: %s pos: %u len: %u read_count: %u\n", address_regions[a].file_path, usepos, uselen, read_count);
-#endif
-            }
-            //Up above, we already made sure we have enough data available
-            //So, we either got it or we didn't, either way, we assume we did and move on
-            //If we didn't, something will blow up, but that's a tolerable behavior
-            len = len - (uselen + usetarget);
-            offset += uselen + usetarget;
-            buf = (unsigned char *)buf + uselen + usetarget;
-          }
+          debug_file("file", region->path, usepos, uselen);
         }
       }
     }
   }
-  //If we've gotten here, we've used up all the mapped in areas, so fill the rest with 0s
-  memset(buf, 0, len);
-  //Pedantry
-  buf = (unsigned char *)buf + len;
-  len = 0;
-  return 0;
+
+  //A read that covers several small files gets them all in parallel
+  int err = fanout_run(reads, nreads);
+  //Nothing gets closed before the next read, so spliced descriptors stay valid
+  file_cache_hold(0);
+  if (segs)
+  {
+    *count = nsegs;
+  }
+  return err;
 }
 
 static int xmp_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
@@ -264,56 +303,53 @@ static int xmp_trim(uint64_t from, uint32_t len, void *userdata)
   return 0;
 }
 
-//Scan a given folder and recursively add it to the memory space
-static void scan_folder(char *path)
+//Add a folder that's been walked to the current directory, entering its folders
+static void add_folder(WalkDir *dir)
 {
-  DIR *d = opendir(path);
-  struct stat st;
-  if (d == NULL)
-    return;
-  struct dirent *dir;
-  while ((dir = readdir(d)) != NULL)
+  current_dir->listing->mtime = dir->mtime;
+  for (uint32_t a = 0; a < dir->count; a++)
   {
-    if (dir->d_type != DT_DIR)
+    WalkEntry *entry = &dir->entries[a];
+    char *name = dir->names + entry->name;
+    uint32_t path = path_add(current_dir->path, name);
+    if (path == Path_None)
     {
-      if (strlen(dir->d_name) + strlen(path) + 1 < PATH_MAX) // If our full path exceeds the allowable length, drop this file
-      {
-        char *f_path;
-        //TODO: Check actual memory usage with large numbers of files
-        f_path = malloc(strlen(dir->d_name) + strlen(path) + 2);
-
-        sprintf(f_path, "%s/%s", path, dir->d_name);
-        stat(f_path, &st);
-#if defined(ENV64BIT)
-        printf("%s/%s  %ld\n", path, dir->d_name, st.st_size);
-#else
-        printf("%s/%s  %lld\n", path, dir->d_name, st.st_size);
-#endif
-        add_file(dir->d_name, f_path, st.st_size, 0);
-      }
-      else
+      fprintf(stderr, "Out of room for paths, dropping %s\n", name);
+      continue;
+    }
+    if (entry->dir == 0)
+    {
+      if (xmpl_debug)
       {
-        fprintf(stderr, "File %s/%s path is too long\n", path, dir->d_name);
+        printf("%s/%s  %llu\n", dir->path, name, (unsigned long long)entry->size);
       }
+      add_file(name, path, entry->size, 0);
     }
     else
     {
-      if (dir->d_type == DT_DIR && strcmp(dir->d_name, ".") != 0 && strcmp(dir->d_name, "..") != 0) // skip . and ..
+      if (xmpl_debug)
       {
-        printf("Dir: %s/%s\n", path, dir->d_name);
-
-        char *d_path;
-        d_path = malloc(strlen(dir->d_name) + strlen(path) + 2);
-        sprintf(d_path, "%s/%s", path, dir->d_name);
-
-        //Create a new dir in the FS and enter it
-        add_file(dir->d_name, d_path, 0, 1);
-        scan_folder(d_path); // recursive
+        printf("Dir: %s\n", entry->dir->path);
+      }
+      //Create a new dir in the FS and enter it
+      //If there wasn't room for it, its contents are skipped too
+      Fat_Directory *parent = current_dir;
+      add_file(name, path, 0, 1);
+      if (current_dir != parent)
+      {
+        add_folder(entry->dir);
         up_dir();
       }
     }
   }
-  closedir(d);
+}
+
+//Read the whole tree in parallel, then lay it out in order on one thread
+static void scan_folder(char *path)
+{
+  WalkDir *root = dir_walk(path, Walk_Threads);
+  add_folder(root);
+  dir_walk_free(root);
 }
 
 int main(int argc, char *argv[])
@@ -322,19 +358,36 @@ int main(int argc, char *argv[])
   {
     fprintf(stderr,
             "Usage:\n"
-            "  %s /dev/nbd0 ./folder_to_export [--debug]\n"
+            "  %s /dev/nbd0 ./folder_to_export [--debug] [--mmap] [--splice] [--snapshot file]\n"
             "Don't forget to load the nbd kernel module (`modprobe nbd`) and\n"
-            "run as root. Adding --debug will turn on debugging\n",
+            "run as root. Adding --debug will turn on debugging\n"
+            "Adding --mmap will serve source files through memory mappings\n"
+            "Adding --splice will send source files to the device without copying\n"
+            "Adding --snapshot keeps the layout in the given file and skips the scan\n"
+            "when none of the exported folders have changed\n",
             argv[0]);
     return 1;
   }
 
-  //Check the debug flag
-  if (argc > 3)
+  //Check the flags
+  for (int a = 3; a < argc; a++)
   {
-    if (strcmp(argv[3], "--debug") == 0)
+    if (strcmp(argv[a], "--debug") == 0)
     {
       xmpl_debug = 1;
+      aop.debug = 1;
+    }
+    else if (strcmp(argv[a], "--mmap") == 0)
+    {
+      map_files = 1;
+    }
+    else if (strcmp(argv[a], "--splice") == 0)
+    {
+      splice_files = 1;
+    }
+    else if (strcmp(argv[a], "--snapshot") == 0 && a + 1 < argc)
+    {
+      snapshot_file = argv[++a];
     }
   }
 
@@ -345,9 +398,32 @@ int main(int argc, char *argv[])
   aop.size_blocks = DiskSize;
 
   build_fats();
-  build_root_dir();
-  //Populate the virtual disk with the contents of the given FS
-  scan_folder(argv[2]);
+  if (snapshot_file != 0 && snapshot_load(snapshot_file, argv[2]) == 0)
+  {
+    fprintf(stderr, "Layout loaded from %s\n", snapshot_file);
+  }
+  else
+  {
+    build_root_dir(argv[2]);
+    //Populate the virtual disk with the contents of the given FS
+    scan_folder(argv[2]);
+    if (snapshot_file != 0)
+    {
+      snapshot_save(snapshot_file, argv[2]);
+    }
+  }
+  //Sort the regions so reads can find theirs without walking all of them
+  address_regions_index();
+  file_cache_init();
+  fanout_init(Fanout_Threads);
+  if (map_files)
+  {
+    file_map_init();
+  }
+  if (splice_files)
+  {
+    aop.read_splice = xmp_read_splice;
+  }
 
   fprintf(stderr, "Scan complete, launching block device\n");
 
@@ -32,31 +32,12 @@
 #endif
 #endif
 
-//Linked list for files in a directory
-typedef struct FileEntry
-{
-    unsigned char Filename[8];
-    unsigned char Ext[3];
-    struct FileEntry *next;
-} FileEntry;
-
-//Linked list for the DirTables
-typedef struct DirTable
-{
-    unsigned char *dirtable;
-    struct DirTable *next;
-} DirTable;
-
-//Ultimately, the file_path might move out of here
-//But, for now, this is a very straight forward way to handle the mapping
-
 typedef struct Fat_Directory
 {
-    char *path;
-    DirTable *dirtables;
+    uint32_t path; // Index in the path table
+    struct DirListing *listing;
     uint32_t current_dir_position;
-    uint32_t dir_location;
-    FileEntry *files;
+    uint32_t dir_location; // Last cluster of the chain
     struct Fat_Directory *parent;
 } Fat_Directory;
 
@@ -151,7 +132,6 @@ typedef struct FSInfo
 
 //Global variables
 extern BootEntry bootentry;
-extern uint32_t *fat;
 
 extern uint32_t current_fat_position; // 0 and 1 are special and 2 is the root dir
 extern Fat_Directory root_dir;
@@ -0,0 +1,424 @@
+/*
+ * wbcache - write-back cache with group commit for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wbcache.h"
+
+/* Dirty data waits at most this long for the writer. */
+#define WB_DELAY 1
+/* Adjacent blocks are written together up to this much at a time. */
+#define WB_MAX_RUN (1024 * 1024)
+
+static int table_init(struct wb_table *table, uint32_t nbuckets)
+{
+    table->buckets = calloc(nbuckets, sizeof(struct wb_block *));
+    table->nbuckets = nbuckets;
+    table->count = 0;
+    return table->buckets ? 0 : -1;
+}
+
+static struct wb_block *table_find(struct wb_table *table, uint64_t block)
+{
+    struct wb_block *b = table->buckets[block % table->nbuckets];
+
+    while (b && b->block != block)
+        b = b->next;
+    return b;
+}
+
+static void table_insert(struct wb_table *table, struct wb_block *b)
+{
+    struct wb_block **bucket = &table->buckets[b->block % table->nbuckets];
+
+    b->next = *bucket;
+    *bucket = b;
+    table->count++;
+}
+
+/* Free every block and leave the table empty. */
+static void table_clear(struct wb_table *table)
+{
+    for (uint32_t i = 0; i < table->nbuckets; i++)
+    {
+        struct wb_block *b = table->buckets[i];
+
+        while (b)
+        {
+            struct wb_block *next = b->next;
+
+            free(b);
+            b = next;
+        }
+    }
+    memset(table->buckets, 0, table->nbuckets * sizeof(struct wb_block *));
+    table->count = 0;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+    const struct wb_block *left = *(struct wb_block *const *)a;
+    const struct wb_block *right = *(struct wb_block *const *)b;
+
+    return left->block < right->block ? -1 : left->block > right->block;
+}
+
+static uint32_t block_length(struct wb_device *dev, uint64_t block)
+{
+    uint64_t left = dev->size - block * WB_BLOCK_SIZE;
+
+    return left < WB_BLOCK_SIZE ? left : WB_BLOCK_SIZE;
+}
+
+/* Write out everything in `inflight', in block order, merging neighbours.
+ * Called without the lock; nothing else touches `inflight' meanwhile. */
+static int write_inflight(struct wb_device *dev, unsigned char *run)
+{
+    struct wb_table *table = &dev->inflight;
+    struct wb_block **sorted = malloc(table->count * sizeof(struct wb_block *));
+    uint32_t n = 0;
+    int err = 0;
+
+    if (!sorted)
+        return ENOMEM;
+    for (uint32_t i = 0; i < table->nbuckets; i++)
+        for (struct wb_block *b = table->buckets[i]; b; b = b->next)
+            sorted[n++] = b;
+    qsort(sorted, n, sizeof(struct wb_block *), compare_blocks);
+
+    for (uint32_t i = 0; i < n && !err;)
+    {
+        uint64_t first = sorted[i]->block;
+        uint32_t len = 0;
+
+        while (i < n && sorted[i]->block == first + len / WB_BLOCK_SIZE && len < WB_MAX_RUN)
+        {
+            uint32_t bytes = block_length(dev, sorted[i]->block);
+
+            memcpy(run + len, sorted[i]->data, bytes);
+            len += bytes;
+            i++;
+            if (bytes < WB_BLOCK_SIZE)
+                break;
+        }
+        err = dev->inner->write(run, len, first * WB_BLOCK_SIZE, dev->inner_userdata);
+        dev->runs++;
+        dev->written += len;
+    }
+    free(sorted);
+    return err;
+}
+
+static void *writer(void *arg)
+{
+    struct wb_device *dev = arg;
+    unsigned char *run = malloc(WB_MAX_RUN);
+    struct timespec deadline;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;)
+    {
+        uint64_t cycle;
+        int sync;
+        int err;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WB_DELAY;
+        while (!dev->stopping && dev->dirty.count < dev->capacity / 2 &&
+               dev->flush_target <= dev->cycle && dev->drain_target <= dev->cycle)
+        {
+            if (pthread_cond_timedwait(&dev->wake, &dev->lock, &deadline) != ETIMEDOUT)
+                continue;
+            if (dev->dirty.count)
+                break;
+            deadline.tv_sec += WB_DELAY;
+        }
+        if (dev->stopping && !dev->dirty.count && dev->flush_target <= dev->cycle)
+            break;
+
+        /* Take everything dirty so far; later writes start a new set. */
+        {
+            struct wb_table swap = dev->inflight;
+
+            dev->inflight = dev->dirty;
+            dev->dirty = swap;
+        }
+        cycle = ++dev->cycle;
+        sync = dev->flush_target >= cycle;
+        pthread_cond_broadcast(&dev->room);
+        pthread_mutex_unlock(&dev->lock);
+
+        err = run ? write_inflight(dev, run) : ENOMEM;
+        if (!err && sync && dev->inner->flush)
+            err = dev->inner->flush(dev->inner_userdata);
+
+        pthread_mutex_lock(&dev->lock);
+        table_clear(&dev->inflight);
+        if (err)
+            dev->error = err;
+        if (sync)
+        {
+            dev->durable = cycle;
+            dev->syncs++;
+        }
+        dev->completed = cycle;
+        pthread_cond_broadcast(&dev->done);
+    }
+    pthread_mutex_unlock(&dev->lock);
+    free(run);
+    return NULL;
+}
+
+/* The current contents of a block, if the cache has them. */
+static struct wb_block *lookup(struct wb_device *dev, uint64_t block)
+{
+    struct wb_block *b = table_find(&dev->dirty, block);
+
+    return b ? b : table_find(&dev->inflight, block);
+}
+
+static int wb_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct wb_device *dev = userdata;
+    unsigned char *out = buf;
+    uint64_t miss_offset = offset;
+    uint32_t miss_len = 0;
+    int err = 0;
+
+    /* Runs of blocks the cache doesn't have are read from the backend in
+     * one go, without the lock. */
+    pthread_mutex_lock(&dev->lock);
+    while (len > 0 && !err)
+    {
+        uint64_t block = offset / WB_BLOCK_SIZE;
+        uint32_t inner = offset % WB_BLOCK_SIZE;
+        uint32_t n = WB_BLOCK_SIZE - inner;
+        struct wb_block *b = lookup(dev, block);
+
+        if (n > len)
+            n = len;
+        if (b && miss_len)
+        {
+            pthread_mutex_unlock(&dev->lock);
+            err = dev->inner->read(out - miss_len, miss_len, miss_offset, dev->inner_userdata);
+            pthread_mutex_lock(&dev->lock);
+            miss_len = 0;
+            /* The block may have been written back while we were out. */
+            b = lookup(dev, block);
+        }
+        if (b)
+        {
+            memcpy(out, b->data + inner, n);
+            dev->hits++;
+        }
+        else
+        {
+            if (!miss_len)
+                miss_offset = offset;
+            miss_len += n;
+        }
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    if (miss_len && !err)
+        err = dev->inner->read(out - miss_len, miss_len, miss_offset, dev->inner_userdata);
+    return err;
+}
+
+static int wb_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+    struct wb_device *dev = userdata;
+    const unsigned char *src = buf;
+    int err = 0;
+
+    pthread_mutex_lock(&dev->lock);
+    while (len > 0 && !err)
+    {
+        uint64_t block = offset / WB_BLOCK_SIZE;
+        uint32_t inner = offset % WB_BLOCK_SIZE;
+        uint32_t n = WB_BLOCK_SIZE - inner;
+        struct wb_block *b;
+
+        if (n > len)
+            n = len;
+
+        /* If the dirty set is full, let the writer take it. */
+        b = table_find(&dev->dirty, block);
+        while (!b && dev->dirty.count >= dev->capacity && !dev->error)
+        {
+            pthread_cond_signal(&dev->wake);
+            pthread_cond_wait(&dev->room, &dev->lock);
+            b = table_find(&dev->dirty, block);
+        }
+        if (!b)
+        {
+            struct wb_block *old = table_find(&dev->inflight, block);
+
+            b = malloc(sizeof(struct wb_block));
+            if (!b)
+            {
+                err = ENOMEM;
+                break;
+            }
+            b->block = block;
+            /* A partial block needs the rest of its current contents. */
+            if (n < block_length(dev, block))
+            {
+                if (old)
+                    memcpy(b->data, old->data, WB_BLOCK_SIZE);
+                else
+                    err = dev->inner->read(b->data, block_length(dev, block),
+                                           block * WB_BLOCK_SIZE, dev->inner_userdata);
+            }
+            if (err)
+            {
+                free(b);
+                break;
+            }
+            table_insert(&dev->dirty, b);
+        }
+        memcpy(b->data + inner, src, n);
+
+        src += n;
+        offset += n;
+        len -= n;
+    }
+    if (dev->dirty.count >= dev->capacity / 2)
+        pthread_cond_signal(&dev->wake);
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+/* Wait for the cycle that will pick up everything written so far. A failed
+ * write-out stays on record until a flush has reported it, since the flush
+ * is what the client checks before trusting its earlier writes. */
+static int wait_cycle(struct wb_device *dev, int sync)
+{
+    uint64_t target;
+    int err;
+
+    pthread_mutex_lock(&dev->lock);
+    target = dev->cycle + 1;
+    if (sync && dev->flush_target < target)
+        dev->flush_target = target;
+    if (!sync && dev->drain_target < target)
+        dev->drain_target = target;
+    pthread_cond_signal(&dev->wake);
+    while ((sync ? dev->durable : dev->completed) < target)
+        pthread_cond_wait(&dev->done, &dev->lock);
+    err = dev->error;
+    if (sync)
+        dev->error = 0;
+    pthread_mutex_unlock(&dev->lock);
+    return err;
+}
+
+static int wb_flush(void *userdata)
+{
+    struct wb_device *dev = userdata;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->flushes++;
+    pthread_mutex_unlock(&dev->lock);
+    return wait_cycle(dev, 1);
+}
+
+/* Cached data must not land on top of a trim or zeroing that comes after
+ * it, so write it all out first. */
+static int wb_trim(uint64_t from, uint32_t len, void *userdata)
+{
+    struct wb_device *dev = userdata;
+    int err = wait_cycle(dev, 0);
+
+    return err ? err : dev->inner->trim(from, len, dev->inner_userdata);
+}
+
+static int wb_write_zeroes(uint64_t from, uint32_t len, void *userdata)
+{
+    struct wb_device *dev = userdata;
+    int err = wait_cycle(dev, 0);
+
+    return err ? err : dev->inner->write_zeroes(from, len, dev->inner_userdata);
+}
+
+static void wb_disc(void *userdata)
+{
+    struct wb_device *dev = userdata;
+
+    wait_cycle(dev, 1);
+    pthread_mutex_lock(&dev->lock);
+    dev->stopping = 1;
+    pthread_cond_signal(&dev->wake);
+    pthread_mutex_unlock(&dev->lock);
+    pthread_join(dev->writer, NULL);
+
+    fprintf(stderr, "cache: %lu hits, %lu bytes written in %lu runs, %lu flushes in %lu syncs\n",
+            dev->hits, dev->written, dev->runs, dev->flushes, dev->syncs);
+    if (dev->inner->disc)
+        dev->inner->disc(dev->inner_userdata);
+}
+
+/* Put a write-back cache of up to `capacity' dirty bytes in front of
+ * `inner'. Its callbacks must cope with being called from the writer
+ * thread while a request is being served. */
+int wb_wrap(struct wb_device *dev, struct buse_operations *outer,
+            const struct buse_operations *inner, void *inner_userdata, uint64_t capacity)
+{
+    memset(dev, 0, sizeof(struct wb_device));
+    *outer = *inner;
+    dev->inner = inner;
+    dev->inner_userdata = inner_userdata;
+    dev->size = inner->size ? inner->size : (uint64_t)inner->blksize * inner->size_blocks;
+    dev->capacity = capacity / WB_BLOCK_SIZE;
+    if (dev->capacity < 2 || capacity / WB_BLOCK_SIZE > UINT32_MAX / 2)
+    {
+        fprintf(stderr, "The write-back cache must be between 8K and 8T\n");
+        return -1;
+    }
+    if (table_init(&dev->dirty, dev->capacity) == -1 || table_init(&dev->inflight, dev->capacity) == -1)
+        return -1;
+
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->wake, NULL);
+    pthread_cond_init(&dev->done, NULL);
+    pthread_cond_init(&dev->room, NULL);
+    if (pthread_create(&dev->writer, NULL, writer, dev))
+        return -1;
+
+    /* Reads have to look at the cache first. */
+    outer->read = wb_read;
+    outer->read_splice = NULL;
+    outer->write = wb_write;
+    outer->flush = wb_flush;
+    outer->trim = inner->trim ? wb_trim : NULL;
+    outer->write_zeroes = inner->write_zeroes ? wb_write_zeroes : NULL;
+    outer->disc = wb_disc;
+    return 0;
+}
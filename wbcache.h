@@ -0,0 +1,87 @@
+/*
+ * wbcache - write-back cache with group commit for loopback
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef WBCACHE_H_INCLUDED
+#define WBCACHE_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "buse.h"
+
+#define WB_BLOCK_SIZE 4096
+
+struct wb_block
+{
+    uint64_t block;
+    struct wb_block *next;
+    unsigned char data[WB_BLOCK_SIZE];
+};
+
+/* Blocks hashed by number, so reads can find them. */
+struct wb_table
+{
+    struct wb_block **buckets;
+    uint32_t nbuckets;
+    uint32_t count;
+};
+
+/*
+ * Writes are copied into `dirty' and acknowledged straight away. The writer
+ * thread periodically swaps `dirty' for the empty `inflight' table, sorts
+ * what it took and writes it out in runs of adjacent blocks. Each such swap
+ * is a cycle. A flush asks for the next cycle to end with a flush of the
+ * backend and waits for it, so every flush that arrives while one cycle is
+ * being written shares a single fdatasync.
+ */
+struct wb_device
+{
+    const struct buse_operations *inner;
+    void *inner_userdata;
+    uint64_t size;
+    uint32_t capacity;
+    struct wb_table dirty;
+    struct wb_table inflight;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    pthread_cond_t room;
+    pthread_t writer;
+    int stopping;
+    int error;
+    /* cycles started, finished and known durable; and the cycles flushes
+     * and trims are waiting for */
+    uint64_t cycle;
+    uint64_t completed;
+    uint64_t durable;
+    uint64_t flush_target;
+    uint64_t drain_target;
+    uint64_t hits;
+    uint64_t runs;
+    uint64_t written;
+    uint64_t flushes;
+    uint64_t syncs;
+};
+
+int wb_wrap(struct wb_device *dev, struct buse_operations *outer,
+            const struct buse_operations *inner, void *inner_userdata, uint64_t capacity);
+
+#endif /* WBCACHE_H_INCLUDED */
@@ -0,0 +1,348 @@
+/*
+ * zram - compressed memory store for busexmp
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "zram.h"
+
+/* Anything that compresses worse than this is kept raw: the slab space saved
+ * would not pay for decompressing it on every read. */
+#define ZRAM_MAX_COMPRESSED (ZRAM_BLOCK_SIZE * 3 / 4)
+
+/* Object area starts after the header, rounded to the class step. */
+#define ZRAM_SLAB_HEADER \
+  ((sizeof(struct zram_slab) + ZRAM_CLASS_STEP - 1) & ~(ZRAM_CLASS_STEP - 1))
+
+static void counter_add(uint64_t *counter, int64_t delta)
+{
+  __atomic_add_fetch(counter, delta, __ATOMIC_RELAXED);
+}
+
+static uint64_t counter_get(uint64_t *counter)
+{
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void slab_unlink(struct zram_class *cls, struct zram_slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    cls->partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static void slab_link(struct zram_class *cls, struct zram_slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = cls->partial;
+  if (cls->partial)
+    cls->partial->prev = slab;
+  cls->partial = slab;
+}
+
+static void *obj_alloc(struct zram_device *dev, uint32_t len)
+{
+  uint32_t c = (len - 1) / ZRAM_CLASS_STEP;
+  struct zram_class *cls = &dev->classes[c];
+  struct zram_slab *slab;
+  void *obj;
+
+  pthread_mutex_lock(&cls->lock);
+  slab = cls->partial;
+  if (!slab)
+  {
+    if (posix_memalign((void **)&slab, ZRAM_SLAB_SIZE, ZRAM_SLAB_SIZE))
+    {
+      pthread_mutex_unlock(&cls->lock);
+      return NULL;
+    }
+    memset(slab, 0, sizeof(struct zram_slab));
+    slab->cls = c;
+    slab_link(cls, slab);
+    counter_add(&dev->slab_bytes, ZRAM_SLAB_SIZE);
+  }
+
+  if (slab->free)
+  {
+    obj = slab->free;
+    slab->free = *(void **)obj;
+  }
+  else
+  {
+    obj = (unsigned char *)slab + ZRAM_SLAB_HEADER + slab->carved * cls->size;
+    slab->carved++;
+  }
+  slab->live++;
+  if (slab->live == cls->per_slab)
+    slab_unlink(cls, slab);
+  pthread_mutex_unlock(&cls->lock);
+  return obj;
+}
+
+static void obj_free(struct zram_device *dev, void *obj)
+{
+  struct zram_slab *slab = (struct zram_slab *)((uintptr_t)obj & ~(uintptr_t)(ZRAM_SLAB_SIZE - 1));
+  struct zram_class *cls = &dev->classes[slab->cls];
+
+  pthread_mutex_lock(&cls->lock);
+  if (slab->live == cls->per_slab)
+    slab_link(cls, slab);
+  slab->live--;
+  if (slab->live == 0)
+  {
+    slab_unlink(cls, slab);
+    free(slab);
+    counter_add(&dev->slab_bytes, -(int64_t)ZRAM_SLAB_SIZE);
+  }
+  else
+  {
+    *(void **)obj = slab->free;
+    slab->free = obj;
+  }
+  pthread_mutex_unlock(&cls->lock);
+}
+
+static pthread_mutex_t *block_lock(struct zram_device *dev, uint64_t blk)
+{
+  return &dev->locks[blk % ZRAM_LOCKS];
+}
+
+/* Callers hold the block lock. */
+static int load_block(struct zram_entry *entry, unsigned char *out)
+{
+  if (entry->len == 0)
+  {
+    memset(out, 0, ZRAM_BLOCK_SIZE);
+    return 0;
+  }
+  if (entry->len == ZRAM_BLOCK_SIZE)
+  {
+    memcpy(out, entry->obj, ZRAM_BLOCK_SIZE);
+    return 0;
+  }
+  return lz_decompress(entry->obj, entry->len, out, ZRAM_BLOCK_SIZE);
+}
+
+static void drop_block(struct zram_device *dev, struct zram_entry *entry)
+{
+  if (entry->len == 0)
+    return;
+  obj_free(dev, entry->obj);
+  counter_add(&dev->stored_blocks, -1);
+  counter_add(&dev->compr_bytes, -(int64_t)entry->len);
+  if (entry->len == ZRAM_BLOCK_SIZE)
+    counter_add(&dev->raw_blocks, -1);
+  entry->obj = NULL;
+  entry->len = 0;
+}
+
+/* Callers hold the block lock. */
+static int store_block(struct zram_device *dev, struct zram_entry *entry, const unsigned char *data)
+{
+  unsigned char packed[ZRAM_MAX_COMPRESSED];
+  const uint64_t *word = (const uint64_t *)data;
+  const unsigned char *src = packed;
+  uint32_t len;
+  void *obj;
+  size_t i;
+
+  for (i = 0; i < ZRAM_BLOCK_SIZE / sizeof(uint64_t) && !word[i]; i++)
+    ;
+  if (i == ZRAM_BLOCK_SIZE / sizeof(uint64_t))
+  {
+    drop_block(dev, entry);
+    return 0;
+  }
+
+  len = lz_compress(data, ZRAM_BLOCK_SIZE, packed, sizeof(packed));
+  if (!len)
+  {
+    len = ZRAM_BLOCK_SIZE;
+    src = data;
+  }
+
+  obj = obj_alloc(dev, len);
+  if (!obj)
+    return ENOMEM;
+  memcpy(obj, src, len);
+
+  drop_block(dev, entry);
+  entry->obj = obj;
+  entry->len = len;
+  counter_add(&dev->stored_blocks, 1);
+  counter_add(&dev->compr_bytes, len);
+  if (len == ZRAM_BLOCK_SIZE)
+    counter_add(&dev->raw_blocks, 1);
+  return 0;
+}
+
+/* Apply `len' bytes of `src' (or zeros when src is NULL) at `offset'. */
+static int update(struct zram_device *dev, const unsigned char *src, uint32_t len, uint64_t offset)
+{
+  unsigned char block[ZRAM_BLOCK_SIZE];
+
+  while (len > 0)
+  {
+    uint64_t blk = offset / ZRAM_BLOCK_SIZE;
+    uint32_t inner = offset % ZRAM_BLOCK_SIZE;
+    uint32_t n = ZRAM_BLOCK_SIZE - inner;
+    pthread_mutex_t *lock = block_lock(dev, blk);
+    int err = 0;
+
+    if (n > len)
+      n = len;
+
+    pthread_mutex_lock(lock);
+    if (n == ZRAM_BLOCK_SIZE && src)
+    {
+      err = store_block(dev, &dev->table[blk], src);
+    }
+    else
+    {
+      if (n != ZRAM_BLOCK_SIZE)
+        err = load_block(&dev->table[blk], block);
+      if (src)
+        memcpy(block + inner, src, n);
+      else
+        memset(block + inner, 0, n);
+      if (!err)
+        err = store_block(dev, &dev->table[blk], block);
+    }
+    pthread_mutex_unlock(lock);
+    if (err)
+      return err == -1 ? EIO : err;
+
+    if (src)
+      src += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int zram_init(struct zram_device *dev, uint64_t size, int debug)
+{
+  uint64_t count = (size + ZRAM_BLOCK_SIZE - 1) / ZRAM_BLOCK_SIZE;
+
+  memset(dev, 0, sizeof(struct zram_device));
+  dev->debug = debug;
+  dev->size = size;
+  dev->table = calloc(count, sizeof(struct zram_entry));
+  if (!dev->table)
+    return -1;
+
+  for (int c = 0; c < ZRAM_CLASSES; c++)
+  {
+    pthread_mutex_init(&dev->classes[c].lock, NULL);
+    dev->classes[c].size = (c + 1) * ZRAM_CLASS_STEP;
+    dev->classes[c].per_slab = (ZRAM_SLAB_SIZE - ZRAM_SLAB_HEADER) / dev->classes[c].size;
+  }
+  for (int l = 0; l < ZRAM_LOCKS; l++)
+    pthread_mutex_init(&dev->locks[l], NULL);
+  return 0;
+}
+
+int zram_read(void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct zram_device *dev = userdata;
+  unsigned char block[ZRAM_BLOCK_SIZE];
+  unsigned char *out = buf;
+
+  if (dev->debug)
+    fprintf(stderr, "R - %lu, %u\n", offset, len);
+
+  while (len > 0)
+  {
+    uint64_t blk = offset / ZRAM_BLOCK_SIZE;
+    uint32_t inner = offset % ZRAM_BLOCK_SIZE;
+    uint32_t n = ZRAM_BLOCK_SIZE - inner;
+    pthread_mutex_t *lock = block_lock(dev, blk);
+    int err;
+
+    if (n > len)
+      n = len;
+
+    pthread_mutex_lock(lock);
+    if (n == ZRAM_BLOCK_SIZE)
+    {
+      err = load_block(&dev->table[blk], out);
+    }
+    else
+    {
+      err = load_block(&dev->table[blk], block);
+      memcpy(out, block + inner, n);
+    }
+    pthread_mutex_unlock(lock);
+    if (err)
+      return EIO;
+
+    out += n;
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int zram_write(const void *buf, uint32_t len, uint64_t offset, void *userdata)
+{
+  struct zram_device *dev = userdata;
+
+  if (dev->debug)
+    fprintf(stderr, "W - %lu, %u\n", offset, len);
+  return update(dev, buf, len, offset);
+}
+
+int zram_trim(uint64_t from, uint32_t len, void *userdata)
+{
+  struct zram_device *dev = userdata;
+
+  if (dev->debug)
+    fprintf(stderr, "T - %lu, %u\n", from, len);
+  return update(dev, NULL, len, from);
+}
+
+void zram_disc(void *userdata)
+{
+  struct zram_device *dev = userdata;
+
+  fprintf(stderr, "Received a disconnect request.\n");
+  zram_print_stats(stderr, dev);
+}
+
+void zram_print_stats(FILE *out, struct zram_device *dev)
+{
+  uint64_t orig = counter_get(&dev->stored_blocks) * ZRAM_BLOCK_SIZE;
+  uint64_t compr = counter_get(&dev->compr_bytes);
+  uint64_t used = counter_get(&dev->slab_bytes);
+  uint64_t table = dev->size / ZRAM_BLOCK_SIZE * sizeof(struct zram_entry);
+
+  fprintf(out, "zram: orig %lu compr %lu mem_used %lu (+%lu table) raw_blocks %lu\n",
+          orig, compr, used, table, counter_get(&dev->raw_blocks));
+  if (used)
+    fprintf(out, "zram: compression ratio %.2f, effective %.2f\n",
+            (double)orig / compr, (double)orig / used);
+}
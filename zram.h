@@ -0,0 +1,84 @@
+/*
+ * zram - compressed memory store for busexmp
+ * Copyright (C) 2017 Sean Mollet
+ *
+ * This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef ZRAM_H_INCLUDED
+#define ZRAM_H_INCLUDED
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ZRAM_BLOCK_SIZE 4096
+#define ZRAM_SLAB_SIZE (64 * 1024)
+#define ZRAM_CLASS_STEP 32
+#define ZRAM_CLASSES (ZRAM_BLOCK_SIZE / ZRAM_CLASS_STEP)
+#define ZRAM_LOCKS 1024
+
+/* A 64K chunk carved into equal objects of one size class. The header lives
+ * at the start of the chunk, so an object finds its slab by masking. */
+struct zram_slab
+{
+  struct zram_slab *prev;
+  struct zram_slab *next;
+  void *free;
+  uint32_t carved;
+  uint32_t live;
+  uint32_t cls;
+};
+
+struct zram_class
+{
+  pthread_mutex_t lock;
+  uint32_t size;
+  uint32_t per_slab;
+  // slabs with at least one free object
+  struct zram_slab *partial;
+};
+
+/* len is 0 for a block that reads as zeros and ZRAM_BLOCK_SIZE for one that
+ * didn't compress and is stored raw. */
+struct zram_entry
+{
+  void *obj;
+  uint32_t len;
+};
+
+struct zram_device
+{
+  uint64_t size;
+  struct zram_entry *table;
+  struct zram_class classes[ZRAM_CLASSES];
+  // per block locks, striped by block number
+  pthread_mutex_t locks[ZRAM_LOCKS];
+  uint64_t stored_blocks;
+  uint64_t raw_blocks;
+  uint64_t compr_bytes;
+  uint64_t slab_bytes;
+  int debug;
+};
+
+int zram_init(struct zram_device *dev, uint64_t size, int debug);
+int zram_read(void *buf, uint32_t len, uint64_t offset, void *userdata);
+int zram_write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
+int zram_trim(uint64_t from, uint32_t len, void *userdata);
+void zram_disc(void *userdata);
+void zram_print_stats(FILE *out, struct zram_device *dev);
+
+#endif /* ZRAM_H_INCLUDED */